@@ -0,0 +1,592 @@
+/*
+ * Compare benchmark results against a stored baseline.
+ *
+ * Both sides are VFIO_RESULTS JSON Lines files (see vfio-bench.h).
+ * Records are grouped by test, phase and parameters, every record of a
+ * group being one sample, and for each group the throughput (ops/s) and
+ * p99 latency are compared: median change, a bootstrap 95% confidence
+ * interval on the ratio of medians and a two sided Mann-Whitney U test.
+ * A metric is flagged as a regression when its median moves the wrong
+ * way by more than the threshold and the difference is significant.
+ * With too few samples for the test to mean anything the threshold alone
+ * decides, which is noted in the report.
+ *
+ * Grouping relies on params holding only the configuration a record was
+ * measured under, with measurements in "extra" which isn't looked at.  A
+ * baseline group with no candidate records means a test put something
+ * run dependent in params (or wasn't run), and fails the comparison
+ * rather than being passed over.
+ *
+ * In run mode the candidate is produced by running the benchmark command
+ * the given number of times with VFIO_RESULTS pointed at a temporary
+ * file, which is kept so it can serve as the next baseline.
+ *
+ * Exits 1 if anything regressed, 0 otherwise, and -1 (255) on errors
+ * and unmatched baseline groups.
+ *
+ * Build: cc -o vfio-bench-compare vfio-bench-compare.c -lm
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MIN_SAMPLES	4	/* Below this Mann-Whitney can't reach p < .05 */
+#define ALPHA		0.05
+#define BOOTSTRAP	2000
+
+enum {
+	M_THROUGHPUT,
+	M_P99,
+	M_NR_METRICS,
+};
+
+static const struct {
+	const char *name;
+	const char *unit;
+	int higher_better;
+} metrics[M_NR_METRICS] = {
+	[M_THROUGHPUT]	= { "ops/s", "", 1 },
+	[M_P99]		= { "p99", "ns", 0 },
+};
+
+struct samples {
+	double *v;
+	int n, max;
+};
+
+struct group {
+	char key[512];
+	struct samples s[2][M_NR_METRICS];	/* baseline, candidate */
+};
+
+static struct group *groups;
+static int nr_groups, max_groups;
+
+void usage(char *name)
+{
+	printf("usage: %s <baseline> <threshold %%> <candidate>\n", name);
+	printf("       %s <baseline> <threshold %%> run <runs> <command> [args...]\n",
+	       name);
+	printf("\tbaseline:  VFIO_RESULTS file from a known good kernel\n");
+	printf("\tthreshold: regression threshold in percent, ex. 5\n");
+	printf("\tcandidate: VFIO_RESULTS file to compare\n");
+	printf("\truns:      times to run the command for the candidate\n");
+}
+
+static int samples_add(struct samples *s, double v)
+{
+	if (s->n == s->max) {
+		int max = s->max ? s->max * 2 : 16;
+		double *tmp = realloc(s->v, max * sizeof(*tmp));
+
+		if (!tmp)
+			return -1;
+
+		s->v = tmp;
+		s->max = max;
+	}
+
+	s->v[s->n++] = v;
+	return 0;
+}
+
+static struct group *group_get(const char *key)
+{
+	int i;
+
+	for (i = 0; i < nr_groups; i++)
+		if (!strcmp(groups[i].key, key))
+			return &groups[i];
+
+	if (nr_groups == max_groups) {
+		int max = max_groups ? max_groups * 2 : 32;
+		struct group *tmp = realloc(groups, max * sizeof(*tmp));
+
+		if (!tmp)
+			return NULL;
+
+		groups = tmp;
+		max_groups = max;
+	}
+
+	memset(&groups[nr_groups], 0, sizeof(groups[0]));
+	snprintf(groups[nr_groups].key, sizeof(groups[0].key), "%s", key);
+	return &groups[nr_groups++];
+}
+
+/*
+ * Just enough JSON to pick members out of our own records: skip over a
+ * value, find a member of an object, read a string or number.
+ */
+static const char *json_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+static const char *json_skip(const char *p)
+{
+	int depth = 0;
+
+	p = json_ws(p);
+	do {
+		switch (*p) {
+		case 0:
+			return NULL;
+		case '"':
+			for (p++; *p && *p != '"'; p++)
+				if (*p == '\\' && p[1])
+					p++;
+			if (!*p)
+				return NULL;
+			p++;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			p++;
+			break;
+		case '}':
+		case ']':
+			if (!depth)
+				return p;
+			depth--;
+			p++;
+			break;
+		case ',':
+		case ':':
+			if (!depth)
+				return p;
+			p++;
+			break;
+		default:
+			/* Number or literal */
+			while (*p && !strchr(",:{}[]\" \t\r\n", *p))
+				p++;
+			if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				p = json_ws(p);
+		}
+	} while (depth);
+
+	return p;
+}
+
+static const char *json_member(const char *obj, const char *key)
+{
+	size_t len = strlen(key);
+	const char *p = json_ws(obj);
+
+	if (*p++ != '{')
+		return NULL;
+
+	for (;;) {
+		const char *name;
+
+		p = json_ws(p);
+		if (*p != '"')
+			return NULL;
+
+		name = p + 1;
+		p = json_skip(p);
+		if (!p)
+			return NULL;
+
+		p = json_ws(p);
+		if (*p++ != ':')
+			return NULL;
+
+		if (p - name - 2 == len && !strncmp(name, key, len))
+			return json_ws(p);
+
+		p = json_skip(p);
+		if (!p)
+			return NULL;
+
+		p = json_ws(p);
+		if (*p++ != ',')
+			return NULL;
+	}
+}
+
+static int json_str(const char *val, char *buf, size_t len)
+{
+	size_t i = 0;
+
+	if (!val || *val++ != '"')
+		return -1;
+
+	for (; *val && *val != '"' && i < len - 1; val++) {
+		if (*val == '\\' && val[1])
+			val++;
+		buf[i++] = *val;
+	}
+
+	buf[i] = 0;
+	return 0;
+}
+
+static int json_num(const char *val, double *num)
+{
+	char *end;
+
+	if (!val)
+		return -1;
+
+	*num = strtod(val, &end);
+	return end == val ? -1 : 0;
+}
+
+static int load_results(const char *path, int side)
+{
+	char test[64], phase[64], key[512], *line = NULL;
+	const char *params, *end, *lat;
+	double ops, wall, p99;
+	int records = 0, lineno = 0;
+	struct group *group;
+	size_t len = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		lineno++;
+		if (*json_ws(line) == 0)
+			continue;
+
+		params = json_member(line, "params");
+		end = params ? json_skip(params) : NULL;
+
+		if (json_str(json_member(line, "test"), test, sizeof(test)) ||
+		    json_str(json_member(line, "phase"), phase, sizeof(phase)) ||
+		    !end || json_num(json_member(line, "ops"), &ops) ||
+		    json_num(json_member(line, "wall_ns"), &wall)) {
+			printf("%s:%d: not a results record, skipped\n",
+			       path, lineno);
+			continue;
+		}
+
+		snprintf(key, sizeof(key), "%s %s %.*s", test, phase,
+			 (int)(end - params), params);
+
+		group = group_get(key);
+		if (!group)
+			goto enomem;
+
+		if (wall > 0 &&
+		    samples_add(&group->s[side][M_THROUGHPUT], ops * 1e9 / wall))
+			goto enomem;
+
+		lat = json_member(line, "lat_ns");
+		if (lat && !json_num(json_member(lat, "p99"), &p99) &&
+		    samples_add(&group->s[side][M_P99], p99))
+			goto enomem;
+
+		records++;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!records) {
+		printf("No results records in %s\n", path);
+		return -1;
+	}
+
+	return records;
+
+enomem:
+	printf("Out of memory loading %s\n", path);
+	free(line);
+	fclose(f);
+	return -1;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts v */
+static double median(double *v, int n)
+{
+	qsort(v, n, sizeof(*v), double_cmp);
+	return n & 1 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* xorshift, seeded so reports are reproducible */
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int rng(unsigned int range)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % range;
+}
+
+/* 95% bootstrap percentile interval on median(b) / median(a) */
+static int bootstrap_ci(struct samples *a, struct samples *b,
+			double *lo, double *hi)
+{
+	double *ratios, *ra, *rb;
+	int i, j, ret = -1;
+
+	ratios = malloc(BOOTSTRAP * sizeof(*ratios));
+	ra = malloc(a->n * sizeof(*ra));
+	rb = malloc(b->n * sizeof(*rb));
+	if (!ratios || !ra || !rb)
+		goto out;
+
+	for (i = 0; i < BOOTSTRAP; i++) {
+		double ma;
+
+		for (j = 0; j < a->n; j++)
+			ra[j] = a->v[rng(a->n)];
+		for (j = 0; j < b->n; j++)
+			rb[j] = b->v[rng(b->n)];
+
+		ma = median(ra, a->n);
+		ratios[i] = ma ? median(rb, b->n) / ma : 1;
+	}
+
+	qsort(ratios, BOOTSTRAP, sizeof(*ratios), double_cmp);
+	*lo = ratios[BOOTSTRAP * 25 / 1000];
+	*hi = ratios[BOOTSTRAP * 975 / 1000 - 1];
+	ret = 0;
+out:
+	free(ratios);
+	free(ra);
+	free(rb);
+	return ret;
+}
+
+struct rank {
+	double v;
+	int side;
+};
+
+static int rank_cmp(const void *a, const void *b)
+{
+	return double_cmp(&((const struct rank *)a)->v,
+			  &((const struct rank *)b)->v);
+}
+
+/*
+ * Two sided Mann-Whitney U, normal approximation with tie and continuity
+ * correction.  Returns the p-value, or -1 on failure.
+ */
+static double mann_whitney(struct samples *a, struct samples *b)
+{
+	int i, j, n = a->n + b->n;
+	double r1 = 0, ties = 0, u, mu, sigma, z;
+	struct rank *r;
+
+	r = malloc(n * sizeof(*r));
+	if (!r)
+		return -1;
+
+	for (i = 0; i < a->n; i++)
+		r[i] = (struct rank){ a->v[i], 0 };
+	for (i = 0; i < b->n; i++)
+		r[a->n + i] = (struct rank){ b->v[i], 1 };
+
+	qsort(r, n, sizeof(*r), rank_cmp);
+
+	for (i = 0; i < n; i = j) {
+		double t, rank;
+
+		for (j = i + 1; j < n && r[j].v == r[i].v; j++)
+			;
+
+		/* Tied values share the average of ranks i+1..j */
+		t = j - i;
+		rank = (i + 1 + j) / 2.0;
+		ties += t * t * t - t;
+
+		for (; i < j; i++)
+			if (!r[i].side)
+				r1 += rank;
+	}
+
+	free(r);
+
+	u = r1 - a->n * (a->n + 1) / 2.0;
+	mu = a->n * (double)b->n / 2;
+	sigma = sqrt(a->n * (double)b->n / 12 *
+		     ((n + 1) - ties / ((double)n * (n - 1))));
+	if (sigma == 0)
+		return 1;
+
+	z = fabs(u - mu);
+	z = z > 0.5 ? (z - 0.5) / sigma : 0;
+	return erfc(z / sqrt(2));
+}
+
+/* Returns 1 if the metric regressed */
+static int compare_metric(struct group *group, int m, double threshold)
+{
+	struct samples *a = &group->s[0][m], *b = &group->s[1][m];
+	double ma, mb, change, lo = 1, hi = 1, p = -1, bad;
+	int tested = a->n >= MIN_SAMPLES && b->n >= MIN_SAMPLES;
+	int regressed;
+
+	if (!a->n && !b->n)
+		return 0;
+
+	printf("  %-7s", metrics[m].name);
+
+	if (!a->n || !b->n) {
+		printf(" %s\n", a->n ? "missing from candidate" : "new");
+		return 0;
+	}
+
+	ma = median(a->v, a->n);
+	mb = median(b->v, b->n);
+	change = ma ? (mb / ma - 1) * 100 : 0;
+	bad = metrics[m].higher_better ? -change : change;
+
+	printf(" %12.0f%-2s -> %12.0f%-2s %+7.1f%%", ma, metrics[m].unit,
+	       mb, metrics[m].unit, change);
+
+	if (tested) {
+		bootstrap_ci(a, b, &lo, &hi);
+		p = mann_whitney(a, b);
+		printf(" [%+.1f%%, %+.1f%%] p=%.3f", (lo - 1) * 100,
+		       (hi - 1) * 100, p);
+	} else {
+		printf(" (n=%d/%d, no test)", a->n, b->n);
+	}
+
+	regressed = bad > threshold && (!tested || (p >= 0 && p < ALPHA));
+
+	if (regressed)
+		printf("  REGRESSION\n");
+	else if (-bad > threshold && tested && p >= 0 && p < ALPHA)
+		printf("  improved\n");
+	else
+		printf("\n");
+
+	return regressed;
+}
+
+static char *run_candidate(int runs, char **argv)
+{
+	static char path[] = "/tmp/vfio-results-XXXXXX";
+	int fd, i, status;
+	pid_t pid;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("Failed to create results file (%s)\n", strerror(errno));
+		return NULL;
+	}
+	close(fd);
+
+	if (setenv("VFIO_RESULTS", path, 1))
+		return NULL;
+
+	for (i = 0; i < runs; i++) {
+		printf("Run %d/%d: %s\n", i + 1, runs, argv[0]);
+		fflush(stdout);
+
+		pid = fork();
+		if (pid < 0) {
+			printf("Failed to fork (%s)\n", strerror(errno));
+			return NULL;
+		}
+
+		if (!pid) {
+			execvp(argv[0], argv);
+			printf("Failed to exec %s (%s)\n",
+			       argv[0], strerror(errno));
+			_exit(127);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			printf("Run %d of %s failed, not comparing\n",
+			       i + 1, argv[0]);
+			return NULL;
+		}
+	}
+
+	printf("Candidate results in %s\n", path);
+	return path;
+}
+
+int main(int argc, char **argv)
+{
+	int i, m, runs, regressions = 0, compared = 0, missing = 0;
+	char *candidate;
+	double threshold;
+
+	if (argc < 4 || sscanf(argv[2], "%lf", &threshold) != 1 ||
+	    threshold < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (!strcmp(argv[3], "run")) {
+		if (argc < 6 || sscanf(argv[4], "%d", &runs) != 1 || runs < 1) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		candidate = run_candidate(runs, &argv[5]);
+		if (!candidate)
+			return -1;
+	} else if (argc == 4) {
+		candidate = argv[3];
+	} else {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (load_results(argv[1], 0) < 0 || load_results(candidate, 1) < 0)
+		return -1;
+
+	printf("Baseline %s, candidate %s, threshold %.1f%%\n",
+	       argv[1], candidate, threshold);
+
+	for (i = 0; i < nr_groups; i++) {
+		printf("%s\n", groups[i].key);
+
+		for (m = 0; m < M_NR_METRICS; m++) {
+			if (groups[i].s[0][m].n && groups[i].s[1][m].n)
+				compared++;
+			regressions += compare_metric(&groups[i], m, threshold);
+		}
+
+		if (groups[i].s[0][M_THROUGHPUT].n &&
+		    !groups[i].s[1][M_THROUGHPUT].n)
+			missing++;
+	}
+
+	if (!compared) {
+		printf("Nothing in common between baseline and candidate\n");
+		return -1;
+	}
+
+	printf("%d of %d metrics regressed by more than %.1f%%\n",
+	       regressions, compared, threshold);
+
+	if (missing) {
+		printf("%d baseline groups have no match in the candidate, "
+		       "are their params configuration only?\n", missing);
+		return -1;
+	}
+
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,991 @@
+/*
+ * Timing, latency, perf counter and results helpers shared by the
+ * benchmark modes of the tests.
+ *
+ * Everything here is static inline so a test can include it and stay a
+ * single "cc -o foo foo.c" build like the rest of the tree.  Include it
+ * after the VFIO uapi definitions (embedded copy or <linux/vfio.h>).
+ */
+#ifndef VFIO_BENCH_H
+#define VFIO_BENCH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include <linux/perf_event.h>
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A growable set of latency samples in nanoseconds.  Percentiles are
+ * computed by sorting the samples in place, so only ask for them once
+ * the measurement is done.
+ */
+struct lat_stats {
+	unsigned long long *ns;
+	unsigned long count, max;
+	int sorted;
+};
+
+static inline int lat_add(struct lat_stats *lat, unsigned long long ns)
+{
+	if (lat->count == lat->max) {
+		unsigned long max = lat->max ? lat->max * 2 : 1024;
+		unsigned long long *tmp;
+
+		tmp = realloc(lat->ns, max * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+
+		lat->ns = tmp;
+		lat->max = max;
+	}
+
+	lat->ns[lat->count++] = ns;
+	lat->sorted = 0;
+	return 0;
+}
+
+static inline int lat_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(unsigned long long *)a;
+	unsigned long long y = *(unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pct is 0-100, nearest-rank */
+static inline unsigned long long lat_pct(struct lat_stats *lat, double pct)
+{
+	unsigned long rank;
+
+	if (!lat->count)
+		return 0;
+
+	if (!lat->sorted) {
+		qsort(lat->ns, lat->count, sizeof(*lat->ns), lat_cmp);
+		lat->sorted = 1;
+	}
+
+	rank = (unsigned long)(pct / 100 * lat->count + 0.5);
+	if (rank)
+		rank--;
+	if (rank >= lat->count)
+		rank = lat->count - 1;
+
+	return lat->ns[rank];
+}
+
+static inline unsigned long long lat_sum(struct lat_stats *lat)
+{
+	unsigned long long sum = 0;
+	unsigned long i;
+
+	for (i = 0; i < lat->count; i++)
+		sum += lat->ns[i];
+
+	return sum;
+}
+
+static inline void lat_print(const char *name, struct lat_stats *lat)
+{
+	if (!lat->count) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	printf("%s: n %lu, avg %llu, p50 %llu, p90 %llu, p99 %llu, "
+	       "max %llu (ns)\n", name, lat->count,
+	       lat_sum(lat) / lat->count, lat_pct(lat, 50), lat_pct(lat, 90),
+	       lat_pct(lat, 99), lat_pct(lat, 100));
+}
+
+static inline void lat_reset(struct lat_stats *lat)
+{
+	lat->count = 0;
+	lat->sorted = 0;
+}
+
+static inline void lat_free(struct lat_stats *lat)
+{
+	free(lat->ns);
+	memset(lat, 0, sizeof(*lat));
+}
+
+/*
+ * Value of a "field: value" or "field value" line, as in /proc/meminfo,
+ * /proc/self/status or /proc/vmstat.  -1 if missing.
+ */
+static inline long long proc_field(const char *path, const char *field)
+{
+	size_t len = strlen(field);
+	long long val = -1;
+	char line[256];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, field, len) &&
+		    (line[len] == ':' || line[len] == ' ')) {
+			sscanf(line + len + 1, "%lld", &val);
+			break;
+		}
+	}
+
+	fclose(f);
+	return val;
+}
+
+/* kB value of a /proc/self/status field (VmLck, VmPin...), -1 if missing */
+static inline long status_kb(const char *field)
+{
+	return proc_field("/proc/self/status", field);
+}
+
+/*
+ * perf_event counters around a measured phase.  The hardware counters
+ * are opened as two groups, one counting only user mode and one only
+ * kernel mode, so a phase shows whether its cost is in the ioctl path or
+ * in our own loop.  Software events are attributed by the context they
+ * fire in (a context switch is always "kernel"), so they get a third
+ * group without any mode exclusion.  Counters the host can't provide
+ * (ex. no PMU in a VM, perf_event_paranoid) are just reported missing.
+ */
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_NR_HW,
+	PERF_CTX_SWITCHES = PERF_NR_HW,
+	PERF_PAGE_FAULTS,
+	PERF_NR_COUNTERS
+};
+
+enum {
+	PERF_USER,
+	PERF_KERNEL,
+	PERF_ALL,	/* software events */
+	PERF_NR_MODES
+};
+
+static const struct {
+	const char *name;
+	__u32 type;
+	__u64 config;
+} perf_events[PERF_NR_COUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "dTLB-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "ctx-sw", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct perf_counters {
+	int enabled;
+	int fd[PERF_NR_MODES][PERF_NR_COUNTERS];
+	unsigned long long val[PERF_NR_MODES][PERF_NR_COUNTERS];
+};
+
+static inline int perf_open_one(int counter, int mode, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[counter].type;
+	attr.config = perf_events[counter].config;
+	attr.disabled = group_fd < 0;
+	attr.exclude_kernel = mode == PERF_USER;
+	attr.exclude_user = mode == PERF_KERNEL;
+	attr.exclude_hv = 1;
+	attr.inherit = 0;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+
+	/* This thread, any CPU */
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static inline int perf_init(struct perf_counters *pc)
+{
+	int mode, i, first, last, leader, opened = 0;
+
+	memset(pc, 0, sizeof(*pc));
+
+	for (mode = 0; mode < PERF_NR_MODES; mode++) {
+		first = mode == PERF_ALL ? PERF_NR_HW : 0;
+		last = mode == PERF_ALL ? PERF_NR_COUNTERS : PERF_NR_HW;
+		leader = -1;
+
+		for (i = 0; i < PERF_NR_COUNTERS; i++)
+			pc->fd[mode][i] = -1;
+
+		for (i = first; i < last; i++) {
+			pc->fd[mode][i] = perf_open_one(i, mode, leader);
+			if (pc->fd[mode][i] < 0)
+				continue;
+
+			if (leader < 0)
+				leader = pc->fd[mode][i];
+			opened++;
+		}
+	}
+
+	if (!opened) {
+		printf("perf: no counters available (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	pc->enabled = 1;
+	return 0;
+}
+
+static inline int perf_leader(struct perf_counters *pc, int mode)
+{
+	int i;
+
+	for (i = 0; i < PERF_NR_COUNTERS; i++)
+		if (pc->fd[mode][i] >= 0)
+			return pc->fd[mode][i];
+
+	return -1;
+}
+
+static inline void perf_start(struct perf_counters *pc)
+{
+	int mode, fd;
+
+	if (!pc->enabled)
+		return;
+
+	for (mode = 0; mode < PERF_NR_MODES; mode++) {
+		fd = perf_leader(pc, mode);
+		if (fd < 0)
+			continue;
+
+		ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+/* Adds the counts since perf_start() to pc->val */
+static inline void perf_stop(struct perf_counters *pc)
+{
+	struct {
+		__u64 nr;
+		struct {
+			__u64 value, id;
+		} values[PERF_NR_COUNTERS];
+	} data;
+	__u64 id;
+	int mode, i, j, fd;
+
+	if (!pc->enabled)
+		return;
+
+	for (mode = 0; mode < PERF_NR_MODES; mode++) {
+		fd = perf_leader(pc, mode);
+		if (fd < 0)
+			continue;
+
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		if (read(fd, &data, sizeof(data)) <= 0)
+			continue;
+
+		for (i = 0; i < PERF_NR_COUNTERS; i++) {
+			if (pc->fd[mode][i] < 0 ||
+			    ioctl(pc->fd[mode][i], PERF_EVENT_IOC_ID, &id))
+				continue;
+
+			for (j = 0; j < data.nr && j < PERF_NR_COUNTERS; j++)
+				if (data.values[j].id == id)
+					pc->val[mode][i] += data.values[j].value;
+		}
+	}
+}
+
+static inline void perf_clear(struct perf_counters *pc)
+{
+	memset(pc->val, 0, sizeof(pc->val));
+}
+
+static inline void perf_print(struct perf_counters *pc, const char *phase,
+			      unsigned long ops)
+{
+	int i;
+
+	if (!pc->enabled || !ops)
+		return;
+
+	printf("%s perf per op (%lu ops):", phase, ops);
+
+	for (i = 0; i < PERF_NR_HW; i++) {
+		if (pc->fd[PERF_USER][i] < 0 && pc->fd[PERF_KERNEL][i] < 0) {
+			printf(" %s n/a", perf_events[i].name);
+			continue;
+		}
+
+		printf(" %s u/k %.1f/%.1f", perf_events[i].name,
+		       (double)pc->val[PERF_USER][i] / ops,
+		       (double)pc->val[PERF_KERNEL][i] / ops);
+	}
+
+	for (i = PERF_NR_HW; i < PERF_NR_COUNTERS; i++) {
+		if (pc->fd[PERF_ALL][i] < 0)
+			printf(" %s n/a", perf_events[i].name);
+		else
+			printf(" %s %.3f", perf_events[i].name,
+			       (double)pc->val[PERF_ALL][i] / ops);
+	}
+
+	printf("\n");
+}
+
+/*
+ * IOMMU model selection.  TYPE1v2 differs from TYPE1 in rejecting unmaps
+ * that would split an existing mapping, where TYPE1 unmaps whatever
+ * overlaps.  Tests take a trailing "type1" or "type1v2" argument, and a
+ * matrix mode runs the workload under both, moving the group to a fresh
+ * container in between.
+ */
+#ifndef VFIO_TYPE1v2_IOMMU
+#define VFIO_TYPE1v2_IOMMU	3
+#endif
+
+static inline const char *iommu_model_name(int type)
+{
+	switch (type) {
+	case VFIO_TYPE1_IOMMU:
+		return "TYPE1";
+	case VFIO_TYPE1v2_IOMMU:
+		return "TYPE1v2";
+	}
+
+	return "unknown";
+}
+
+/* Strip a trailing model argument, TYPE1 if there isn't one */
+static inline int iommu_model_arg(int *argc, char **argv)
+{
+	int type = VFIO_TYPE1_IOMMU;
+
+	if (*argc < 3)
+		return type;
+
+	if (!strcmp(argv[*argc - 1], "type1v2"))
+		type = VFIO_TYPE1v2_IOMMU;
+	else if (strcmp(argv[*argc - 1], "type1"))
+		return type;
+
+	(*argc)--;
+	return type;
+}
+
+/* Open a group, attach it to a new container of the given model */
+static inline int open_container(int groupid, int type)
+{
+	struct vfio_group_status group_status = {
+		.argsz = sizeof(group_status)
+	};
+	int container, group;
+	char path[50];
+
+	container = open("/dev/vfio/vfio", O_RDWR);
+	if (container < 0) {
+		printf("Failed to open /dev/vfio/vfio, %d (%s)\n",
+		       container, strerror(errno));
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
+	group = open(path, O_RDWR);
+	if (group < 0) {
+		printf("Failed to open %s, %d (%s)\n",
+		       path, group, strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(group, VFIO_GROUP_GET_STATUS, &group_status)) {
+		printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
+		return -1;
+	}
+
+	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		printf("Group %d not viable, are all devices attached to vfio?\n",
+		       groupid);
+		return -1;
+	}
+
+	if (ioctl(group, VFIO_GROUP_SET_CONTAINER, &container)) {
+		printf("Failed to set group container\n");
+		return -1;
+	}
+
+	if (ioctl(container, VFIO_SET_IOMMU, type)) {
+		printf("Failed to set IOMMU\n");
+		return -1;
+	}
+
+	return container;
+}
+
+/*
+ * Largest usable iova range of the container, inclusive.  Returns -1 and
+ * leaves start and end alone if it doesn't say, so they can be preset to
+ * the default.
+ */
+static inline int iova_range(int container, __u64 *start, __u64 *end)
+{
+#ifdef VFIO_IOMMU_TYPE1_INFO_CAP_IOVA_RANGE
+	struct vfio_iommu_type1_info_cap_iova_range *cap;
+	struct vfio_iommu_type1_info *info;
+	struct vfio_info_cap_header *hdr;
+	struct vfio_iova_range *r;
+	char buf[4096];
+	int found = 0;
+	__u32 off, i;
+
+	memset(buf, 0, sizeof(buf));
+	info = (struct vfio_iommu_type1_info *)buf;
+	info->argsz = sizeof(buf);
+
+	if (ioctl(container, VFIO_IOMMU_GET_INFO, info) ||
+	    !(info->flags & VFIO_IOMMU_INFO_CAPS) || info->argsz > sizeof(buf))
+		return -1;
+
+	for (off = info->cap_offset; off && off + sizeof(*hdr) <= sizeof(buf);
+	     off = hdr->next) {
+		hdr = (struct vfio_info_cap_header *)(buf + off);
+		if (hdr->id != VFIO_IOMMU_TYPE1_INFO_CAP_IOVA_RANGE)
+			continue;
+
+		cap = (struct vfio_iommu_type1_info_cap_iova_range *)hdr;
+		for (i = 0; i < cap->nr_iovas &&
+		     (char *)&cap->iova_ranges[i + 1] <= buf + sizeof(buf); i++) {
+			r = &cap->iova_ranges[i];
+			if (!found || r->end - r->start > *end - *start) {
+				*start = r->start;
+				*end = r->end;
+				found = 1;
+			}
+		}
+	}
+
+	if (found)
+		return 0;
+#endif
+	return -1;
+}
+
+/* Returns the new container, the old one is closed, or -1 */
+static inline int iommu_container_switch(int group, int container, int type)
+{
+	int new;
+
+	new = open("/dev/vfio/vfio", O_RDWR);
+	if (new < 0)
+		return -1;
+
+	if (ioctl(new, VFIO_CHECK_EXTENSION, type) <= 0) {
+		close(new);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (ioctl(group, VFIO_GROUP_UNSET_CONTAINER) ||
+	    ioctl(group, VFIO_GROUP_SET_CONTAINER, &new) ||
+	    ioctl(new, VFIO_SET_IOMMU, type)) {
+		close(new);
+		return -1;
+	}
+
+	close(container);
+	return new;
+}
+
+/*
+ * Map two pages as one mapping at iova and try to unmap the first.
+ * Type1 removes the whole mapping and reports the size it unmapped, v2
+ * fails with EINVAL rather than split a mapping.  Returns 1 if the unmap
+ * was allowed, 0 if it was rejected, -1 on error with errno set.
+ * Nothing is left mapped.
+ */
+static inline int iommu_split_unmap_probe(int container, int type, __u64 iova)
+{
+	long page = getpagesize();
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.iova = iova,
+		.size = 2 * page,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = iova,
+		.size = page,
+	};
+	int ret, err;
+	void *buf;
+
+	buf = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	dma_map.vaddr = (unsigned long)buf;
+	if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+		err = errno;
+		munmap(buf, 2 * page);
+		errno = err;
+		return -1;
+	}
+
+	ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	err = errno;
+	if (!ret) {
+		ret = 1;
+		if (dma_unmap.size < page) {
+			ret = -1;
+			err = EIO;
+		}
+	} else if (err == EINVAL && type == VFIO_TYPE1v2_IOMMU) {
+		ret = 0;
+	} else {
+		ret = -1;
+	}
+
+	dma_unmap.size = 2 * page;
+	ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	munmap(buf, 2 * page);
+	errno = err;
+	return ret;
+}
+
+/* Side by side rows for the model matrix */
+static inline void matrix_header(const char *a, const char *b)
+{
+	printf("%-20s %14s %14s %8s\n", "", a, b, "change");
+}
+
+static inline void matrix_row(const char *name, double a, double b)
+{
+	printf("%-20s %14.0f %14.0f %+7.1f%%\n", name, a, b,
+	       a ? (b / a - 1) * 100 : 0);
+}
+
+/* ops/s over the sampled time, then median and tail latency */
+static inline void matrix_lat(const char *name, struct lat_stats *a,
+			      struct lat_stats *b)
+{
+	char row[64];
+
+	snprintf(row, sizeof(row), "%s ops/s", name);
+	matrix_row(row, a->count ? a->count * 1e9 / lat_sum(a) : 0,
+		   b->count ? b->count * 1e9 / lat_sum(b) : 0);
+	snprintf(row, sizeof(row), "%s p50 ns", name);
+	matrix_row(row, lat_pct(a, 50), lat_pct(b, 50));
+	snprintf(row, sizeof(row), "%s p99 ns", name);
+	matrix_row(row, lat_pct(a, 99), lat_pct(b, 99));
+	snprintf(row, sizeof(row), "%s max ns", name);
+	matrix_row(row, lat_pct(a, 100), lat_pct(b, 100));
+}
+
+/*
+ * Host memory a phase costs the kernel.  A snapshot takes the process's
+ * page tables and pinned/locked memory from /proc/self/status, free
+ * memory and CPU/secondary (IOMMU, KVM) page tables from /proc/meminfo,
+ * and the slab caches that hold VFIO and IOMMU metadata from
+ * /proc/slabinfo (root only).  vfio_dma and vfio_pfn come from kmalloc,
+ * so those caches are summed as one "kmalloc-*" entry.
+ */
+#define MEM_SLABS_MAX	32
+
+struct mem_slab {
+	char name[64];
+	long long bytes;
+};
+
+struct mem_snapshot {
+	long vmpte, vmpin, vmlck;
+	long long memfree, pagetables, secpagetables;
+	int nr_slabs;		/* -1 without /proc/slabinfo */
+	struct mem_slab slabs[MEM_SLABS_MAX];
+};
+
+static inline int mem_slab_wanted(const char *name)
+{
+	return strstr(name, "iommu") || strstr(name, "dmar") ||
+	       strstr(name, "vfio") || strstr(name, "iova") ||
+	       strstr(name, "pgtable") || !strncmp(name, "kmalloc-", 8);
+}
+
+static inline long long mem_slab_bytes(struct mem_snapshot *m,
+				       const char *name)
+{
+	int i;
+
+	for (i = 0; i < m->nr_slabs; i++)
+		if (!strcmp(m->slabs[i].name, name))
+			return m->slabs[i].bytes;
+
+	return 0;
+}
+
+static inline void mem_snapshot(struct mem_snapshot *m)
+{
+	unsigned long num_objs, objsize;
+	char line[512], name[64];
+	struct mem_slab *slab;
+	FILE *f;
+	int i;
+
+	memset(m, 0, sizeof(*m));
+	m->vmpte = status_kb("VmPTE");
+	m->vmpin = status_kb("VmPin");
+	m->vmlck = status_kb("VmLck");
+	m->memfree = proc_field("/proc/meminfo", "MemFree");
+	m->pagetables = proc_field("/proc/meminfo", "PageTables");
+	m->secpagetables = proc_field("/proc/meminfo", "SecPageTables");
+
+	f = fopen("/proc/slabinfo", "r");
+	if (!f) {
+		m->nr_slabs = -1;
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %*s %lu %lu", name, &num_objs,
+			   &objsize) != 3 || !mem_slab_wanted(name))
+			continue;
+
+		if (!strncmp(name, "kmalloc-", 8))
+			snprintf(name, sizeof(name), "kmalloc-*");
+
+		for (i = 0; i < m->nr_slabs; i++)
+			if (!strcmp(m->slabs[i].name, name))
+				break;
+
+		if (i == m->nr_slabs) {
+			if (m->nr_slabs == MEM_SLABS_MAX)
+				continue;
+			m->nr_slabs++;
+			snprintf(m->slabs[i].name, sizeof(m->slabs[i].name),
+				 "%s", name);
+		}
+
+		slab = &m->slabs[i];
+		slab->bytes += (long long)num_objs * objsize;
+	}
+
+	fclose(f);
+}
+
+/* Kernel metadata grown between a and b: page tables and slab, bytes */
+static inline long long mem_overhead(struct mem_snapshot *a,
+				     struct mem_snapshot *b)
+{
+	long long bytes;
+	int i;
+
+	bytes = (b->pagetables - a->pagetables +
+		 (b->secpagetables > 0 ? b->secpagetables - a->secpagetables : 0))
+		* 1024;
+
+	for (i = 0; i < b->nr_slabs; i++)
+		bytes += b->slabs[i].bytes -
+			 mem_slab_bytes(a, b->slabs[i].name);
+
+	return bytes;
+}
+
+/* Deltas from a to b, and the overhead per GB of mapped */
+static inline void mem_overhead_print(const char *phase,
+				      struct mem_snapshot *a,
+				      struct mem_snapshot *b,
+				      unsigned long long mapped)
+{
+	long long delta;
+	int i, n = 0;
+
+	printf("%s: VmPTE %+ldkB, VmPin %+ldkB, VmLck %+ldkB, "
+	       "PageTables %+lldkB, SecPageTables ", phase,
+	       b->vmpte - a->vmpte, b->vmpin - a->vmpin, b->vmlck - a->vmlck,
+	       b->pagetables - a->pagetables);
+	if (b->secpagetables < 0)
+		printf("n/a");
+	else
+		printf("%+lldkB", b->secpagetables - a->secpagetables);
+	printf(", MemFree %+lldkB\n", b->memfree - a->memfree);
+
+	if (b->nr_slabs < 0) {
+		printf("  slabinfo unavailable\n");
+	} else {
+		printf("  slab:");
+		for (i = 0; i < b->nr_slabs; i++) {
+			delta = b->slabs[i].bytes -
+				mem_slab_bytes(a, b->slabs[i].name);
+			if (delta && ++n)
+				printf(" %s %+lldkB", b->slabs[i].name,
+				       delta / 1024);
+		}
+		printf("%s\n", n ? "" : " unchanged");
+	}
+
+	if (mapped)
+		printf("  overhead %lld bytes per GB mapped\n",
+		       mem_overhead(a, b) * (1LL << 30) / (long long)mapped);
+}
+
+/* Append the deltas to a results extra body */
+static inline void mem_overhead_json(char *buf, size_t len,
+				     struct mem_snapshot *a,
+				     struct mem_snapshot *b)
+{
+	size_t off = strlen(buf);
+
+	snprintf(buf + off, len - off, "%s\"vmpte_kb\":%ld,\"vmpin_kb\":%ld,"
+		 "\"pagetables_kb\":%lld,\"secpagetables_kb\":%lld,"
+		 "\"memfree_kb\":%lld,\"overhead_bytes\":%lld",
+		 off ? "," : "", b->vmpte - a->vmpte, b->vmpin - a->vmpin,
+		 b->pagetables - a->pagetables,
+		 b->secpagetables - a->secpagetables, b->memfree - a->memfree,
+		 mem_overhead(a, b));
+}
+
+/*
+ * Machine readable results.  With VFIO_RESULTS=<file> (or "-" for
+ * stdout) in the environment, every measured phase appends one JSON
+ * object per line: the phase, its parameters, op and byte counts, wall
+ * and CPU time, latency percentiles and perf counters where the test has
+ * them, plus the run metadata (kernel, IOMMU model and page sizes, CPU).
+ * Records are flushed as they're written so long running loops stream.
+ *
+ * params identifies the configuration measured and is what records are
+ * matched on across runs, so it must only hold what the test was asked
+ * to do (sizes, modes, counts requested).  Anything measured or that
+ * varies from run to run goes in the phase's extra body instead.
+ */
+struct results {
+	FILE *f;
+	char test[64];
+	char kernel[128];
+	char cpu[128];
+	char iommu[16];
+	unsigned long long iova_pgsizes;
+};
+
+struct results_phase {
+	unsigned long long start;
+	struct rusage ru;
+	char extra[512];	/* JSON object body, measurements */
+};
+
+static inline void json_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/* json_str() into buf, appended to what's there */
+static inline void json_str_buf(char *buf, size_t len, const char *str)
+{
+	size_t off = strlen(buf);
+
+	if (off + 1 < len)
+		buf[off++] = '"';
+	for (; *str && off + 7 < len; str++) {
+		if (*str == '"' || *str == '\\')
+			off += snprintf(buf + off, len - off, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			off += snprintf(buf + off, len - off, "\\u%04x", *str);
+		else
+			buf[off++] = *str;
+	}
+	if (off + 1 < len)
+		buf[off++] = '"';
+	buf[off < len ? off : len - 1] = 0;
+}
+
+/* r->f is left NULL, and every other call a no-op, unless enabled */
+static inline int results_open(struct results *r, const char *test)
+{
+	const char *path = getenv("VFIO_RESULTS");
+	struct utsname uts;
+	char line[256];
+	FILE *cpuinfo;
+
+	memset(r, 0, sizeof(*r));
+	if (!path || !*path)
+		return 0;
+
+	r->f = strcmp(path, "-") ? fopen(path, "a") : stdout;
+	if (!r->f) {
+		printf("Failed to open results file %s (%s)\n",
+		       path, strerror(errno));
+		return -1;
+	}
+
+	snprintf(r->test, sizeof(r->test), "%s", test);
+	snprintf(r->iommu, sizeof(r->iommu), "none");
+
+	if (!uname(&uts))
+		snprintf(r->kernel, sizeof(r->kernel), "%s", uts.release);
+
+	cpuinfo = fopen("/proc/cpuinfo", "r");
+	while (cpuinfo && fgets(line, sizeof(line), cpuinfo)) {
+		char *val = strchr(line, ':');
+
+		if (strncmp(line, "model name", 10) || !val)
+			continue;
+
+		val += strspn(val, ": \t");
+		val[strcspn(val, "\n")] = 0;
+		snprintf(r->cpu, sizeof(r->cpu), "%s", val);
+		break;
+	}
+	if (cpuinfo)
+		fclose(cpuinfo);
+
+	return 0;
+}
+
+/* Call once VFIO_SET_IOMMU has succeeded */
+static inline void results_set_iommu(struct results *r, int container,
+				     int type)
+{
+	struct vfio_iommu_type1_info info = {
+		.argsz = sizeof(info),
+	};
+
+	if (!r->f)
+		return;
+
+	snprintf(r->iommu, sizeof(r->iommu), "%s", iommu_model_name(type));
+
+	if (!ioctl(container, VFIO_IOMMU_GET_INFO, &info) &&
+	    (info.flags & VFIO_IOMMU_INFO_PGSIZES))
+		r->iova_pgsizes = info.iova_pgsizes;
+}
+
+static inline void results_phase_start(struct results *r,
+				       struct results_phase *ph)
+{
+	ph->extra[0] = 0;
+	if (!r->f)
+		return;
+
+	getrusage(RUSAGE_SELF, &ph->ru);
+	ph->start = now_ns();
+}
+
+static inline unsigned long long tv_delta_ns(struct timeval *a,
+					     struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL +
+	       (b->tv_usec - a->tv_usec) * 1000LL;
+}
+
+/*
+ * params is the body of a JSON object ("\"size\":4096,\"mode\":\"x\""),
+ * lat and perf may be NULL.  ph->extra, if set, is emitted as "extra".
+ */
+static inline void results_phase_end(struct results *r,
+				     struct results_phase *ph,
+				     const char *phase, const char *params,
+				     unsigned long ops, unsigned long long bytes,
+				     struct lat_stats *lat,
+				     struct perf_counters *perf)
+{
+	unsigned long long wall;
+	struct rusage ru;
+	int i;
+
+	if (!r->f)
+		return;
+
+	wall = now_ns() - ph->start;
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(r->f, "{\"test\":");
+	json_str(r->f, r->test);
+	fprintf(r->f, ",\"phase\":");
+	json_str(r->f, phase);
+	fprintf(r->f, ",\"params\":{%s}", params ? params : "");
+	if (ph->extra[0])
+		fprintf(r->f, ",\"extra\":{%s}", ph->extra);
+	fprintf(r->f, ",\"ops\":%lu,\"bytes\":%llu", ops, bytes);
+	fprintf(r->f, ",\"wall_ns\":%llu,\"user_ns\":%llu,\"sys_ns\":%llu",
+		wall, tv_delta_ns(&ph->ru.ru_utime, &ru.ru_utime),
+		tv_delta_ns(&ph->ru.ru_stime, &ru.ru_stime));
+
+	if (lat && lat->count)
+		fprintf(r->f, ",\"lat_ns\":{\"n\":%lu,\"avg\":%llu,"
+			"\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+			"\"p999\":%llu,\"max\":%llu}", lat->count,
+			lat_sum(lat) / lat->count, lat_pct(lat, 50),
+			lat_pct(lat, 90), lat_pct(lat, 99), lat_pct(lat, 99.9),
+			lat_pct(lat, 100));
+
+	if (perf && perf->enabled) {
+		fprintf(r->f, ",\"perf\":{");
+		for (i = 0; i < PERF_NR_COUNTERS; i++) {
+			int mode = i < PERF_NR_HW ? PERF_USER : PERF_ALL;
+
+			fprintf(r->f, "%s", i ? "," : "");
+			if (perf->fd[mode][i] < 0 &&
+			    (mode == PERF_ALL || perf->fd[PERF_KERNEL][i] < 0))
+				fprintf(r->f, "\"%s\":null", perf_events[i].name);
+			else if (i < PERF_NR_HW)
+				fprintf(r->f, "\"%s\":[%llu,%llu]",
+					perf_events[i].name,
+					perf->val[PERF_USER][i],
+					perf->val[PERF_KERNEL][i]);
+			else
+				fprintf(r->f, "\"%s\":%llu",
+					perf_events[i].name,
+					perf->val[mode][i]);
+		}
+		fprintf(r->f, "}");
+	}
+
+	fprintf(r->f, ",\"meta\":{\"kernel\":");
+	json_str(r->f, r->kernel);
+	fprintf(r->f, ",\"iommu\":");
+	json_str(r->f, r->iommu);
+	fprintf(r->f, ",\"iova_pgsizes\":%llu,\"cpu\":", r->iova_pgsizes);
+	json_str(r->f, r->cpu);
+	fprintf(r->f, ",\"time\":%ld}}\n", (long)time(NULL));
+	fflush(r->f);
+}
+
+#endif /* VFIO_BENCH_H */
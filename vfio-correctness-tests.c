@@ -22,6 +22,7 @@
 /* Extensions */
 
 #define VFIO_TYPE1_IOMMU		1
+#define VFIO_TYPE1v2_IOMMU		3
 
 /*
  * The IOCTL interface is designed for extensibility by embedding the
@@ -396,9 +397,19 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include "vfio-bench.h"
+#include "vfio-iommu-plan.h"
+
 void usage(char *name)
 {
-	printf("usage: %s <iommu group id> [memory path]\n", name);
+	printf("usage: %s <iommu group id> [memory path] [type1|type1v2] [plan]\n",
+	       name);
+	printf("       %s <iommu group id> frag [hugetlbfs path...]\n", name);
+	printf("\ttype1|type1v2: IOMMU model, default type1\n");
+	printf("\tplan: compare naive page chunking with planned mappings\n");
+	printf("\tfrag: hugepage test unmap analysis over 4K and THP "
+	       "anonymous memory\n\t      and each hugetlbfs path, "
+	       "TYPE1 and TYPE1v2\n");
 }
 
 #define false 0
@@ -587,8 +598,76 @@ int pagesize_test(int fd, unsigned long vaddr,
 	return 0;
 }
 
-int hugepage_test(int fd, unsigned long vaddr,
-		  unsigned long size, unsigned long pagesize)
+/*
+ * What the unmaps of hugepage_test() returned, by size.  Under TYPE1 a
+ * pagesize unmap that lands in an IOMMU superpage unmaps (and returns)
+ * the whole superpage, the rest of its pagesize unmaps return nothing,
+ * so this is the superpage usage we actually got and what it costs to
+ * break it up.
+ */
+struct unmap_sizes {
+	unsigned long count[64];	/* by log2 of the returned size */
+	unsigned long long ns[64];
+	unsigned long empty;		/* returned nothing */
+	unsigned long long empty_ns;
+};
+
+void unmap_sizes_add(struct unmap_sizes *sizes, __u64 size,
+		     unsigned long long ns)
+{
+	int order;
+
+	if (!size) {
+		sizes->empty++;
+		sizes->empty_ns += ns;
+		return;
+	}
+
+	order = 63 - __builtin_clzll(size);
+	sizes->count[order]++;
+	sizes->ns[order] += ns;
+}
+
+void unmap_sizes_print(struct unmap_sizes *sizes)
+{
+	unsigned long long bytes = 0, ns = sizes->empty_ns;
+	char label[16];
+	int i;
+
+	printf("  %-8s %8s %12s %10s\n", "returned", "unmaps", "avg ns",
+	       "ns/MB");
+
+	for (i = 0; i < 64; i++) {
+		if (!sizes->count[i])
+			continue;
+
+		bytes += (1ULL << i) * sizes->count[i];
+		ns += sizes->ns[i];
+
+		if (i >= 30)
+			snprintf(label, sizeof(label), "%lluG", 1ULL << (i - 30));
+		else if (i >= 20)
+			snprintf(label, sizeof(label), "%lluM", 1ULL << (i - 20));
+		else
+			snprintf(label, sizeof(label), "%lluK", 1ULL << (i - 10));
+
+		printf("  %-8s %8lu %12llu %10.1f\n", label, sizes->count[i],
+		       sizes->ns[i] / sizes->count[i],
+		       (double)sizes->ns[i] / sizes->count[i] /
+		       ((1ULL << i) / (1024.0 * 1024)));
+	}
+
+	if (sizes->empty)
+		printf("  %-8s %8lu %12llu\n", "none", sizes->empty,
+		       sizes->empty_ns / sizes->empty);
+
+	if (bytes)
+		printf("  total %llu us, %.1f ns/MB unmapped\n", ns / 1000,
+		       (double)ns / (bytes / (1024.0 * 1024)));
+}
+
+int hugepage_test(int fd, unsigned long vaddr, unsigned long size,
+		  unsigned long pagesize, int type, struct unmap_sizes *sizes)
 {
 	struct vfio_iommu_type1_dma_map dma_map = {
 		.argsz = sizeof(dma_map),
@@ -601,6 +680,7 @@ int hugepage_test(int fd, unsigned long vaddr,
 	int unmaps;
 	unsigned long unmapped;
 	unsigned long biggest_page;
+	unsigned long long start;
 
 	/* map it */
 	dma_map.vaddr = vaddr;
@@ -647,13 +727,43 @@ int hugepage_test(int fd, unsigned long vaddr,
 		return ret;
 	}
 
-	/* unmap it, backwards */
 	unmaps = unmapped = biggest_page = 0;
+
+	/* v2 doesn't allow splitting a mapping, so it has to go in one */
+	if (type == VFIO_TYPE1v2_IOMMU && size > pagesize) {
+		dma_unmap.iova = size - pagesize;
+		dma_unmap.size = pagesize;
+		ret = ioctl(fd, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+		if (!ret || errno != EINVAL) {
+			printf("Error, TYPE1v2 allowed split unmap @0x%llx(%s)\n",
+			       dma_unmap.iova, strerror(errno));
+			return -1;
+		}
+
+		dma_unmap.iova = 0;
+		dma_unmap.size = size;
+		start = now_ns();
+		ret = ioctl(fd, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+		unmap_sizes_add(sizes, dma_unmap.size, now_ns() - start);
+		if (ret || dma_unmap.size != size) {
+			printf("Failed to unmap @0x%llx(%s)\n",
+			       dma_unmap.iova, strerror(errno));
+			return -1;
+		}
+
+		printf("hugepage test: PASSED\n");
+		return 0;
+	}
+
+	/* unmap it, backwards */
 	for (dma_unmap.iova = size - pagesize;
 	     dma_unmap.iova < size;
 	     dma_unmap.iova -= pagesize) {
 		dma_unmap.size = pagesize;
+		start = now_ns();
 		ret = ioctl(fd, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+		unmap_sizes_add(sizes, ret ? 0 : dma_unmap.size,
+				now_ns() - start);
 		if (ret) {
 			printf("Failed to unmap @0x%lx(%s)\n",
 			       dma_unmap.iova, strerror(errno));
@@ -678,10 +788,263 @@ int hugepage_test(int fd, unsigned long vaddr,
 	return 0;
 }
 
+struct frag_backing {
+	char name[PATH_MAX + 32];
+	const char *path;	/* hugetlbfs mount, NULL for anonymous */
+	int advice;		/* madvise() for anonymous memory */
+	unsigned long pagesize;
+};
+
+/* Populated backing for the fragmentation test, aligned to size */
+unsigned long frag_alloc(struct frag_backing *backing, unsigned long size,
+			 const char *prog)
+{
+	char path[PATH_MAX];
+	unsigned long i;
+	void *addr;
+	int fd;
+
+	if (!backing->path) {
+		addr = iommu_plan_mmap(size, size, PROT_READ | PROT_WRITE,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1);
+		if (addr == MAP_FAILED)
+			return 0;
+
+		/* Advise before the first touch so THP gets a say */
+		madvise(addr, size, backing->advice);
+		for (i = 0; i < size; i += getpagesize())
+			((volatile char *)addr)[i] = 0;
+
+		return (unsigned long)addr;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.XXXXXX", backing->path, prog);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("Failed to open mempath file %s (%s)\n",
+		       path, strerror(errno));
+		return 0;
+	}
+	unlink(path);
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return 0;
+	}
+
+	addr = iommu_plan_mmap(size, size, PROT_READ | PROT_WRITE,
+			       MAP_POPULATE | MAP_SHARED, fd);
+	close(fd);
+	return addr == MAP_FAILED ? 0 : (unsigned long)addr;
+}
+
+/*
+ * hugepage_test() over 4K and THP anonymous memory and each hugetlbfs
+ * path, under both IOMMU models, with the distribution of what the
+ * unmaps returned.  All backings use the same size, two of the largest
+ * page, so the time per byte is comparable.
+ */
+int frag_test(int group, int container, unsigned long pagesize,
+	      const char *prog, int nr_paths, char **paths)
+{
+	struct {
+		const char *name;
+		int type;
+	} types[] = {
+		{ "TYPE1", VFIO_TYPE1_IOMMU },
+		{ "TYPE1v2", VFIO_TYPE1v2_IOMMU },
+	};
+	struct frag_backing *backings;
+	struct unmap_sizes sizes;
+	unsigned long size = 2 * 1024 * 1024, vaddr;
+	int i, j, nr_backings = 2, ret = -1;
+	struct statfs fs;
+
+	backings = calloc(nr_paths + 2, sizeof(*backings));
+	if (!backings)
+		return -1;
+
+	snprintf(backings[0].name, sizeof(backings[0].name),
+		 "%luK anonymous", pagesize >> 10);
+	backings[0].advice = MADV_NOHUGEPAGE;
+	backings[0].pagesize = pagesize;
+
+	snprintf(backings[1].name, sizeof(backings[1].name), "THP anonymous");
+	backings[1].advice = MADV_HUGEPAGE;
+	backings[1].pagesize = 2 * 1024 * 1024;
+
+	for (i = 0; i < nr_paths; i++) {
+		if (statfs(paths[i], &fs)) {
+			printf("Can't statfs on %s\n", paths[i]);
+			goto out;
+		}
+
+		backings[nr_backings].path = paths[i];
+		backings[nr_backings].pagesize = fs.f_bsize;
+		snprintf(backings[nr_backings].name,
+			 sizeof(backings[0].name), "%ldK hugetlbfs %s",
+			 (long)fs.f_bsize >> 10, paths[i]);
+		nr_backings++;
+	}
+
+	for (i = 0; i < nr_backings; i++)
+		size = MAX(size, 2 * backings[i].pagesize);
+
+	printf("Fragmentation test, %luM per backing\n", size >> 20);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (types[i].type != VFIO_TYPE1_IOMMU) {
+			container = iommu_container_switch(group, container,
+							   types[i].type);
+			if (container < 0) {
+				printf("%s: can't switch IOMMU model (%s)\n",
+				       types[i].name, strerror(errno));
+				goto out;
+			}
+		}
+
+		for (j = 0; j < nr_backings; j++) {
+			vaddr = frag_alloc(&backings[j], size, prog);
+			if (!vaddr) {
+				printf("Failed to allocate %s memory\n",
+				       backings[j].name);
+				goto out;
+			}
+
+			printf("%s, %s: ", backings[j].name, types[i].name);
+			memset(&sizes, 0, sizeof(sizes));
+			if (hugepage_test(container, vaddr, size, pagesize,
+					  types[i].type, &sizes)) {
+				printf("hugepage test: FAILED\n");
+				munmap((void *)vaddr, size);
+				goto out;
+			}
+			unmap_sizes_print(&sizes);
+
+			munmap((void *)vaddr, size);
+		}
+	}
+
+	ret = 0;
+out:
+	free(backings);
+	return ret;
+}
+
+/* Map and unmap a list of runs, returns -1 or the time taken in ns */
+long long plan_map_unmap(int fd, struct iommu_plan *plan,
+			 unsigned long long *unmap_ns)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	unsigned long long start, map_ns;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < plan->nr; i++) {
+		dma_map.vaddr = plan->maps[i].vaddr;
+		dma_map.iova = plan->maps[i].iova;
+		dma_map.size = plan->maps[i].size;
+		if (ioctl(fd, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+			printf("Failed to map @0x%llx(%s)\n",
+			       dma_map.iova, strerror(errno));
+			return -1;
+		}
+	}
+	map_ns = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < plan->nr; i++) {
+		dma_unmap.iova = plan->maps[i].iova;
+		dma_unmap.size = plan->maps[i].size;
+		if (ioctl(fd, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+		    dma_unmap.size != plan->maps[i].size) {
+			printf("Failed to unmap @0x%llx(%s)\n",
+			       dma_unmap.iova, strerror(errno));
+			return -1;
+		}
+	}
+	*unmap_ns = now_ns() - start;
+
+	return map_ns;
+}
+
+/*
+ * Naive chunking (one mapping per smallest IOMMU page, as the pagesize
+ * test does) against the planned split, for the region as allocated and
+ * with the iova shifted a page against the vaddr so superpages can't be
+ * used.  The footprint assumes the backing is at least as large as each
+ * IOMMU page.
+ */
+int plan_bench(int fd, __u64 pgsizes, unsigned long vaddr, unsigned long size)
+{
+	__u64 minpage = iommu_pgsize_min(pgsizes);
+	struct {
+		const char *name;
+		unsigned long iova;
+	} layouts[] = {
+		{ "aligned", 0 },
+		{ "shifted", minpage },
+	};
+	struct iommu_plan naive = { 0 }, planned = { 0 };
+	unsigned long long unmap_ns;
+	long long map_ns;
+	int i, ret = -1;
+	__u64 off;
+
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		for (off = 0; off < size; off += minpage)
+			if (iommu_plan_add(&naive, vaddr + off,
+					   layouts[i].iova + off,
+					   minpage, minpage))
+				goto out;
+
+		if (iommu_plan_split(&planned, pgsizes, vaddr,
+				     layouts[i].iova, size)) {
+			printf("Failed to plan %s layout (%s)\n",
+			       layouts[i].name, strerror(errno));
+			goto out;
+		}
+
+		printf("%s, %luK @0x%lx:\n", layouts[i].name, size >> 10,
+		       layouts[i].iova);
+
+		map_ns = plan_map_unmap(fd, &naive, &unmap_ns);
+		if (map_ns < 0)
+			goto out;
+		printf("  naive:   %7d maps, map %9llu us, unmap %9llu us, "
+		       "%llu IOMMU pages\n", naive.nr, map_ns / 1000,
+		       unmap_ns / 1000, naive.pages);
+
+		map_ns = plan_map_unmap(fd, &planned, &unmap_ns);
+		if (map_ns < 0)
+			goto out;
+		printf("  planned: %7d maps, map %9llu us, unmap %9llu us, ",
+		       planned.nr, map_ns / 1000, unmap_ns / 1000);
+		iommu_plan_print(&planned);
+
+		iommu_plan_free(&naive);
+		iommu_plan_free(&planned);
+	}
+
+	ret = 0;
+out:
+	iommu_plan_free(&naive);
+	iommu_plan_free(&planned);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int ret, container, group, groupid, fd = -1;
-	int sp = false;
+	int sp = false, plan = false, frag = false, type;
+	struct unmap_sizes sizes = { 0 };
+	__u64 pgsizes, align;
 	char path[PATH_MAX], mempath[PATH_MAX] = "";
 	unsigned long i, vaddr;
 	struct statfs fs;
@@ -697,6 +1060,13 @@ int main(int argc, char **argv)
 		.argsz = sizeof(dma_unmap)
 	};
 
+	if (argc > 2 && !strcmp(argv[argc - 1], "plan")) {
+		plan = true;
+		argc--;
+	}
+
+	type = iommu_model_arg(&argc, argv);
+
 	if (argc < 2) {
 		usage(argv[0]);
 		return -1;
@@ -708,7 +1078,9 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (argc > 2) {
+	if (argc > 2 && !strcmp(argv[2], "frag")) {
+		frag = true;
+	} else if (argc > 2) {
 		ret = sscanf(argv[2], "%s", mempath);
 		if (ret != 1) {
 			usage(argv[0]);
@@ -748,13 +1120,23 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
-	ret = ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
+	ret = ioctl(container, VFIO_SET_IOMMU, frag ? VFIO_TYPE1_IOMMU : type);
 	if (ret) {
 		printf("Failed to set IOMMU\n");
 		return ret;
 	}
 
-	hugepagesize = pagesize = getpagesize();
+	/* The IOMMU may not support pages as small as the CPU's */
+	pgsizes = iommu_pgsizes(container);
+	printf("IOMMU page sizes:");
+	iommu_pgsizes_print(pgsizes);
+	printf("\n");
+
+	hugepagesize = pagesize = MAX(getpagesize(), iommu_pgsize_min(pgsizes));
+
+	if (frag)
+		return frag_test(group, container, pagesize, basename(argv[0]),
+				 argc - 3, argv + 3);
 
 	if (strlen(mempath)) {
 		do {
@@ -781,31 +1163,50 @@ int main(int argc, char **argv)
 	else
 		mapsize = hugepagesize;
 
+	/*
+	 * Aligned so the IOMMU can use a superpage for the whole thing, and
+	 * never below the hugetlbfs page size or MAP_FIXED fails with EINVAL.
+	 */
+	align = MAX(iommu_plan_align(pgsizes, mapsize), (__u64)hugepagesize);
 	if (fd < 0) {
-		vaddr = (unsigned long)mmap(0, mapsize,
-					    PROT_READ | PROT_WRITE,
-					    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+		vaddr = (unsigned long)iommu_plan_mmap(mapsize, align,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1);
 	} else {
 		ftruncate(fd, mapsize);
-		vaddr = (unsigned long)mmap(0, mapsize,
-					    PROT_READ | PROT_WRITE,
-					    MAP_POPULATE | MAP_SHARED, fd, 0);
+		vaddr = (unsigned long)iommu_plan_mmap(mapsize, align,
+					PROT_READ | PROT_WRITE,
+					MAP_POPULATE | MAP_SHARED, fd);
 	}
 
-	if (!vaddr) {
+	if ((void *)vaddr == MAP_FAILED) {
 		printf("Failed to allocate memory\n");
 		return -1;
 	}
 
+	/* The one semantic difference between the IOMMU models */
+	ret = iommu_split_unmap_probe(container, type, 0);
+	if (ret < 0 || ret != (type == VFIO_TYPE1_IOMMU)) {
+		printf("split unmap test: FAILED (%s %s)\n",
+		       iommu_model_name(type), ret < 0 ? strerror(errno) :
+		       ret ? "allowed split" : "rejected split");
+		return -1;
+	}
+	printf("split unmap test: PASSED (%s)\n", ret ? "allowed" : "rejected");
+
 	if (pagesize_test(container, vaddr, mapsize, pagesize)) {
 		printf("pagesize test: FAILED\n");
 		return -1;
 	}
 
-	if (hugepage_test(container, vaddr, mapsize, pagesize)) {
+	if (hugepage_test(container, vaddr, mapsize, pagesize, type, &sizes)) {
 		printf("hugepage test: FAILED\n");
 		return -1;
 	}
+	unmap_sizes_print(&sizes);
+
+	if (plan && plan_bench(container, pgsizes, vaddr, mapsize))
+		return -1;
 
 	return 0;
 }
@@ -0,0 +1,266 @@
+/*
+ * Cached device region and IRQ info.
+ *
+ * vfio_dev_info_get() fetches every region and IRQ of a device once,
+ * parses the region capability chains into typed fields and keeps the
+ * lot in a single allocation.  Lookups by index afterwards are array
+ * references, no ioctls and no allocation, so a caller can keep the
+ * cache across device resets rather than re-querying.
+ *
+ * Include after the VFIO uapi definitions (embedded copy or
+ * <linux/vfio.h>), which must provide VFIO_REGION_INFO_CAP_TYPE.
+ */
+#ifndef VFIO_DEVICE_INFO_H
+#define VFIO_DEVICE_INFO_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#ifndef VFIO_REGION_INFO_CAP_MSIX_MAPPABLE
+#define VFIO_REGION_INFO_CAP_MSIX_MAPPABLE	3
+#endif
+
+/* Covers the caps of every region we know of, larger ones get re-queried */
+#define VFIO_DEV_INFO_SCRATCH	4096
+
+struct vfio_dev_region {
+	__u32	index;
+	int	valid;		/* VFIO_DEVICE_GET_REGION_INFO succeeded */
+	__u32	flags;		/* VFIO_REGION_INFO_FLAG_* */
+	__u64	size;
+	__u64	offset;		/* from start of device fd */
+	__u32	nr_caps;	/* all caps in the chain, including unknown */
+	int	has_type;	/* VFIO_REGION_INFO_CAP_TYPE */
+	__u32	type;
+	__u32	subtype;
+	int	msix_mappable;	/* VFIO_REGION_INFO_CAP_MSIX_MAPPABLE */
+	__u32	nr_sparse;	/* VFIO_REGION_INFO_CAP_SPARSE_MMAP */
+	struct vfio_region_sparse_mmap_area *sparse;
+};
+
+struct vfio_dev_info {
+	__u32	flags;		/* VFIO_DEVICE_FLAGS_* */
+	__u32	num_regions;
+	__u32	num_irqs;
+	__u32	nr_ioctls;	/* spent building the cache */
+	struct vfio_dev_region *regions;
+	struct vfio_irq_info *irqs;	/* count 0 if query failed */
+	/* regions, irqs and sparse areas follow in the same allocation */
+};
+
+static inline struct vfio_dev_region *
+vfio_dev_region(struct vfio_dev_info *di, __u32 index)
+{
+	return index < di->num_regions ? &di->regions[index] : NULL;
+}
+
+static inline struct vfio_irq_info *
+vfio_dev_irq(struct vfio_dev_info *di, __u32 index)
+{
+	return index < di->num_irqs ? &di->irqs[index] : NULL;
+}
+
+static inline struct vfio_dev_region *
+vfio_dev_find_region(struct vfio_dev_info *di, __u32 type, __u32 subtype)
+{
+	__u32 i;
+
+	for (i = 0; i < di->num_regions; i++)
+		if (di->regions[i].has_type && di->regions[i].type == type &&
+		    di->regions[i].subtype == subtype)
+			return &di->regions[i];
+
+	return NULL;
+}
+
+/*
+ * Walk a raw region info cap chain.  With region NULL only the number of
+ * sparse areas is returned, otherwise the typed fields are filled in and
+ * the sparse areas are copied to *sparse, which is advanced.
+ */
+static inline __u32 vfio_dev_parse_caps(struct vfio_region_info *info,
+					struct vfio_dev_region *region,
+					struct vfio_region_sparse_mmap_area **sparse)
+{
+	struct vfio_info_cap_header *header;
+	__u32 off, nr_sparse = 0, nr_caps = 0;
+
+	if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS))
+		return 0;
+
+	/* Bound the walk in case of a corrupt chain */
+	for (off = info->cap_offset;
+	     off >= sizeof(*info) && off + sizeof(*header) <= info->argsz &&
+	     nr_caps < info->argsz / sizeof(*header);
+	     off = header->next, nr_caps++) {
+		header = (void *)info + off;
+
+		switch (header->id) {
+		case VFIO_REGION_INFO_CAP_SPARSE_MMAP: {
+			struct vfio_region_info_cap_sparse_mmap *cap;
+
+			cap = (void *)header;
+			nr_sparse += cap->nr_areas;
+			if (!region)
+				break;
+
+			memcpy(*sparse + region->nr_sparse, cap->areas,
+			       cap->nr_areas * sizeof(cap->areas[0]));
+			region->nr_sparse += cap->nr_areas;
+			break;
+		}
+		case VFIO_REGION_INFO_CAP_TYPE: {
+			struct vfio_region_info_cap_type *cap;
+
+			if (!region)
+				break;
+
+			cap = (void *)header;
+			region->has_type = 1;
+			region->type = cap->type;
+			region->subtype = cap->subtype;
+			break;
+		}
+		case VFIO_REGION_INFO_CAP_MSIX_MAPPABLE:
+			if (region)
+				region->msix_mappable = 1;
+			break;
+		}
+	}
+
+	if (region) {
+		region->nr_caps = nr_caps;
+		*sparse += region->nr_sparse;
+	}
+
+	return nr_sparse;
+}
+
+static inline void vfio_dev_info_free(struct vfio_dev_info *di)
+{
+	free(di);
+}
+
+/* Returns NULL with errno set on failure */
+static inline struct vfio_dev_info *vfio_dev_info_get(int device)
+{
+	struct vfio_device_info device_info = {
+		.argsz = sizeof(device_info)
+	};
+	struct vfio_region_sparse_mmap_area *sparse;
+	struct vfio_dev_info *di;
+	struct vfio_region_info *info;
+	__u32 i, nr_ioctls = 1, nr_sparse = 0, *sizes;
+	size_t len, used = 0, raw_max;
+	void *raw, *tmp;
+
+	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info))
+		return NULL;
+
+	/*
+	 * Pass 1: pull every region info, caps and all, into one packed
+	 * scratch buffer so it can be sized and parsed without re-querying.
+	 */
+	raw_max = (device_info.num_regions + 1) * VFIO_DEV_INFO_SCRATCH;
+	raw = malloc(raw_max);
+	sizes = calloc(device_info.num_regions + 1, sizeof(*sizes));
+	if (!raw || !sizes)
+		goto enomem;
+
+	for (i = 0; i < device_info.num_regions; i++) {
+		__u32 argsz = VFIO_DEV_INFO_SCRATCH;
+
+again:
+		if (used + argsz > raw_max) {
+			raw_max = (used + argsz) * 2;
+			tmp = realloc(raw, raw_max);
+			if (!tmp)
+				goto enomem;
+			raw = tmp;
+		}
+
+		info = raw + used;
+		memset(info, 0, sizeof(*info));
+		info->argsz = argsz;
+		info->index = i;
+
+		nr_ioctls++;
+		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, info)) {
+			sizes[i] = 0;	/* recorded as !valid */
+			continue;
+		}
+
+		if (info->argsz > argsz) {
+			argsz = info->argsz;
+			goto again;
+		}
+
+		/* Keep the next blob 8-byte aligned for the u64 fields */
+		sizes[i] = (info->argsz + 7) & ~7;
+		used += sizes[i];
+		nr_sparse += vfio_dev_parse_caps(info, NULL, NULL);
+	}
+
+	len = sizeof(*di) +
+	      device_info.num_regions * sizeof(struct vfio_dev_region) +
+	      device_info.num_irqs * sizeof(struct vfio_irq_info) +
+	      nr_sparse * sizeof(struct vfio_region_sparse_mmap_area);
+
+	di = calloc(1, len);
+	if (!di)
+		goto enomem;
+
+	di->flags = device_info.flags;
+	di->num_regions = device_info.num_regions;
+	di->num_irqs = device_info.num_irqs;
+	di->regions = (void *)(di + 1);
+	di->irqs = (void *)(di->regions + di->num_regions);
+	sparse = (void *)(di->irqs + di->num_irqs);
+
+	/* Pass 2: parse into the arena */
+	for (i = 0, used = 0; i < di->num_regions; i++) {
+		struct vfio_dev_region *region = &di->regions[i];
+
+		region->index = i;
+		if (!sizes[i])
+			continue;
+
+		info = raw + used;
+		used += sizes[i];
+
+		region->valid = 1;
+		region->flags = info->flags;
+		region->size = info->size;
+		region->offset = info->offset;
+		region->sparse = sparse;
+		vfio_dev_parse_caps(info, region, &sparse);
+	}
+
+	for (i = 0; i < di->num_irqs; i++) {
+		struct vfio_irq_info *irq = &di->irqs[i];
+
+		irq->argsz = sizeof(*irq);
+		irq->index = i;
+
+		nr_ioctls++;
+		if (ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, irq)) {
+			irq->flags = 0;
+			irq->count = 0;
+		}
+	}
+
+	di->nr_ioctls = nr_ioctls;
+	free(sizes);
+	free(raw);
+	return di;
+
+enomem:
+	free(sizes);
+	free(raw);
+	errno = ENOMEM;
+	return NULL;
+}
+
+#endif /* VFIO_DEVICE_INFO_H */
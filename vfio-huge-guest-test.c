@@ -395,20 +395,35 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include "vfio-bench.h"
+#include "vfio-iommu-plan.h"
+
 #define MMAP_GB (4UL)
 #define MMAP_SIZE (MMAP_GB * 1024 * 1024 * 1024)
 #define GUEST_GB (1024UL)
 
 void usage(char *name)
 {
-	printf("usage: %s <iommu group id> [hugepage path]\n", name);
+	printf("usage: %s <iommu group id> [hugepage path] [type1|type1v2] [perf]\n",
+	       name);
+	printf("\ttype1|type1v2: IOMMU model, default type1\n");
+	printf("\tperf: report perf counters per map ioctl of each phase\n");
 }
 
 int main(int argc, char **argv)
 {
 	int ret, container, group, groupid, fd = -1;
 	char path[PATH_MAX], mempath[PATH_MAX] = "";
-	unsigned long i, vaddr;
+	unsigned long i, vaddr, ops;
+	struct iommu_plan plan = { 0 };
+	__u64 pgsizes, align;
+	struct perf_counters perf = { 0 };
+	int use_perf = 0, type;
+	struct results results;
+	struct results_phase phase;
+	struct mem_snapshot mem_start, mem_before, mem_after;
+	unsigned long backing_pgsize = getpagesize();
+	char params[PATH_MAX + 64];
 	struct vfio_group_status group_status = {
 		.argsz = sizeof(group_status)
 	};
@@ -416,6 +431,13 @@ int main(int argc, char **argv)
 		.argsz = sizeof(dma_map)
 	};
 
+	if (argc > 2 && !strcmp(argv[argc - 1], "perf")) {
+		use_perf = 1;
+		argc--;
+	}
+
+	type = iommu_model_arg(&argc, argv);
+
 	if (argc < 2) {
 		usage(argv[0]);
 		return -1;
@@ -467,12 +489,16 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
-	ret = ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
+	ret = ioctl(container, VFIO_SET_IOMMU, type);
 	if (ret) {
 		printf("Failed to set IOMMU\n");
 		return ret;
 	}
 
+	if (results_open(&results, "vfio-huge-guest-test"))
+		return -1;
+	results_set_iommu(&results, container, type);
+
 	if (strlen(mempath)) {
 		struct statfs fs;
 
@@ -482,8 +508,10 @@ int main(int argc, char **argv)
 
 		if (ret) {
 			printf("Can't statfs on %s\n", mempath);
-		} else
+		} else {
 			printf("Using %dK huge page size\n", fs.f_bsize >> 10);
+			backing_pgsize = fs.f_bsize;
+		}
 
 		sprintf(path, "%s/%s.XXXXXX", mempath, basename(argv[0]));
 		fd = mkstemp(path);
@@ -492,16 +520,27 @@ int main(int argc, char **argv)
 			       path, strerror(errno));
 	}
 
-	/* 4G of host memory */
+	/*
+	 * 4G of host memory, aligned to the largest IOMMU page that fits so
+	 * vaddr and iova stay congruent across the whole guest layout below,
+	 * and to at least the backing page size so a hugetlbfs MAP_FIXED lands.
+	 */
+	pgsizes = iommu_pgsizes(container);
+	align = MAX(iommu_plan_align(pgsizes, MMAP_SIZE),
+		    (__u64)backing_pgsize);
+	printf("IOMMU page sizes:");
+	iommu_pgsizes_print(pgsizes);
+	printf(", host memory aligned to %lluK\n", align >> 10);
+
 	if (fd < 0) {
-		vaddr = (unsigned long)mmap(0, MMAP_SIZE,
-					    PROT_READ | PROT_WRITE,
-					    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+		vaddr = (unsigned long)iommu_plan_mmap(MMAP_SIZE, align,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1);
 	} else {
 		ftruncate(fd, MMAP_SIZE);
-		vaddr = (unsigned long)mmap(0, MMAP_SIZE,
-					    PROT_READ | PROT_WRITE,
-					    MAP_POPULATE | MAP_SHARED, fd, 0);
+		vaddr = (unsigned long)iommu_plan_mmap(MMAP_SIZE, align,
+					PROT_READ | PROT_WRITE,
+					MAP_POPULATE | MAP_SHARED, fd);
 	}
 
 	if ((void *)vaddr == MAP_FAILED) {
@@ -511,49 +550,118 @@ int main(int argc, char **argv)
 
 	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
 
+	if (use_perf && perf_init(&perf))
+		return -1;
+
+	snprintf(params, sizeof(params), "\"guest_gb\":%lu,"
+		 "\"backing_pgsize\":%lu,\"backing\":", GUEST_GB,
+		 backing_pgsize);
+	json_str_buf(params, sizeof(params), fd < 0 ? "anonymous" : mempath);
+
+	/* Host memory each phase costs, sampled outside the ioctls */
+	mem_snapshot(&mem_start);
+	mem_before = mem_start;
+
 	/* 640K@0, enough for anyone */
 	printf("Mapping 0-640K");
 	fflush(stdout);
 	dma_map.vaddr = vaddr;
 	dma_map.size = 640 * 1024;
 	dma_map.iova = 0;
+	results_phase_start(&results, &phase);
+	perf_start(&perf);
 	ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+	perf_stop(&perf);
 	if (ret) {
 		printf("Failed to map memory (%s)\n", strerror(errno));
 		return ret;
 	}
 	printf(".\n");
+	iommu_plan_split(&plan, pgsizes, dma_map.vaddr, dma_map.iova,
+			 dma_map.size);
+	printf("  ");
+	iommu_plan_print(&plan);
+	iommu_plan_free(&plan);
+	perf_print(&perf, "0-640K", 1);
+	mem_snapshot(&mem_after);
+	mem_overhead_print("  memory", &mem_before, &mem_after, dma_map.size);
+	mem_overhead_json(phase.extra, sizeof(phase.extra), &mem_before,
+			  &mem_after);
+	results_phase_end(&results, &phase, "0-640K", params,
+			  1, dma_map.size, NULL, &perf);
+	perf_clear(&perf);
 
 	/* (3G - 1M)@1M "low memory" */
+	mem_snapshot(&mem_before);
 	printf("Mapping low memory");
 	fflush(stdout);
 	dma_map.size = (3UL * 1024 * 1024 * 1024) - (1024 * 1024);
 	dma_map.iova = 1024 * 1024;
 	dma_map.vaddr = vaddr + dma_map.iova;
+	results_phase_start(&results, &phase);
+	perf_start(&perf);
 	ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+	perf_stop(&perf);
 	if (ret) {
 		printf("Failed to map memory (%s)\n", strerror(errno));
 		return ret;
 	}
 	printf(".\n");
+	iommu_plan_split(&plan, pgsizes, dma_map.vaddr, dma_map.iova,
+			 dma_map.size);
+	printf("  ");
+	iommu_plan_print(&plan);
+	iommu_plan_free(&plan);
+	perf_print(&perf, "Low memory", 1);
+	mem_snapshot(&mem_after);
+	mem_overhead_print("  memory", &mem_before, &mem_after, dma_map.size);
+	mem_overhead_json(phase.extra, sizeof(phase.extra), &mem_before,
+			  &mem_after);
+	results_phase_end(&results, &phase, "low", params,
+			  1, dma_map.size, NULL, &perf);
+	perf_clear(&perf);
 
 	/* (1TB - 4G)@4G "high memory" after the I/O hole */
+	mem_snapshot(&mem_before);
 	printf("Mapping high memory");
 	fflush(stdout);
 	dma_map.size = MMAP_SIZE;
 	dma_map.iova = 4UL * 1024 * 1024 * 1024;
 	dma_map.vaddr = vaddr;
+	ops = 0;
+	results_phase_start(&results, &phase);
 	while (dma_map.iova < GUEST_GB * 1024 * 1024 * 1024) {
+		perf_start(&perf);
 		ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+		perf_stop(&perf);
+		ops++;
 		if (ret) {
 			printf("Failed to map memory (%s)\n", strerror(errno));
 			return ret;
 		}
+		iommu_plan_split(&plan, pgsizes, dma_map.vaddr, dma_map.iova,
+				 dma_map.size);
 		printf(".");
 		fflush(stdout);
 		dma_map.iova += MMAP_SIZE;
 	}
-	printf("\n");
+	printf("\n  ");
+	iommu_plan_print(&plan);
+	iommu_plan_free(&plan);
+	perf_print(&perf, "High memory", ops);
+	mem_snapshot(&mem_after);
+	mem_overhead_print("  memory", &mem_before, &mem_after,
+			   ops * MMAP_SIZE);
+	mem_overhead_json(phase.extra, sizeof(phase.extra), &mem_before,
+			  &mem_after);
+	results_phase_end(&results, &phase, "high", params,
+			  ops, ops * MMAP_SIZE, NULL, &perf);
+
+	/* 640K + low + high */
+	printf("Total with %luK backing pages, ", backing_pgsize >> 10);
+	mem_overhead_print("all phases", &mem_start, &mem_after,
+			   640 * 1024 + (3UL << 30) - (1 << 20) +
+			   ops * MMAP_SIZE);
 
 	if (fd >= 0)
 		unlink(path);
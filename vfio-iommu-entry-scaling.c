@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define FIRST_STEP	1024
+#define SLOT_BITS	22		/* at most 4M live mappings */
+#define BACKING_MAX	(1ULL << 40)	/* virtual reservation cap */
+#define UNMAP_SAMPLES	256
+
+/*
+ * How map and unmap cost grows with the number of live vfio_dma entries
+ * in a container, and where the type1 dma_entry_limit (ENOSPC) is.  The
+ * live count is doubled from FIRST_STEP until a map fails.  At each step
+ * the maps that got there give the map latency, then UNMAP_SAMPLES
+ * entries spread over the live set are unmapped and mapped back for the
+ * unmap latency, and the process, slab and page table memory is sampled.
+ *
+ * Every mapping has its own backing from one reservation, laid out in
+ * iova as:
+ *   dense:     back to back
+ *   sparse:    with a gap of one mapping between each
+ *   scattered: bit-reversed slots over the whole iova range, so each map
+ *              lands between existing ones instead of at the end
+ * starting at the bottom of the largest iova range the container reports,
+ * with the live count and slot range cut down to fit inside it.
+ */
+enum placement {
+	PLACE_DENSE,
+	PLACE_SPARSE,
+	PLACE_SCATTERED,
+};
+
+static const char *place_names[] = { "dense", "sparse", "scattered" };
+
+struct sample {
+	long vmpte, vmlck;
+	long long slab, sunreclaim, pagetables, secpagetables;
+};
+
+static struct results results;
+
+void usage(char *name)
+{
+	printf("usage: %s <map size KB> <dense|sparse|scattered> <iommu group id>\n",
+	       name);
+	printf("\tmap size:  size of every mapping\n");
+	printf("\tplacement: iova layout of the mappings\n");
+}
+
+/* Remaining mappings the container allows, -1 if it doesn't say */
+long dma_avail(int container)
+{
+#ifdef VFIO_IOMMU_TYPE1_INFO_DMA_AVAIL
+	struct vfio_iommu_type1_info *info;
+	struct vfio_info_cap_header *hdr;
+	char buf[4096];
+	__u32 off;
+
+	memset(buf, 0, sizeof(buf));
+	info = (struct vfio_iommu_type1_info *)buf;
+	info->argsz = sizeof(buf);
+
+	if (ioctl(container, VFIO_IOMMU_GET_INFO, info) ||
+	    !(info->flags & VFIO_IOMMU_INFO_CAPS) || info->argsz > sizeof(buf))
+		return -1;
+
+	for (off = info->cap_offset; off && off + sizeof(*hdr) <= sizeof(buf);
+	     off = hdr->next) {
+		hdr = (struct vfio_info_cap_header *)(buf + off);
+		if (hdr->id == VFIO_IOMMU_TYPE1_INFO_DMA_AVAIL)
+			return ((struct vfio_iommu_type1_info_dma_avail *)hdr)->avail;
+	}
+#endif
+	return -1;
+}
+
+unsigned long slot_of(unsigned long i, enum placement place, int bits)
+{
+	unsigned long rev = 0;
+	int b;
+
+	switch (place) {
+	case PLACE_SPARSE:
+		return i * 2;
+	case PLACE_SCATTERED:
+		for (b = 0; b < bits; b++)
+			if (i & (1UL << b))
+				rev |= 1UL << (bits - 1 - b);
+		return rev;
+	default:
+		return i;
+	}
+}
+
+void sample_mem(struct sample *s)
+{
+	s->vmpte = status_kb("VmPTE");
+	s->vmlck = status_kb("VmLck");
+	s->slab = proc_field("/proc/meminfo", "Slab");
+	s->sunreclaim = proc_field("/proc/meminfo", "SUnreclaim");
+	s->pagetables = proc_field("/proc/meminfo", "PageTables");
+	s->secpagetables = proc_field("/proc/meminfo", "SecPageTables");
+}
+
+int main(int argc, char **argv)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+	struct lat_stats map_lat = { 0 }, unmap_lat = { 0 };
+	unsigned long size, max, slots, live = 0, target, i, j;
+	unsigned long long start, teardown;
+	__u64 iova_start = 0, iova_end = ~0ULL, iova_base;
+	struct sample base, s;
+	struct results_phase phase;
+	int container, groupid, place, slot_bits = SLOT_BITS, err = 0;
+	long avail;
+	char params[192];
+	char *backing;
+
+	if (argc != 4 || sscanf(argv[1], "%lu", &size) != 1 || !size ||
+	    sscanf(argv[3], "%d", &groupid) != 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (place = 0; place < 3; place++)
+		if (!strcmp(argv[2], place_names[place]))
+			break;
+	if (place == 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	size <<= 10;
+	if (size % getpagesize()) {
+		printf("Map size must be a multiple of the page size\n");
+		return -1;
+	}
+
+	/* Let the entry limit be what stops us, not locked memory */
+	if (setrlimit(RLIMIT_MEMLOCK, &unlimited))
+		printf("Can't lift RLIMIT_MEMLOCK (%s), ENOMEM may come first\n",
+		       strerror(errno));
+
+	container = open_container(groupid, VFIO_TYPE1_IOMMU);
+	if (container < 0)
+		return -1;
+
+	if (results_open(&results, "vfio-iommu-entry-scaling"))
+		return -1;
+	results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	/* Keep every slot a placement can use inside the iova aperture */
+	if (!iova_range(container, &iova_start, &iova_end))
+		printf("Using iova range 0x%llx-0x%llx\n",
+		       (unsigned long long)iova_start,
+		       (unsigned long long)iova_end);
+
+	iova_base = (iova_start + size - 1) / size * size;
+	if (iova_base < iova_start || iova_base > iova_end ||
+	    iova_end - iova_base < size - 1) {
+		printf("No room for a %luK mapping in the iova range\n",
+		       size >> 10);
+		return -1;
+	}
+	slots = (iova_end - iova_base - (size - 1)) / size + 1;
+
+	while (slot_bits && (1UL << slot_bits) > slots)
+		slot_bits--;
+
+	max = 1UL << SLOT_BITS;
+	if (max * size > BACKING_MAX)
+		max = BACKING_MAX / size;
+	if (place == PLACE_DENSE)
+		max = MIN(max, slots);
+	else if (place == PLACE_SPARSE)
+		max = MIN(max, (slots + 1) / 2);
+	else
+		max = MIN(max, 1UL << slot_bits);
+
+	backing = mmap(NULL, max * size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (backing == MAP_FAILED) {
+		printf("Failed to reserve backing (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	avail = dma_avail(container);
+	printf("%luK mappings, %s, up to %lu", size >> 10,
+	       place_names[place], max);
+	if (avail >= 0)
+		printf(", container allows %ld", avail);
+	printf("\n");
+	printf("%8s %8s %8s %9s %9s %10s %10s %10s %10s %9s\n", "entries",
+	       "map p50", "map p99", "unmap p50", "unmap p99", "VmPTE kB",
+	       "VmLck kB", "Slab kB", "SecPT kB", "avail");
+
+	sample_mem(&base);
+	dma_map.size = dma_unmap.size = size;
+
+	for (target = FIRST_STEP; !err; target *= 2) {
+		if (target > max)
+			target = max;
+
+		results_phase_start(&results, &phase);
+		lat_reset(&map_lat);
+		lat_reset(&unmap_lat);
+
+		for (; live < target; live++) {
+			dma_map.vaddr = (unsigned long)backing + live * size;
+			dma_map.iova = iova_base +
+				       slot_of(live, place, slot_bits) * size;
+
+			start = now_ns();
+			if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+				err = errno;
+				break;
+			}
+			lat_add(&map_lat, now_ns() - start);
+		}
+
+		/* Unmap and restore a spread of the live entries */
+		for (j = 0; !err && j < UNMAP_SAMPLES && j < live; j++) {
+			i = j * (live / UNMAP_SAMPLES ? live / UNMAP_SAMPLES : 1);
+			dma_unmap.iova = iova_base +
+					 slot_of(i, place, slot_bits) * size;
+
+			start = now_ns();
+			if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
+				printf("Failed to unmap entry %lu (%s)\n",
+				       i, strerror(errno));
+				return -1;
+			}
+			lat_add(&unmap_lat, now_ns() - start);
+
+			dma_map.vaddr = (unsigned long)backing + i * size;
+			dma_map.iova = dma_unmap.iova;
+			if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+				printf("Failed to remap entry %lu (%s)\n",
+				       i, strerror(errno));
+				return -1;
+			}
+		}
+
+		sample_mem(&s);
+		avail = dma_avail(container);
+
+		printf("%8lu %8llu %8llu %9llu %9llu %10ld %10ld %10lld %10lld %9ld\n",
+		       live, lat_pct(&map_lat, 50), lat_pct(&map_lat, 99),
+		       lat_pct(&unmap_lat, 50), lat_pct(&unmap_lat, 99),
+		       s.vmpte - base.vmpte, s.vmlck - base.vmlck,
+		       s.slab - base.slab, s.secpagetables - base.secpagetables,
+		       avail);
+
+		snprintf(params, sizeof(params), "\"target\":%lu,"
+			 "\"size\":%lu,\"placement\":\"%s\"",
+			 target, size, place_names[place]);
+		snprintf(phase.extra, sizeof(phase.extra), "\"entries\":%lu,"
+			 "\"vmpte_kb\":%ld,\"slab_kb\":%lld,"
+			 "\"secpagetables_kb\":%lld", live,
+			 s.vmpte - base.vmpte, s.slab - base.slab,
+			 s.secpagetables - base.secpagetables);
+		results_phase_end(&results, &phase, "map", params,
+				  map_lat.count, map_lat.count * size,
+				  &map_lat, NULL);
+		results_phase_end(&results, &phase, "unmap", params,
+				  unmap_lat.count, unmap_lat.count * size,
+				  &unmap_lat, NULL);
+
+		if (live == max)
+			break;
+	}
+
+	if (err == ENOSPC)
+		printf("Ceiling: %lu entries, ENOSPC (dma_entry_limit)\n", live);
+	else if (err)
+		printf("Stopped at %lu entries by %s, not the entry limit\n",
+		       live, strerror(err));
+	else
+		printf("No ceiling below %lu entries\n", live);
+
+	if (live)
+		printf("Per entry: VmPTE %.1f B, VmLck %.1f B, Slab %.1f B, "
+		       "SUnreclaim %.1f B, PageTables %.1f B, SecPageTables %.1f B\n",
+		       (s.vmpte - base.vmpte) * 1024.0 / live,
+		       (s.vmlck - base.vmlck) * 1024.0 / live,
+		       (s.slab - base.slab) * 1024.0 / live,
+		       (s.sunreclaim - base.sunreclaim) * 1024.0 / live,
+		       (s.pagetables - base.pagetables) * 1024.0 / live,
+		       (s.secpagetables - base.secpagetables) * 1024.0 / live);
+
+	/* One unmap over every slot any placement uses takes them all */
+	dma_unmap.iova = iova_base;
+	dma_unmap.size = MIN(slots, 2UL << SLOT_BITS) * size;
+
+	start = now_ns();
+	if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
+		printf("Failed to tear down (%s)\n", strerror(errno));
+		return -1;
+	}
+	teardown = now_ns() - start;
+	printf("Teardown of %lu entries: %llu ms, %llu ns/entry\n", live,
+	       teardown / 1000000, live ? teardown / live : 0);
+
+	return err == ENOSPC || !err ? 0 : -1;
+}
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+/*
+ * One host buffer mapped at many iovas, as a vIOMMU guest aliasing its
+ * pages does.  Each window maps the whole buffer again, so every map
+ * takes another reference on pages that are already pinned and every
+ * unmap drops one.  Windows are spread round robin over a container per
+ * group given, back to back from the bottom of the largest iova range
+ * each container reports, clear of reserved windows such as the x86 MSI
+ * one.  The pinned/locked memory accounting is read from
+ * /proc/self/status after each step: type1 charges locked_vm (VmLck),
+ * the core mm pinned_vm (VmPin) is shown alongside.
+ */
+struct window {
+	int container;
+	__u64 iova;
+	unsigned long long map_ns, unmap_ns;
+	long lck_kb, pin_kb;		/* change caused by the map */
+	long unmap_lck_kb, unmap_pin_kb;
+};
+
+static struct results results;
+
+void usage(char *name)
+{
+	printf("usage: %s <windows> <size MB> <iommu group id> [iommu group id...]\n",
+	       name);
+	printf("\twindows: number of iova aliases of the buffer\n");
+	printf("\tsize:    buffer size\n");
+	printf("\tmore than one group spreads the windows over a container each\n");
+}
+
+int main(int argc, char **argv)
+{
+	int i, nr_windows, nr_containers, groupid, *containers;
+	unsigned long size, pages;
+	long lck, pin, lck0, pin0;
+	unsigned long long start;
+	__u64 iova_start, iova_end;
+	struct window *windows;
+	struct results_phase phase;
+	char params[128];
+	void *vaddr;
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+
+	if (argc < 4 || sscanf(argv[1], "%d", &nr_windows) != 1 ||
+	    nr_windows < 1 || sscanf(argv[2], "%lu", &size) != 1 || !size) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	size <<= 20;
+	pages = size / getpagesize();
+	nr_containers = argc - 3;
+
+	containers = calloc(nr_containers, sizeof(*containers));
+	windows = calloc(nr_windows, sizeof(*windows));
+	if (!containers || !windows) {
+		printf("Failed to allocate windows\n");
+		return -1;
+	}
+
+	for (i = 0; i < nr_containers; i++) {
+		if (sscanf(argv[3 + i], "%d", &groupid) != 1) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		containers[i] = open_container(groupid, VFIO_TYPE1_IOMMU);
+		if (containers[i] < 0)
+			return -1;
+	}
+
+	if (results_open(&results, "vfio-iommu-fanout"))
+		return -1;
+	results_set_iommu(&results, containers[0], VFIO_TYPE1_IOMMU);
+
+	vaddr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (vaddr == MAP_FAILED) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+
+	/* Lay the windows out up front so none fail for want of iova */
+	for (i = 0; i < nr_windows; i++) {
+		struct window *w = &windows[i];
+
+		w->container = containers[i % nr_containers];
+		iova_start = 0;
+		iova_end = ~0ULL;
+		iova_range(w->container, &iova_start, &iova_end);
+		iova_start = (iova_start + getpagesize() - 1) /
+			     getpagesize() * getpagesize();
+
+		w->iova = iova_start + (__u64)(i / nr_containers) * size;
+		if (iova_start > iova_end || w->iova < iova_start ||
+		    w->iova > iova_end || iova_end - w->iova < size - 1) {
+			printf("Window %d doesn't fit the iova range "
+			       "0x%llx-0x%llx\n", i,
+			       (unsigned long long)iova_start,
+			       (unsigned long long)iova_end);
+			return -1;
+		}
+	}
+
+	lck0 = lck = status_kb("VmLck");
+	pin0 = pin = status_kb("VmPin");
+
+	printf("%luM buffer, %d windows over %d container%s\n", size >> 20,
+	       nr_windows, nr_containers, nr_containers > 1 ? "s" : "");
+	printf("%6s %10s %8s %12s %12s\n", "window", "map us", "ns/page",
+	       "VmLck +kB", "VmPin +kB");
+
+	dma_map.vaddr = (unsigned long)vaddr;
+	dma_map.size = size;
+
+	/* Every window adds a reference to every page */
+	for (i = 0; i < nr_windows; i++) {
+		struct window *w = &windows[i];
+
+		dma_map.iova = w->iova;
+
+		results_phase_start(&results, &phase);
+		start = now_ns();
+		if (ioctl(w->container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+			printf("Failed to map window %d (%s)\n",
+			       i, strerror(errno));
+			return -1;
+		}
+		w->map_ns = now_ns() - start;
+
+		w->lck_kb = status_kb("VmLck") - lck;
+		w->pin_kb = status_kb("VmPin") - pin;
+		lck += w->lck_kb;
+		pin += w->pin_kb;
+
+		printf("%6d %10llu %8llu %12ld %12ld\n", i, w->map_ns / 1000,
+		       w->map_ns / pages, w->lck_kb, w->pin_kb);
+
+		snprintf(params, sizeof(params), "\"window\":%d,\"size\":%lu,"
+			 "\"containers\":%d", i, size, nr_containers);
+		results_phase_end(&results, &phase, "map", params,
+				  1, size, NULL, NULL);
+	}
+
+	printf("Accounting with %d windows: VmLck +%ldkB, VmPin +%ldkB, "
+	       "buffer %lukB", nr_windows, lck - lck0, pin - pin0,
+	       size >> 10);
+	if (lck - lck0 == (long)(size >> 10) * nr_windows)
+		printf(", charged per alias\n");
+	else if (lck - lck0 == (long)(size >> 10) * nr_containers)
+		printf(", charged per page per container\n");
+	else
+		printf(", doesn't match the buffer or alias count\n");
+
+	printf("%6s %10s %8s %12s %12s\n", "window", "unmap us", "ns/page",
+	       "VmLck +kB", "VmPin +kB");
+
+	/* And now drop them, last mapped first */
+	for (i = nr_windows - 1; i >= 0; i--) {
+		struct window *w = &windows[i];
+
+		dma_unmap.iova = w->iova;
+		dma_unmap.size = size;
+
+		results_phase_start(&results, &phase);
+		start = now_ns();
+		if (ioctl(w->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+		    dma_unmap.size != size) {
+			printf("Failed to unmap window %d (%s)\n",
+			       i, strerror(errno));
+			return -1;
+		}
+		w->unmap_ns = now_ns() - start;
+
+		w->unmap_lck_kb = status_kb("VmLck") - lck;
+		w->unmap_pin_kb = status_kb("VmPin") - pin;
+		lck += w->unmap_lck_kb;
+		pin += w->unmap_pin_kb;
+
+		printf("%6d %10llu %8llu %12ld %12ld\n", i, w->unmap_ns / 1000,
+		       w->unmap_ns / pages, w->unmap_lck_kb, w->unmap_pin_kb);
+
+		snprintf(params, sizeof(params), "\"window\":%d,\"size\":%lu,"
+			 "\"containers\":%d", i, size, nr_containers);
+		results_phase_end(&results, &phase, "unmap", params,
+				  1, size, NULL, NULL);
+	}
+
+	if (lck != lck0 || pin != pin0)
+		printf("Accounting leaked: VmLck %+ldkB, VmPin %+ldkB\n",
+		       lck - lck0, pin - pin0);
+
+	/* Fewest references against most, in the order they happened */
+	if (nr_windows > 1)
+		printf("Map %llu -> %llu ns/page as references grow, "
+		       "unmap %llu -> %llu ns/page as they fall\n",
+		       windows[0].map_ns / pages,
+		       windows[nr_windows - 1].map_ns / pages,
+		       windows[nr_windows - 1].unmap_ns / pages,
+		       windows[0].unmap_ns / pages);
+
+	return lck != lck0 || pin != pin0 ? -1 : 0;
+}
@@ -13,17 +13,323 @@
 #include <linux/ioctl.h>
 #include <linux/vfio.h>
 
+#include "vfio-bench.h"
+#include "vfio-map-coalesce.h"
+
 #define MAP_SIZE (1UL * 1024 * 1024 * 1024)
 #define MAP_CHUNK (4 * 1024)
 #define REALLOC_INTERVAL 30
+#define COALESCE_BATCH 512
+#define HPAGE_SIZE (2UL * 1024 * 1024)
+#define BITS_PER_LONG (8 * sizeof(long))
+
+static struct results results;
+static char params[128];
 
 void usage(char *name)
 {
-	printf("usage: %s ssss:bb:dd.f\n", name);
+	printf("usage: %s ssss:bb:dd.f [type1|type1v2|matrix <cycles>|coalesce <cycles>|alloc <cycles>] [vma|arena|arena-free] [perf]\n",
+	       name);
 	printf("\tssss: PCI segment, ex. 0000\n");
 	printf("\tbb:   PCI bus, ex. 01\n");
 	printf("\tdd:   PCI device, ex. 06\n");
 	printf("\tf:    PCI function, ex. 0\n");
+	printf("\ttype1|type1v2: IOMMU model, default type1\n");
+	printf("\tmatrix: run <cycles> under each model and compare\n");
+	printf("\tcoalesce: run <cycles> direct, then through the map coalescer\n");
+	printf("\talloc: run <cycles> with per-chunk VMAs, then the arena\n");
+	printf("\tvma: one mmap per chunk, recycled with munmap (default)\n");
+	printf("\tarena: chunks from one mapping, recycled with MADV_DONTNEED\n");
+	printf("\tarena-free: as arena, recycled with MADV_FREE\n");
+	printf("\tperf: report perf counters per map/unmap ioctl\n");
+}
+
+struct map_unmap_stats {
+	struct lat_stats map;	/* per MAP_CHUNK map request */
+	struct lat_stats unmap;	/* per whole MAP_SIZE unmap */
+	unsigned long vmas;	/* most seen after a map phase */
+	long thp_kb;		/* most AnonHugePages after a map phase */
+	long long thp_fault, thp_collapse;	/* /proc/vmstat deltas */
+};
+
+/*
+ * Where the chunks come from.  The original allocator is a VMA per chunk,
+ * unmapped and mmapped again every REALLOC_INTERVAL, so THP collapse has
+ * to happen across up to MAP_SIZE/MAP_CHUNK VMAs and every lookup of a
+ * chunk walks them.  The arena carves the chunks out of one 2M aligned
+ * mapping instead, tracks which are live in a bitmap and recycles them
+ * with MADV_DONTNEED (zapped, refaulted on the next pin) or MADV_FREE
+ * (only dropped under memory pressure).
+ */
+enum alloc_mode {
+	ALLOC_VMA,
+	ALLOC_DONTNEED,
+	ALLOC_FREE,
+};
+
+static const char *alloc_names[] = { "vma", "arena", "arena-free" };
+
+struct chunk_alloc {
+	enum alloc_mode mode;
+	void **maps;		/* ALLOC_VMA */
+	char *arena;		/* the others */
+	unsigned long *live;
+};
+
+int chunk_alloc_init(struct chunk_alloc *a, enum alloc_mode mode)
+{
+	unsigned long nr = MAP_SIZE / MAP_CHUNK, base, aligned;
+
+	memset(a, 0, sizeof(*a));
+	a->mode = mode;
+
+	if (mode == ALLOC_VMA) {
+		/* Track our mmaps for re-use */
+		a->maps = calloc(nr, sizeof(void *));
+		return a->maps ? 0 : -1;
+	}
+
+	a->live = calloc((nr + BITS_PER_LONG - 1) / BITS_PER_LONG,
+			 sizeof(long));
+	if (!a->live)
+		return -1;
+
+	base = (unsigned long)mmap(NULL, MAP_SIZE + HPAGE_SIZE,
+				   PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == (unsigned long)MAP_FAILED)
+		return -1;
+
+	aligned = (base + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+	if (aligned > base)
+		munmap((void *)base, aligned - base);
+	munmap((void *)(aligned + MAP_SIZE), base + HPAGE_SIZE - aligned);
+
+	a->arena = (char *)aligned;
+	if (madvise(a->arena, MAP_SIZE, MADV_HUGEPAGE))
+		printf("Madvise failed (%s)\n", strerror(errno));
+
+	return 0;
+}
+
+void *chunk_get(struct chunk_alloc *a, unsigned long i)
+{
+	if (a->mode != ALLOC_VMA) {
+		a->live[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+		return a->arena + i * MAP_CHUNK;
+	}
+
+	if (!a->maps[i]) {
+		a->maps[i] = mmap(NULL, MAP_CHUNK, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (a->maps[i] == MAP_FAILED) {
+			a->maps[i] = NULL;
+			return MAP_FAILED;
+		}
+	}
+
+	if (madvise(a->maps[i], MAP_CHUNK, MADV_HUGEPAGE))
+		printf("Madvise failed (%s)\n", strerror(errno));
+
+	return a->maps[i];
+}
+
+/* Give every chunk back, one madvise per run of live chunks */
+void chunk_recycle(struct chunk_alloc *a)
+{
+	unsigned long nr = MAP_SIZE / MAP_CHUNK, i, j;
+
+	if (a->mode == ALLOC_VMA) {
+		for (i = 0; i < nr; i++) {
+			if (a->maps[i]) {
+				munmap(a->maps[i], MAP_CHUNK);
+				a->maps[i] = NULL;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < nr; i = j) {
+		if (!(a->live[i / BITS_PER_LONG] & (1UL << (i % BITS_PER_LONG)))) {
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i; j < nr &&
+		     (a->live[j / BITS_PER_LONG] & (1UL << (j % BITS_PER_LONG)));
+		     j++)
+			;
+
+		if (madvise(a->arena + i * MAP_CHUNK, (j - i) * MAP_CHUNK,
+			    a->mode == ALLOC_FREE ? MADV_FREE : MADV_DONTNEED))
+			printf("Madvise failed (%s)\n", strerror(errno));
+	}
+
+	memset(a->live, 0, (nr + BITS_PER_LONG - 1) / BITS_PER_LONG *
+	       sizeof(long));
+}
+
+unsigned long vma_count(void)
+{
+	unsigned long vmas = 0;
+	char line[512];
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (strchr(line, '\n'))
+			vmas++;
+
+	fclose(f);
+	return vmas;
+}
+
+/*
+ * Runs forever with cycles 0, dropping the stats every interval.  With a
+ * coalescer the requests go through it, the last batch flushed before
+ * the unmap.
+ */
+int map_unmap_loop(int container, struct chunk_alloc *alloc,
+		   unsigned long cycles,
+		   struct map_coalescer *co, struct map_unmap_stats *stats,
+		   struct perf_counters *map_perf,
+		   struct perf_counters *unmap_perf)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map)
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap)
+	};
+	unsigned long map_ops = 0, unmap_ops = 0;
+	long long thp_fault, thp_collapse;
+	struct results_phase phase;
+	unsigned long long start;
+	unsigned long i, count, vmas;
+	void *chunk;
+	long thp_kb;
+	int ret;
+	/* Results on stdout must start on a line of their own */
+	int progress = results.f != stdout;
+
+	thp_fault = proc_field("/proc/vmstat", "thp_fault_alloc");
+	thp_collapse = proc_field("/proc/vmstat", "thp_collapse_alloc");
+
+	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+	dma_map.size = MAP_CHUNK;
+	dma_unmap.size = MAP_SIZE;
+	dma_unmap.iova = 0;
+
+	for (count = 0; !cycles || count < cycles; count++) {
+
+		/* Every REALLOC_INTERVAL, dump our mappings to give THP something to collapse */
+		if (count % REALLOC_INTERVAL == 0) {
+			chunk_recycle(alloc);
+			if (count && !cycles) {
+				printf("\t%ld\n", count);
+				lat_print("Map  ", &stats->map);
+				lat_print("Unmap", &stats->unmap);
+				printf("VMAs %lu, AnonHugePages %ldkB\n",
+				       stats->vmas, stats->thp_kb);
+				lat_reset(&stats->map);
+				lat_reset(&stats->unmap);
+				perf_print(map_perf, "Map", map_ops);
+				perf_print(unmap_perf, "Unmap", unmap_ops);
+				perf_clear(map_perf);
+				perf_clear(unmap_perf);
+				map_ops = unmap_ops = 0;
+				//return 0;
+			}
+			if (progress) {
+				printf("|");
+				fflush(stdout);
+			}
+		}
+
+		/* Map MAP_CHUNK at a time, each chunk is pinned on map, so THP can't do anything until unmap */
+		results_phase_start(&results, &phase);
+		perf_start(map_perf);
+		for (i = dma_map.iova = 0; i < MAP_SIZE/dma_map.size; i++, dma_map.iova += dma_map.size) {
+			chunk = chunk_get(alloc, i);
+			if (chunk == MAP_FAILED) {
+				printf("Failed to mmap memory (%s)\n", strerror(errno));
+				return -1;
+			}
+
+			dma_map.vaddr = (unsigned long)chunk;
+
+			start = now_ns();
+			if (co)
+				ret = coalesce_map(co, dma_map.vaddr,
+						   dma_map.iova, dma_map.size,
+						   dma_map.flags);
+			else
+				ret = ioctl(container, VFIO_IOMMU_MAP_DMA,
+					    &dma_map);
+			lat_add(&stats->map, now_ns() - start);
+			if (ret) {
+				printf("Failed to map memory (%s)\n",
+					strerror(errno));
+				return ret;
+			}
+		}
+		if (co && coalesce_flush(co)) {
+			printf("Failed to map memory (%s)\n", strerror(errno));
+			return -1;
+		}
+		perf_stop(map_perf);
+		map_ops += MAP_SIZE/dma_map.size;
+		results_phase_end(&results, &phase, "map", params,
+				  MAP_SIZE/dma_map.size, MAP_SIZE, NULL, NULL);
+
+		/* Sampled while everything is pinned, outside the phases */
+		vmas = vma_count();
+		if (vmas > stats->vmas)
+			stats->vmas = vmas;
+		thp_kb = proc_field("/proc/self/smaps_rollup", "AnonHugePages");
+		if (thp_kb > stats->thp_kb)
+			stats->thp_kb = thp_kb;
+
+		if (progress) {
+			printf("+");
+			fflush(stdout);
+		}
+
+		/* Unmap everything at once */
+		results_phase_start(&results, &phase);
+		perf_start(unmap_perf);
+		start = now_ns();
+		if (co)
+			ret = coalesce_unmap(co, dma_unmap.iova, dma_unmap.size);
+		else
+			ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+		lat_add(&stats->unmap, now_ns() - start);
+		perf_stop(unmap_perf);
+		if (ret) {
+			printf("Failed to unmap memory (%s)\n", strerror(errno));
+			return ret;
+		}
+		unmap_ops++;
+		results_phase_end(&results, &phase, "unmap", params,
+				  1, MAP_SIZE, NULL, NULL);
+
+		if (progress) {
+			printf("-");
+			fflush(stdout);
+		}
+	}
+
+	stats->thp_fault = proc_field("/proc/vmstat", "thp_fault_alloc") -
+			   thp_fault;
+	stats->thp_collapse = proc_field("/proc/vmstat", "thp_collapse_alloc") -
+			      thp_collapse;
+
+	if (progress)
+		printf("\n");
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -33,20 +339,57 @@ int main(int argc, char **argv)
 	char path[50], iommu_group_path[50], *group_name;
 	struct stat st;
 	ssize_t len;
-	unsigned long i, count;
-	void *vaddr;
-	void **maps;
+	unsigned long cycles = 0;
+	struct chunk_alloc allocs[2];
+	enum alloc_mode modes[2] = { ALLOC_VMA, ALLOC_VMA };
+	struct perf_counters map_perf = { 0 }, unmap_perf = { 0 };
+	struct map_unmap_stats stats[2] = { 0 };
+	struct map_coalescer co;
+	int models[2] = { VFIO_TYPE1_IOMMU, VFIO_TYPE1v2_IOMMU };
+	int i, nr_models = 1, use_perf = 0, use_coalesce = 0, use_alloc = 0;
+	int split;
 	struct vfio_group_status group_status = {
 		.argsz = sizeof(group_status)
 	};
-	struct vfio_iommu_type1_dma_map dma_map = {
-		.argsz = sizeof(dma_map)
-	};
-	struct vfio_iommu_type1_dma_unmap dma_unmap = {
-		.argsz = sizeof(dma_unmap)
-	};
 
-	if (argc != 2) {
+	if (argc > 2 && !strcmp(argv[argc - 1], "perf")) {
+		use_perf = 1;
+		argc--;
+	}
+
+	for (i = 0; argc > 2 && i < 3; i++) {
+		if (!strcmp(argv[argc - 1], alloc_names[i])) {
+			modes[0] = modes[1] = i;
+			argc--;
+			break;
+		}
+	}
+
+	models[0] = iommu_model_arg(&argc, argv);
+
+	if (argc == 4 && (!strcmp(argv[2], "matrix") ||
+			  !strcmp(argv[2], "coalesce") ||
+			  !strcmp(argv[2], "alloc"))) {
+		if (sscanf(argv[3], "%lu", &cycles) != 1 || !cycles) {
+			usage(argv[0]);
+			return -1;
+		}
+		if (!strcmp(argv[2], "coalesce")) {
+			/* Same model twice, direct then coalesced */
+			models[1] = models[0];
+			use_coalesce = 1;
+		} else if (!strcmp(argv[2], "alloc")) {
+			/* Same model twice, per-chunk VMAs then the arena */
+			models[1] = models[0];
+			modes[0] = ALLOC_VMA;
+			if (modes[1] == ALLOC_VMA)
+				modes[1] = ALLOC_DONTNEED;
+			use_alloc = 1;
+		} else {
+			models[0] = VFIO_TYPE1_IOMMU;
+		}
+		nr_models = 2;
+	} else if (argc != 2) {
 		usage(argv[0]);
 		return -1;
 	}
@@ -116,84 +459,108 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
-	ret = ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
+	ret = ioctl(container, VFIO_SET_IOMMU, models[0]);
 	if (ret) {
 		printf("Failed to set IOMMU\n");
 		return ret;
 	}
 
-	/* Test code */
-	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
-	dma_map.size = MAP_CHUNK;
-	dma_unmap.size = MAP_SIZE;
-	dma_unmap.iova = 0;
-
-	/* Track our mmaps for re-use */
-	maps = malloc(sizeof(void *) * (MAP_SIZE/dma_map.size));
-	if (!maps) {
-		printf("Failed to allocate map (%s)\n", strerror(errno));
+	if (results_open(&results, "vfio-iommu-map-unmap"))
 		return -1;
-	}
-
-	memset(maps, 0, sizeof(void *) * (MAP_SIZE/dma_map.size));
 
-	for (count = 0;; count++) {
+	if (use_perf && (perf_init(&map_perf) || perf_init(&unmap_perf)))
+		return -1;
 
-		/* Every REALLOC_INTERVAL, dump our mappings to give THP something to collapse */
-		if (count % REALLOC_INTERVAL == 0) {
-			for (i = 0; i < MAP_SIZE/dma_map.size; i++) {
-				if (maps[i]) {
-					munmap(maps[i], dma_map.size);
-					maps[i] = NULL;
-				}
-			}
-			if (count) {
-				printf("\t%ld\n", count);
-				//return 0;
-			}
-			printf("|");
-			fflush(stdout);
+	for (i = 0; i < (use_alloc ? 2 : 1); i++) {
+		if (chunk_alloc_init(&allocs[i], modes[i])) {
+			printf("Failed to allocate map (%s)\n", strerror(errno));
+			return -1;
 		}
+	}
 
-		/* Map MAP_CHUNK at a time, each chunk is pinned on map, so THP can't do anything until unmap */
-		for (i = dma_map.iova = 0; i < MAP_SIZE/dma_map.size; i++, dma_map.iova += dma_map.size) {
-			if (!maps[i]) {
-				maps[i] = mmap(NULL, dma_map.size,
-						PROT_READ | PROT_WRITE,
-						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-				if (maps[i] == MAP_FAILED) {
-					printf("Failed to mmap memory (%s)\n", strerror(errno));
-					return -1;
-				}
+	for (i = 0; i < nr_models; i++) {
+		if (i) {
+			container = iommu_container_switch(group, container,
+							   models[i]);
+			if (container < 0) {
+				printf("Failed to switch to %s (%s)\n",
+				       iommu_model_name(models[i]),
+				       strerror(errno));
+				return -1;
 			}
+		}
 
-			ret = madvise(maps[i], dma_map.size, MADV_HUGEPAGE);
-			if (ret) {
-				printf("Madvise failed (%s)\n", strerror(errno));
-			}
+		results_set_iommu(&results, container, models[i]);
 
-			dma_map.vaddr = (unsigned long)maps[i];
+		split = iommu_split_unmap_probe(container, models[i], 0);
+		if (split < 0)
+			printf("%s: split unmap probe failed (%s)\n",
+			       iommu_model_name(models[i]), strerror(errno));
+		else
+			printf("%s: split unmap %s\n",
+			       iommu_model_name(models[i]),
+			       split ? "allowed" : "rejected");
 
-			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
-			if (ret) {
-				printf("Failed to map memory (%s)\n",
-					strerror(errno));
-				return ret;
-			}
+		if (use_coalesce && i &&
+		    coalesce_init(&co, container, MAP_SIZE, COALESCE_BATCH)) {
+			printf("Failed to allocate coalescer\n");
+			return -1;
 		}
 
-		printf("+");
-		fflush(stdout);
+		snprintf(params, sizeof(params), "\"chunk\":%d,\"size\":%lu,"
+			 "\"alloc\":\"%s\"", MAP_CHUNK, MAP_SIZE,
+			 alloc_names[modes[i]]);
+		if (use_coalesce)
+			snprintf(params + strlen(params),
+				 sizeof(params) - strlen(params),
+				 ",\"coalesce\":%d", !!i);
 
-		/* Unmap everything at once */
-		ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
-		if (ret) {
-			printf("Failed to unmap memory (%s)\n", strerror(errno));
+		ret = map_unmap_loop(container, &allocs[use_alloc ? i : 0],
+				     cycles, use_coalesce && i ? &co : NULL,
+				     &stats[i], &map_perf, &unmap_perf);
+		if (ret)
 			return ret;
+
+		/* Don't leave the VMAs around for the arena run to count */
+		if (use_alloc && !i)
+			chunk_recycle(&allocs[i]);
+
+		if (use_coalesce && i) {
+			printf("Coalesced %lu requests into %lu maps, "
+			       "%lu unmaps\n", co.requests, co.map_ioctls,
+			       co.unmap_ioctls);
+			coalesce_free(&co);
 		}
 
-		printf("-");
-		fflush(stdout);
+		perf_print(&map_perf, "Map", cycles * (MAP_SIZE/MAP_CHUNK));
+		perf_print(&unmap_perf, "Unmap", cycles);
+		perf_clear(&map_perf);
+		perf_clear(&unmap_perf);
+	}
+
+	if (nr_models > 1) {
+		printf("%lu cycles of %luM in %dK chunks:\n", cycles,
+		       MAP_SIZE >> 20, MAP_CHUNK >> 10);
+		if (use_coalesce) {
+			matrix_header("direct", "coalesced");
+			matrix_row("map ioctls", cycles * (MAP_SIZE/MAP_CHUNK),
+				   co.map_ioctls);
+		} else if (use_alloc) {
+			matrix_header(alloc_names[modes[0]],
+				      alloc_names[modes[1]]);
+			matrix_row("VMAs", stats[0].vmas, stats[1].vmas);
+			matrix_row("AnonHugePages kB", stats[0].thp_kb,
+				   stats[1].thp_kb);
+			matrix_row("THP faults", stats[0].thp_fault,
+				   stats[1].thp_fault);
+			matrix_row("THP collapses", stats[0].thp_collapse,
+				   stats[1].thp_collapse);
+		} else {
+			matrix_header(iommu_model_name(models[0]),
+				      iommu_model_name(models[1]));
+		}
+		matrix_lat("map", &stats[0].map, &stats[1].map);
+		matrix_lat("unmap", &stats[0].unmap, &stats[1].unmap);
 	}
 
 	return 0;
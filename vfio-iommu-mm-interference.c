@@ -0,0 +1,370 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define MAP_SIZE	(4 * 1024)
+#define REGION_SIZE	(256 * 1024)		/* madvise, mprotect, churn */
+#define THP_SIZE	(2 * 1024 * 1024)
+
+/*
+ * accounting-stress races mlock()/munlock() of an unrelated buffer
+ * against a 4K map/unmap loop.  This runs the same loop against one
+ * interferer thread at a time, each hammering the mm in its own way:
+ *
+ *   mlock:     mlock()/munlock() of a 4K buffer, as accounting-stress
+ *   madvise:   fault in REGION_SIZE, then MADV_DONTNEED it
+ *   mprotect:  flip the first half of REGION_SIZE read-only and back,
+ *              splitting and merging the VMA
+ *   fork:      fork() a child that exits straight away, copying the page
+ *              tables, pinned pages included
+ *   thp-split: fault in a THP, munmap() 4K out of its middle to split it,
+ *              then the rest
+ *   churn:     mmap(), touch and munmap() REGION_SIZE
+ *
+ * All but madvise take mmap_lock for write, MADV_DONTNEED only needs it
+ * for read.  Map needs it for read to pin, and map and unmap both take it
+ * for write to account locked_vm.  Each pair is held against a run with
+ * no interferer: the throughput lost and how much map and unmap p99
+ * inflate.  The interferer wants a CPU of its own, or the loss is mostly
+ * the two sharing one.  Without a group the loop is simulated with
+ * mlock()/munlock().
+ */
+struct interferer {
+	const char *name;
+	int (*op)(struct interferer *);
+	unsigned long size;		/* of buf, allocated up front */
+	char *buf;
+	unsigned long ops;
+	int error;
+	pthread_t thread;
+};
+
+struct pair {
+	double rate;
+	double iops;
+	struct lat_stats map, unmap;
+};
+
+static struct results results;
+static volatile int stop;
+
+void usage(char *name)
+{
+	printf("usage: %s <seconds per pair> [iommu group id] [interferer...]\n",
+	       name);
+	printf("\tinterferers: mlock madvise mprotect fork thp-split churn, default all\n");
+	printf("\twithout a group the map/unmap loop is simulated with mlock\n");
+}
+
+static void touch(char *buf, unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i += getpagesize())
+		((volatile char *)buf)[i] = 1;
+}
+
+static int mlock_op(struct interferer *in)
+{
+	return mlock(in->buf, MAP_SIZE) || munlock(in->buf, MAP_SIZE);
+}
+
+static int madvise_op(struct interferer *in)
+{
+	touch(in->buf, REGION_SIZE);
+	return madvise(in->buf, REGION_SIZE, MADV_DONTNEED);
+}
+
+static int mprotect_op(struct interferer *in)
+{
+	return mprotect(in->buf, REGION_SIZE / 2, PROT_READ) ||
+	       mprotect(in->buf, REGION_SIZE / 2, PROT_READ | PROT_WRITE);
+}
+
+static int fork_op(struct interferer *in)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return -1;
+	if (!pid)
+		_exit(0);
+
+	return waitpid(pid, NULL, 0) < 0 ? -1 : 0;
+}
+
+static int thp_split_op(struct interferer *in)
+{
+	unsigned long base;
+	char *thp;
+
+	/* Over-reserve so there's an aligned 2M to trim down to */
+	base = (unsigned long)mmap(NULL, THP_SIZE * 2, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)base == MAP_FAILED)
+		return -1;
+
+	thp = (char *)((base + THP_SIZE - 1) & ~(THP_SIZE - 1UL));
+	if (thp > (char *)base)
+		munmap((void *)base, thp - (char *)base);
+	munmap(thp + THP_SIZE, base + THP_SIZE * 2 - (unsigned long)thp -
+	       THP_SIZE);
+
+	madvise(thp, THP_SIZE, MADV_HUGEPAGE);
+	touch(thp, THP_SIZE);
+
+	return munmap(thp + THP_SIZE / 2, getpagesize()) ||
+	       munmap(thp, THP_SIZE);
+}
+
+static int churn_op(struct interferer *in)
+{
+	char *buf;
+
+	buf = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	touch(buf, REGION_SIZE);
+	return munmap(buf, REGION_SIZE);
+}
+
+static struct interferer interferers[] = {
+	{ "none" },
+	{ "mlock",	mlock_op,	MAP_SIZE },
+	{ "madvise",	madvise_op,	REGION_SIZE },
+	{ "mprotect",	mprotect_op,	REGION_SIZE },
+	{ "fork",	fork_op },
+	{ "thp-split",	thp_split_op },
+	{ "churn",	churn_op },
+};
+
+#define NR_INTERFERERS	(sizeof(interferers) / sizeof(interferers[0]))
+
+void *interferer_thread(void *arg)
+{
+	struct interferer *in = arg;
+
+	while (!stop) {
+		if (in->op(in)) {
+			in->error = errno;
+			break;
+		}
+		in->ops++;
+	}
+
+	return NULL;
+}
+
+/* The accounting-stress loop, for seconds */
+int map_unmap_loop(int container, char *buf, int seconds, struct pair *p)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = (unsigned long)buf,
+		.size = MAP_SIZE,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = MAP_SIZE,
+	};
+	unsigned long long start, deadline, t;
+	unsigned long cycles = 0;
+	int ret;
+
+	start = now_ns();
+	deadline = start + seconds * 1000000000ULL;
+
+	while ((t = now_ns()) < deadline) {
+		if (container >= 0)
+			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+		else
+			ret = mlock(buf, MAP_SIZE);
+		lat_add(&p->map, now_ns() - t);
+		if (ret) {
+			printf("Failed to map memory (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		t = now_ns();
+		if (container >= 0)
+			ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA,
+				    &dma_unmap);
+		else
+			ret = munlock(buf, MAP_SIZE);
+		lat_add(&p->unmap, now_ns() - t);
+		if (ret) {
+			printf("Failed to unmap memory (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		cycles++;
+	}
+
+	p->rate = cycles * 1e9 / (now_ns() - start);
+	return 0;
+}
+
+int run_pair(struct interferer *in, int container, char *buf, int seconds,
+	     struct pair *p)
+{
+	unsigned long long start;
+
+	in->ops = 0;
+	in->error = 0;
+	stop = 0;
+
+	if (in->op && pthread_create(&in->thread, NULL, interferer_thread, in)) {
+		printf("Failed to create %s thread\n", in->name);
+		return -1;
+	}
+
+	start = now_ns();
+	if (map_unmap_loop(container, buf, seconds, p))
+		return -1;
+
+	stop = 1;
+	if (in->op) {
+		pthread_join(in->thread, NULL);
+		if (in->error) {
+			printf("%s interferer failed (%s)\n",
+			       in->name, strerror(in->error));
+			return -1;
+		}
+	}
+
+	p->iops = in->ops * 1e9 / (now_ns() - start);
+	return 0;
+}
+
+static double ratio(unsigned long long a, unsigned long long b)
+{
+	return b ? (double)a / b : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int seconds, groupid, container = -1, first = 2, i, j, worst = -1;
+	struct pair pairs[NR_INTERFERERS], *base = &pairs[0];
+	int selected[NR_INTERFERERS] = { 1 };
+	struct results_phase phase;
+	double loss, worst_loss = 0;
+	char params[128];
+	char *buf;
+
+	if (argc < 2 || sscanf(argv[1], "%d", &seconds) != 1 || seconds < 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc > 2 && sscanf(argv[2], "%d", &groupid) == 1) {
+		container = open_container(groupid, VFIO_TYPE1v2_IOMMU);
+		if (container < 0)
+			return -1;
+		first = 3;
+	}
+
+	for (i = first; i < argc; i++) {
+		for (j = 1; j < NR_INTERFERERS; j++)
+			if (!strcmp(argv[i], interferers[j].name))
+				break;
+		if (j == NR_INTERFERERS) {
+			usage(argv[0]);
+			return -1;
+		}
+		selected[j] = 1;
+	}
+	for (j = 1; first == argc && j < NR_INTERFERERS; j++)
+		selected[j] = 1;
+
+	if (results_open(&results, "vfio-iommu-mm-interference"))
+		return -1;
+	if (container >= 0)
+		results_set_iommu(&results, container, VFIO_TYPE1v2_IOMMU);
+
+	buf = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to mmap DMA mapping buffer\n");
+		return -1;
+	}
+
+	printf("%dK map/unmap loop, %s, %ds per pair\n", MAP_SIZE >> 10,
+	       container < 0 ? "simulated" : "vfio", seconds);
+	printf("%-10s %10s %7s %9s %9s %9s %9s %8s %8s %10s\n", "interferer",
+	       "cycles/s", "loss%", "map p50", "map p99", "unmap p50",
+	       "unmap p99", "map x", "unmap x", "its ops/s");
+
+	memset(pairs, 0, sizeof(pairs));
+
+	for (i = 0; i < NR_INTERFERERS; i++) {
+		struct interferer *in = &interferers[i];
+		struct pair *p = &pairs[i];
+
+		if (!selected[i])
+			continue;
+
+		if (in->size) {
+			in->buf = mmap(NULL, in->size, PROT_READ | PROT_WRITE,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (in->buf == MAP_FAILED) {
+				printf("Failed to mmap %s buffer\n", in->name);
+				return -1;
+			}
+		}
+
+		results_phase_start(&results, &phase);
+		if (run_pair(in, container, buf, seconds, p))
+			return -1;
+
+		loss = (1 - p->rate / base->rate) * 100;
+		if (i && loss > worst_loss) {
+			worst_loss = loss;
+			worst = i;
+		}
+
+		/* Inflation is of p99, against the loop left alone */
+		printf("%-10s %10.0f %7.1f %9llu %9llu %9llu %9llu %8.2f %8.2f %10.0f\n",
+		       in->name, p->rate, loss, lat_pct(&p->map, 50),
+		       lat_pct(&p->map, 99), lat_pct(&p->unmap, 50),
+		       lat_pct(&p->unmap, 99),
+		       ratio(lat_pct(&p->map, 99), lat_pct(&base->map, 99)),
+		       ratio(lat_pct(&p->unmap, 99), lat_pct(&base->unmap, 99)),
+		       p->iops);
+
+		snprintf(params, sizeof(params), "\"interferer\":\"%s\"",
+			 in->name);
+		snprintf(phase.extra, sizeof(phase.extra), "\"rate\":%.0f,"
+			 "\"loss_pct\":%.1f,\"interferer_ops\":%lu", p->rate,
+			 loss, in->ops);
+		results_phase_end(&results, &phase, "map", params,
+				  p->map.count, p->map.count * MAP_SIZE,
+				  &p->map, NULL);
+		results_phase_end(&results, &phase, "unmap", params,
+				  p->unmap.count, p->unmap.count * MAP_SIZE,
+				  &p->unmap, NULL);
+	}
+
+	if (worst > 0)
+		printf("Worst: %s, %.1f%% of map/unmap throughput lost\n",
+		       interferers[worst].name, worst_loss);
+
+	return 0;
+}
@@ -0,0 +1,378 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define WORK_SIZE (16UL * 1024 * 1024)
+#define MAP_CHUNK (4 * 1024)
+
+/*
+ * K containers, each running its own map/unmap loop: map WORK_SIZE in
+ * MAP_CHUNK pieces, unmap it all at once, repeat.  A container needs a
+ * group of its own, so containers beyond the groups given run a simulated
+ * backend which pins with mlock()/munlock() instead, covering the mm side
+ * (mmap_lock, page pinning and accounting) but not the IOMMU.
+ *
+ * Threads share one mm, as a VMM with many assigned devices would,
+ * processes each have their own, as separate VMs would.  The container
+ * count is swept up in powers of two to K so the aggregate can be held
+ * against K times the single container rate.
+ */
+struct worker_result {
+	int error;			/* errno, 0 on success */
+	unsigned long cycles;
+	unsigned long long setup_ns;	/* container + IOMMU domain */
+	unsigned long long wall_ns;
+	unsigned long maps;
+	unsigned long long map_ns;
+	unsigned long long map_p50, map_p99;
+	unsigned long long unmap_p50, unmap_p99;
+};
+
+struct worker {
+	int index;
+	int group;		/* -1 for the simulated backend */
+	int gate;		/* read end, EOF starts the run */
+	int seconds;
+	struct worker_result *result;
+	pthread_t thread;
+	pid_t pid;
+};
+
+static struct results results;
+
+void usage(char *name)
+{
+	printf("usage: %s <containers> <seconds> <threads|procs> [iommu group id...]\n",
+	       name);
+	printf("\tcontainers: maximum number of containers, swept in powers of 2\n");
+	printf("\tseconds:    run time at each step\n");
+	printf("\tthreads:    one thread per container, shared mm\n");
+	printf("\tprocs:      one process per container, separate mms\n");
+	printf("\tgroups are given one per container, the rest simulated\n");
+}
+
+int worker_run(struct worker *w)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.size = MAP_CHUNK,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = WORK_SIZE,
+	};
+	struct worker_result *res = w->result;
+	struct lat_stats map_lat = { 0 }, unmap_lat = { 0 };
+	unsigned long long start, deadline, t;
+	int container = -1, ret = 0;
+	unsigned long off;
+	char *buf;
+	char c;
+
+	memset(res, 0, sizeof(*res));
+
+	buf = mmap(NULL, WORK_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		res->error = errno;
+		return -1;
+	}
+
+	/* Blocks until the write end is closed by the parent */
+	if (read(w->gate, &c, 1) < 0) {
+		res->error = errno;
+		goto out;
+	}
+
+	start = now_ns();
+	if (w->group >= 0) {
+		container = open("/dev/vfio/vfio", O_RDWR);
+		if (container < 0 ||
+		    ioctl(w->group, VFIO_GROUP_SET_CONTAINER, &container) ||
+		    ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
+			res->error = errno;
+			goto out;
+		}
+	}
+	res->setup_ns = now_ns() - start;
+
+	start = now_ns();
+	deadline = start + w->seconds * 1000000000ULL;
+
+	while (now_ns() < deadline) {
+		for (off = 0; off < WORK_SIZE; off += MAP_CHUNK) {
+			t = now_ns();
+			if (container >= 0) {
+				dma_map.vaddr = (unsigned long)buf + off;
+				dma_map.iova = off;
+				ret = ioctl(container, VFIO_IOMMU_MAP_DMA,
+					    &dma_map);
+			} else {
+				ret = mlock(buf + off, MAP_CHUNK);
+			}
+			lat_add(&map_lat, now_ns() - t);
+			if (ret) {
+				res->error = errno;
+				goto out;
+			}
+		}
+
+		t = now_ns();
+		if (container >= 0)
+			ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA,
+				    &dma_unmap);
+		else
+			ret = munlock(buf, WORK_SIZE);
+		lat_add(&unmap_lat, now_ns() - t);
+		if (ret) {
+			res->error = errno;
+			goto out;
+		}
+
+		res->cycles++;
+	}
+
+	res->wall_ns = now_ns() - start;
+	res->maps = map_lat.count;
+	res->map_ns = lat_sum(&map_lat);
+	res->map_p50 = lat_pct(&map_lat, 50);
+	res->map_p99 = lat_pct(&map_lat, 99);
+	res->unmap_p50 = lat_pct(&unmap_lat, 50);
+	res->unmap_p99 = lat_pct(&unmap_lat, 99);
+
+out:
+	if (container >= 0) {
+		ioctl(w->group, VFIO_GROUP_UNSET_CONTAINER);
+		close(container);
+	}
+	munmap(buf, WORK_SIZE);
+	lat_free(&map_lat);
+	lat_free(&unmap_lat);
+	return res->error ? -1 : 0;
+}
+
+void *worker_thread(void *arg)
+{
+	worker_run(arg);
+	return NULL;
+}
+
+static double worker_rate(struct worker_result *res)
+{
+	return res->wall_ns ? res->maps * 1e9 / res->wall_ns : 0;
+}
+
+/* Returns the aggregate map rate, or -1 */
+double run_step(struct worker *workers, int k, int use_procs, int nr_groups,
+		int verbose)
+{
+	struct worker_result *res;
+	unsigned long long setup_max = 0, map_p99 = 0, unmap_p99 = 0;
+	double rate, total = 0, min = 0, max = 0;
+	unsigned long maps = 0;
+	struct results_phase phase;
+	char params[128];
+	int i, gate[2], failed = 0;
+
+	res = mmap(NULL, k * sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED || pipe(gate)) {
+		printf("Failed to set up step (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	results_phase_start(&results, &phase);
+
+	for (i = 0; i < k; i++) {
+		workers[i].result = &res[i];
+		workers[i].gate = gate[0];
+
+		if (!use_procs) {
+			if (pthread_create(&workers[i].thread, NULL,
+					   worker_thread, &workers[i])) {
+				printf("Failed to create thread %d\n", i);
+				return -1;
+			}
+			continue;
+		}
+
+		workers[i].pid = fork();
+		if (workers[i].pid < 0) {
+			printf("Failed to fork worker %d (%s)\n",
+			       i, strerror(errno));
+			return -1;
+		}
+
+		if (!workers[i].pid) {
+			close(gate[1]);
+			_exit(worker_run(&workers[i]) ? 1 : 0);
+		}
+	}
+
+	/* Everyone's set up and waiting, go */
+	close(gate[1]);
+
+	for (i = 0; i < k; i++) {
+		if (use_procs)
+			waitpid(workers[i].pid, NULL, 0);
+		else
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	close(gate[0]);
+
+	for (i = 0; i < k; i++) {
+		if (res[i].error) {
+			printf("  container %d failed (%s)\n",
+			       i, strerror(res[i].error));
+			failed++;
+			continue;
+		}
+
+		rate = worker_rate(&res[i]);
+		total += rate;
+		min = !min || rate < min ? rate : min;
+		max = rate > max ? rate : max;
+		setup_max = MAX(setup_max, res[i].setup_ns);
+		map_p99 = MAX(map_p99, res[i].map_p99);
+		unmap_p99 = MAX(unmap_p99, res[i].unmap_p99);
+		maps += res[i].maps;
+
+		if (verbose)
+			printf("  %4d %-9s %10.0f maps/s, map p50 %6llu "
+			       "p99 %6llu ns, unmap p50 %8llu p99 %8llu ns, "
+			       "setup %llu us\n", i,
+			       i < nr_groups ? "vfio" : "simulated", rate,
+			       res[i].map_p50, res[i].map_p99,
+			       res[i].unmap_p50, res[i].unmap_p99,
+			       res[i].setup_ns / 1000);
+	}
+
+	printf("%4d %12.0f %10.0f %10.0f %10.0f %10llu %12llu %10llu\n",
+	       k, total, min, k > failed ? total / (k - failed) : 0, max,
+	       map_p99, unmap_p99, setup_max / 1000);
+
+	snprintf(params, sizeof(params), "\"containers\":%d,\"vfio\":%d,"
+		 "\"mode\":\"%s\",\"chunk\":%d", k, MIN(k, nr_groups),
+		 use_procs ? "procs" : "threads", MAP_CHUNK);
+	results_phase_end(&results, &phase, "aggregate", params,
+			  maps, (unsigned long long)maps * MAP_CHUNK, NULL, NULL);
+
+	munmap(res, k * sizeof(*res));
+	return failed ? -1 : total;
+}
+
+int main(int argc, char **argv)
+{
+	int i, k, max_k, seconds, use_procs, nr_groups, groupid;
+	struct worker *workers;
+	double rate, base = 0;
+	char path[50];
+	struct vfio_group_status group_status = {
+		.argsz = sizeof(group_status)
+	};
+
+	if (argc < 4 || sscanf(argv[1], "%d", &max_k) != 1 || max_k < 1 ||
+	    sscanf(argv[2], "%d", &seconds) != 1 || seconds < 1 ||
+	    (strcmp(argv[3], "threads") && strcmp(argv[3], "procs"))) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	use_procs = !strcmp(argv[3], "procs");
+	nr_groups = MIN(argc - 4, max_k);
+
+	workers = calloc(max_k, sizeof(*workers));
+	if (!workers) {
+		printf("Failed to allocate workers\n");
+		return -1;
+	}
+
+	for (i = 0; i < max_k; i++) {
+		workers[i].index = i;
+		workers[i].group = -1;
+		workers[i].seconds = seconds;
+
+		if (i >= nr_groups)
+			continue;
+
+		if (sscanf(argv[4 + i], "%d", &groupid) != 1) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
+		workers[i].group = open(path, O_RDWR);
+		if (workers[i].group < 0) {
+			printf("Failed to open %s, %d (%s)\n",
+			       path, workers[i].group, strerror(errno));
+			return -1;
+		}
+
+		if (ioctl(workers[i].group, VFIO_GROUP_GET_STATUS,
+			  &group_status)) {
+			printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
+			return -1;
+		}
+
+		if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+			printf("Group %d not viable, are all devices attached to vfio?\n",
+			       groupid);
+			return -1;
+		}
+	}
+
+	if (results_open(&results, "vfio-iommu-multi-container"))
+		return -1;
+	snprintf(results.iommu, sizeof(results.iommu), "%s",
+		 nr_groups ? "TYPE1" : "none");
+
+	printf("%d vfio containers, %d simulated, %s, %luM in %dK maps\n",
+	       nr_groups, max_k - nr_groups, use_procs ? "processes" :
+	       "threads", WORK_SIZE >> 20, MAP_CHUNK >> 10);
+	printf("%4s %12s %10s %10s %10s %10s %12s %10s\n", "K",
+	       "maps/s", "min", "avg", "max", "map p99", "unmap p99",
+	       "setup us");
+
+	for (k = 1; ; k = MIN(k * 2, max_k)) {
+		rate = run_step(workers, k, use_procs, nr_groups, k == max_k);
+		if (rate < 0)
+			return -1;
+
+		/*
+		 * The single container baseline only means something against
+		 * containers on the same backend as it, vfio if any groups
+		 * were given, simulated otherwise.
+		 */
+		if (k == 1)
+			base = rate;
+		else if (k <= nr_groups || !nr_groups)
+			printf("%4s efficiency %.0f%% of %d x 1 container\n",
+			       "", base ? rate * 100 / (base * k) : 0, k);
+		else
+			printf("%4s efficiency n/a, %d vfio + %d simulated "
+			       "containers\n", "", nr_groups, k - nr_groups);
+
+		if (k == max_k)
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define CAPACITY_NS	(1000000000ULL)	/* closed-loop calibration */
+#define GRACE_NS	(1000000000ULL)	/* issuing past the window */
+#define KNEE_GOODPUT	0.95		/* of offered load */
+#define KNEE_P99	10		/* times the lightest load's p99 */
+#define SPIN_NS		(200000ULL)	/* spin, don't sleep, this close */
+
+/*
+ * Open-loop map/unmap load.  Each operation maps a chunk and unmaps it
+ * again, and operations are scheduled at a fixed arrival rate, evenly
+ * spaced or as a Poisson process, whether or not the previous one has
+ * finished.  Latency is taken from the intended start, so time spent
+ * queued behind a slow operation counts, and operations still unissued
+ * when the window (plus GRACE_NS) closes are recorded with the time they
+ * had waited so far rather than dropped.
+ *
+ * The closed-loop rate is measured first and the offered load swept from
+ * 10% to 150% of it.  The knee is the last load where goodput keeps up
+ * with the offered rate and p99 stays within KNEE_P99 times the lightest
+ * load's.  Without a group the host side is simulated with mlock().
+ *
+ * This is a tool of its own rather than a mode of vfio-iommu-map-unmap:
+ * that loop's unit of work is a whole map-then-unmap-everything cycle,
+ * while an open-loop schedule needs small independent operations.
+ *
+ * Build: cc -o vfio-iommu-open-loop vfio-iommu-open-loop.c -lm
+ */
+struct step {
+	double offered, achieved;
+	unsigned long issued, scheduled;
+	struct lat_stats lat;		/* from intended start */
+	struct lat_stats service;	/* from actual start */
+};
+
+static struct results results;
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+void usage(char *name)
+{
+	printf("usage: %s <chunk KB> <seconds per step> <const|poisson> [iommu group id]\n",
+	       name);
+	printf("\tchunk:   size of each map/unmap\n");
+	printf("\tconst:   evenly spaced arrivals\n");
+	printf("\tpoisson: exponentially distributed inter-arrival times\n");
+	printf("\twithout a group the host side is simulated with mlock\n");
+}
+
+/* Uniform in (0, 1] */
+static double rng_unit(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return ((rng_state >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+
+int map_unmap(int container, void *buf, unsigned long size)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = (unsigned long)buf,
+		.size = size,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = size,
+	};
+
+	if (container < 0)
+		return mlock(buf, size) || munlock(buf, size);
+
+	return ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map) ||
+	       ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+}
+
+/* Back to back for CAPACITY_NS, ops/s */
+double capacity(int container, void *buf, unsigned long size)
+{
+	unsigned long long start = now_ns(), t;
+	unsigned long ops = 0;
+
+	while ((t = now_ns()) - start < CAPACITY_NS) {
+		if (map_unmap(container, buf, size))
+			return -1;
+		ops++;
+	}
+
+	return ops * 1e9 / (t - start);
+}
+
+int run_step(struct step *st, int container, void *buf, unsigned long size,
+	     double rate, int seconds, int poisson)
+{
+	unsigned long long start, end, deadline, intended, t;
+	struct timespec ts;
+	double next = 0;
+
+	st->offered = rate;
+	start = now_ns();
+	end = start + seconds * 1000000000ULL;
+	deadline = end + GRACE_NS;
+
+	for (;;) {
+		intended = start + (unsigned long long)next;
+		if (intended >= end)
+			break;
+
+		t = now_ns();
+		if (t >= deadline) {
+			/* Never issued, waited at least this long */
+			lat_add(&st->lat, t - intended);
+			st->scheduled++;
+			goto advance;
+		}
+
+		/* Wakeup latency would otherwise be charged to the op */
+		if (t + SPIN_NS < intended) {
+			ts.tv_sec = (intended - t - SPIN_NS) / 1000000000ULL;
+			ts.tv_nsec = (intended - t - SPIN_NS) % 1000000000ULL;
+			nanosleep(&ts, NULL);
+		}
+		while ((t = now_ns()) < intended)
+			;
+
+		if (map_unmap(container, buf, size)) {
+			printf("Failed to map/unmap (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		lat_add(&st->lat, now_ns() - intended);
+		lat_add(&st->service, now_ns() - t);
+		st->issued++;
+		st->scheduled++;
+advance:
+		next += poisson ? -log(rng_unit()) * 1e9 / rate : 1e9 / rate;
+	}
+
+	st->achieved = st->issued * 1e9 / (now_ns() - start);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, seconds, poisson, groupid, container = -1, knee = -1;
+	static const int loads[] = { 10, 25, 50, 70, 80, 90, 95, 100, 110,
+				     125, 150 };
+	int nr_loads = sizeof(loads) / sizeof(loads[0]);
+	struct step steps[sizeof(loads) / sizeof(loads[0])];
+	struct results_phase phase;
+	unsigned long size;
+	double cap;
+	char params[192];
+	void *buf;
+
+	if (argc < 4 || sscanf(argv[1], "%lu", &size) != 1 || !size ||
+	    sscanf(argv[2], "%d", &seconds) != 1 || seconds < 1 ||
+	    (strcmp(argv[3], "const") && strcmp(argv[3], "poisson")) ||
+	    (argc > 4 && sscanf(argv[4], "%d", &groupid) != 1)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	poisson = !strcmp(argv[3], "poisson");
+	size <<= 10;
+
+	if (argc > 4) {
+		container = open_container(groupid, VFIO_TYPE1_IOMMU);
+		if (container < 0)
+			return -1;
+	}
+
+	if (results_open(&results, "vfio-iommu-open-loop"))
+		return -1;
+	if (container >= 0)
+		results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+
+	cap = capacity(container, buf, size);
+	if (cap <= 0) {
+		printf("Failed to map/unmap (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	printf("%luK map+unmap, %s arrivals, %s, closed-loop %.0f ops/s\n",
+	       size >> 10, poisson ? "Poisson" : "constant",
+	       container < 0 ? "simulated" : "vfio", cap);
+	printf("%5s %10s %10s %10s %10s %10s %10s %10s\n", "load",
+	       "offered/s", "achieved/s", "p50 ns", "p99 ns", "p99.9 ns",
+	       "max ns", "svc p50");
+
+	memset(steps, 0, sizeof(steps));
+
+	for (i = 0; i < nr_loads; i++) {
+		struct step *st = &steps[i];
+
+		results_phase_start(&results, &phase);
+		if (run_step(st, container, buf, size, cap * loads[i] / 100,
+			     seconds, poisson))
+			return -1;
+
+		/* The knee is the end of the first run of loads that keep up */
+		if (knee == i - 1 &&
+		    st->achieved >= st->offered * KNEE_GOODPUT &&
+		    lat_pct(&st->lat, 99) <= KNEE_P99 * lat_pct(&steps[0].lat, 99))
+			knee = i;
+
+		printf("%4d%% %10.0f %10.0f %10llu %10llu %10llu %10llu %10llu\n",
+		       loads[i], st->offered, st->achieved,
+		       lat_pct(&st->lat, 50), lat_pct(&st->lat, 99),
+		       lat_pct(&st->lat, 99.9), lat_pct(&st->lat, 100),
+		       lat_pct(&st->service, 50));
+
+		snprintf(params, sizeof(params), "\"chunk\":%lu,"
+			 "\"arrivals\":\"%s\",\"load\":%d", size,
+			 poisson ? "poisson" : "const", loads[i]);
+		snprintf(phase.extra, sizeof(phase.extra), "\"offered\":%.0f,"
+			 "\"achieved\":%.0f,\"capacity\":%.0f", st->offered,
+			 st->achieved, cap);
+		results_phase_end(&results, &phase, "open-loop", params,
+				  st->issued, st->issued * size, &st->lat,
+				  NULL);
+	}
+
+	if (knee < 0)
+		printf("No load kept up, knee below %d%%\n", loads[0]);
+	else
+		printf("Knee at %d%% load: %.0f ops/s offered, p99 %llu ns%s\n",
+		       loads[knee], steps[knee].offered,
+		       lat_pct(&steps[knee].lat, 99),
+		       knee == nr_loads - 1 ? " (not reached)" : "");
+
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * IOMMU page size aware mapping plans.
+ *
+ * The IOMMU can only use a page size for a stretch of a mapping where
+ * both the iova and the vaddr are aligned to it, so a region is best
+ * described as runs of uniform page size: small pages up to the first
+ * boundary of the next size up, the biggest pages the region allows in
+ * the middle, and stepping back down towards the end.  iommu_plan_split()
+ * produces exactly those runs from the VFIO_IOMMU_GET_INFO page size
+ * bitmap, one mapping per run, and counts the IOMMU pages (IOTLB entries)
+ * they take if the backing is at least as large as the page size.
+ *
+ * A page size is only usable at all if vaddr and iova are congruent
+ * modulo it, so guest memory should be allocated with
+ * iommu_plan_mmap() aligned to iommu_plan_align() of the guest layout.
+ *
+ * Include after the VFIO uapi definitions (embedded copy or
+ * <linux/vfio.h>).
+ */
+#ifndef VFIO_IOMMU_PLAN_H
+#define VFIO_IOMMU_PLAN_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+struct iommu_plan_map {
+	__u64	vaddr;
+	__u64	iova;
+	__u64	size;
+	__u64	pgsize;		/* IOMMU page size used for the run */
+};
+
+struct iommu_plan {
+	int	nr, max;
+	struct iommu_plan_map *maps;
+	unsigned long long pages;	/* IOTLB footprint of all runs */
+};
+
+/* Supported IOMMU page sizes, falling back to the CPU page size */
+static inline __u64 iommu_pgsizes(int container)
+{
+	struct vfio_iommu_type1_info info = {
+		.argsz = sizeof(info),
+	};
+
+	if (!ioctl(container, VFIO_IOMMU_GET_INFO, &info) &&
+	    (info.flags & VFIO_IOMMU_INFO_PGSIZES) && info.iova_pgsizes)
+		return info.iova_pgsizes;
+
+	return getpagesize();
+}
+
+static inline __u64 iommu_pgsize_min(__u64 pgsizes)
+{
+	return pgsizes & -pgsizes;
+}
+
+/* Largest page size no bigger than size, for aligning a backing */
+static inline __u64 iommu_plan_align(__u64 pgsizes, __u64 size)
+{
+	__u64 align = iommu_pgsize_min(pgsizes);
+
+	for (; pgsizes; pgsizes &= pgsizes - 1)
+		if ((pgsizes & -pgsizes) <= size)
+			align = pgsizes & -pgsizes;
+
+	return align;
+}
+
+static inline void iommu_pgsizes_print(__u64 pgsizes)
+{
+	__u64 p;
+
+	for (; pgsizes; pgsizes &= pgsizes - 1) {
+		p = pgsizes & -pgsizes;
+		if (p >= 1ULL << 30)
+			printf(" %lluG", p >> 30);
+		else if (p >= 1ULL << 20)
+			printf(" %lluM", p >> 20);
+		else
+			printf(" %lluK", p >> 10);
+	}
+}
+
+static inline int iommu_plan_add(struct iommu_plan *plan, __u64 vaddr,
+				 __u64 iova, __u64 size, __u64 pgsize)
+{
+	if (plan->nr == plan->max) {
+		int max = plan->max ? plan->max * 2 : 8;
+		struct iommu_plan_map *tmp;
+
+		tmp = realloc(plan->maps, max * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		plan->maps = tmp;
+		plan->max = max;
+	}
+
+	plan->maps[plan->nr].vaddr = vaddr;
+	plan->maps[plan->nr].iova = iova;
+	plan->maps[plan->nr].size = size;
+	plan->maps[plan->nr].pgsize = pgsize;
+	plan->nr++;
+	plan->pages += size / pgsize;
+	return 0;
+}
+
+/*
+ * Append the runs covering (vaddr, iova, size) to plan.  Fails with
+ * EINVAL if the region isn't aligned to the smallest page size.
+ */
+static inline int iommu_plan_split(struct iommu_plan *plan, __u64 pgsizes,
+				   __u64 vaddr, __u64 iova, __u64 size)
+{
+	__u64 usable = 0, p, q, len, next, end = iova + size, sizes;
+
+	/* Only sizes vaddr and iova are congruent modulo can ever be used */
+	for (sizes = pgsizes; sizes; sizes &= sizes - 1) {
+		p = sizes & -sizes;
+		if (!((vaddr - iova) & (p - 1)))
+			usable |= p;
+	}
+
+	while (iova < end) {
+		/* Largest usable page aligned here that fits */
+		for (p = 0, sizes = usable; sizes; sizes &= sizes - 1) {
+			q = sizes & -sizes;
+			if (!(iova & (q - 1)) && q <= end - iova)
+				p = q;
+		}
+
+		if (!p) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		len = (end - iova) & ~(p - 1);
+
+		/*
+		 * Stop at the first boundary of the next size up if a page of
+		 * it fits there, no larger size can be reached any sooner.
+		 */
+		sizes = usable & ~((p << 1) - 1);
+		if (sizes) {
+			q = sizes & -sizes;
+			next = (iova + q - 1) & ~(q - 1);
+			if (next + q <= end && next - iova < len)
+				len = next - iova;
+		}
+
+		if (iommu_plan_add(plan, vaddr, iova, len, p))
+			return -1;
+
+		vaddr += len;
+		iova += len;
+	}
+
+	return 0;
+}
+
+static inline void iommu_plan_free(struct iommu_plan *plan)
+{
+	free(plan->maps);
+	memset(plan, 0, sizeof(*plan));
+}
+
+/* One line: number of runs and IOMMU pages of each size */
+static inline void iommu_plan_print(struct iommu_plan *plan)
+{
+	unsigned long long pages[64] = { 0 };
+	int i;
+
+	printf("%d run%s, %llu IOMMU pages:", plan->nr,
+	       plan->nr == 1 ? "" : "s", plan->pages);
+
+	for (i = 0; i < plan->nr; i++)
+		pages[__builtin_ctzll(plan->maps[i].pgsize)] +=
+			plan->maps[i].size / plan->maps[i].pgsize;
+
+	for (i = 0; i < 64; i++) {
+		if (!pages[i])
+			continue;
+		printf(" %llu x", pages[i]);
+		iommu_pgsizes_print(1ULL << i);
+	}
+
+	printf("\n");
+}
+
+/*
+ * mmap() with the returned address aligned to align, by reserving the
+ * slop up front and placing the real mapping over it.
+ */
+static inline void *iommu_plan_mmap(size_t size, size_t align, int prot,
+				    int flags, int fd)
+{
+	unsigned long base, aligned;
+	void *addr;
+
+	base = (unsigned long)mmap(NULL, size + align, PROT_NONE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				   -1, 0);
+	if ((void *)base == MAP_FAILED)
+		return MAP_FAILED;
+
+	aligned = (base + align - 1) & ~(align - 1);
+
+	addr = mmap((void *)aligned, size, prot, flags | MAP_FIXED, fd, 0);
+	if (addr == MAP_FAILED) {
+		munmap((void *)base, size + align);
+		return MAP_FAILED;
+	}
+
+	if (aligned > base)
+		munmap((void *)base, aligned - base);
+	if (base + align > aligned)
+		munmap((void *)(aligned + size), base + align - aligned);
+
+	return addr;
+}
+
+#endif /* VFIO_IOMMU_PLAN_H */
@@ -393,124 +393,102 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include "vfio-bench.h"
+#include "vfio-map-coalesce.h"
+
 #define MAP_SIZE (1UL * 1024 * 1024 * 1024)
 #define MAP_MAX 1024
 #define DMA_CHUNK (2UL * 1024 * 1024)
+#define COALESCE_MAX (16 * DMA_CHUNK)
+
+static struct results results;
+static char params[128];
 
 void usage(char *name)
 {
-	printf("usage: %s ssss:bb:dd.f\n", name);
+	printf("usage: %s ssss:bb:dd.f [type1|type1v2|matrix|coalesce] [perf]\n",
+	       name);
 	printf("\tssss: PCI segment, ex. 0000\n");
 	printf("\tbb:   PCI bus, ex. 01\n");
 	printf("\tdd:   PCI device, ex. 06\n");
 	printf("\tf:    PCI function, ex. 0\n");
+	printf("\ttype1|type1v2: IOMMU model, default type1\n");
+	printf("\tmatrix: run under each model and compare\n");
+	printf("\tcoalesce: run again through the map coalescer and compare\n");
+	printf("\tperf: report perf counters per map/unmap ioctl\n");
 }
 
-int main(int argc, char **argv)
-{
-	int seg, bus, slot, func;
-	int ret, container, group, groupid;
-	char path[50], iommu_group_path[50], *group_name;
-	struct stat st;
-	ssize_t len;
-	unsigned long i, j, vaddr;
-	struct vfio_group_status group_status = {
-		.argsz = sizeof(group_status)
-	};
-	struct vfio_iommu_type1_dma_map dma_map = {
-		.argsz = sizeof(dma_map)
-	};
-	struct vfio_iommu_type1_dma_unmap dma_unmap = {
-		.argsz = sizeof(dma_unmap)
-	};
-
-	if (argc != 2) {
-		usage(argv[0]);
-		return -1;
-	}
-
-	ret = sscanf(argv[1], "%04x:%02x:%02x.%d", &seg, &bus, &slot, &func);
-	if (ret != 4) {
-		usage(argv[0]);
-		return -1;
-	}
-
-	container = open("/dev/vfio/vfio", O_RDWR);
-	if (container < 0) {
-		printf("Failed to open /dev/vfio/vfio, %d (%s)\n",
-		       container, strerror(errno));
-		return container;
-	}
-
-	snprintf(path, sizeof(path),
-		 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/",
-		 seg, bus, slot, func);
-
-	ret = stat(path, &st);
-	if (ret < 0) {
-		printf("No such device\n");
-		return  ret;
-	}
-
-	strncat(path, "iommu_group", sizeof(path) - strlen(path) - 1);
+struct stress_stats {
+	struct lat_stats map;
+	struct lat_stats unmap;
+	unsigned long long map_ns, unmap_ns;	/* phase wall time */
+	unsigned long map_ioctls, unmap_ioctls;
+};
 
-	len = readlink(path, iommu_group_path, sizeof(iommu_group_path));
-	if (len <= 0) {
-		printf("No iommu_group for device\n");
-		return -1;
-	}
+static inline int timed_ioctl(int fd, unsigned long request, void *arg,
+			      struct lat_stats *lat)
+{
+	unsigned long long start = now_ns();
+	int ret;
 
-	iommu_group_path[len] = 0;
-	group_name = basename(iommu_group_path);
+	ret = ioctl(fd, request, arg);
+	lat_add(lat, now_ns() - start);
+	return ret;
+}
 
-	if (sscanf(group_name, "%d", &groupid) != 1) {
-		printf("Unknown group\n");
-		return -1;
-	}
+/* Requests go through the coalescer if there is one */
+static int stress_map(int container, struct map_coalescer *co,
+		      struct vfio_iommu_type1_dma_map *dma_map,
+		      struct lat_stats *lat)
+{
+	unsigned long long start = now_ns();
+	int ret;
 
-	snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
-	group = open(path, O_RDWR);
-	if (group < 0) {
-		printf("Failed to open %s, %d (%s)\n",
-		       path, group, strerror(errno));
-		return group;
-	}
+	if (!co)
+		return timed_ioctl(container, VFIO_IOMMU_MAP_DMA, dma_map, lat);
 
-	ret = ioctl(group, VFIO_GROUP_GET_STATUS, &group_status);
-	if (ret) {
-		printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
-		return ret;
-	}
+	ret = coalesce_map(co, dma_map->vaddr, dma_map->iova,
+			   dma_map->size, dma_map->flags);
+	lat_add(lat, now_ns() - start);
+	return ret;
+}
 
-	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
-		printf("Group not viable, are all devices attached to vfio?\n");
-		return -1;
-	}
+static int stress_unmap(int container, struct map_coalescer *co,
+			struct vfio_iommu_type1_dma_unmap *dma_unmap,
+			struct lat_stats *lat)
+{
+	unsigned long long start = now_ns();
+	int ret;
 
-	ret = ioctl(group, VFIO_GROUP_SET_CONTAINER, &container);
-	if (ret) {
-		printf("Failed to set group container\n");
-		return ret;
-	}
+	if (!co)
+		return timed_ioctl(container, VFIO_IOMMU_UNMAP_DMA, dma_unmap,
+				   lat);
 
-	ret = ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
-	if (ret) {
-		printf("Failed to set IOMMU\n");
-		return ret;
-	}
+	ret = coalesce_unmap(co, dma_unmap->iova, dma_unmap->size);
+	lat_add(lat, now_ns() - start);
+	return ret;
+}
 
-	vaddr = (unsigned long)mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE,
-				    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	if (!vaddr) {
-		printf("Failed to allocate memory\n");
-		return -1;
-	}
-printf("%lx\n", vaddr);
+int stress_run(int container, unsigned long vaddr, struct map_coalescer *co,
+	       struct perf_counters *perf, struct stress_stats *stats)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map)
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap)
+	};
+	struct results_phase phase;
+	unsigned long i, j, ops;
+	int ret;
 
 	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
 
 	printf("Mapping:   0%%");
 	fflush(stdout);
+	results_phase_start(&results, &phase);
+	stats->map_ns = now_ns();
+	perf_start(perf);
 	for (i = 0; i < MAP_MAX; i++) {
 		dma_map.size = DMA_CHUNK;
 
@@ -521,7 +499,8 @@ printf("%lx\n", vaddr);
 			dma_map.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 			dma_map.vaddr = vaddr + (j * DMA_CHUNK);
 
-			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+			ret = stress_map(container, co, &dma_map,
+					 &stats->map);
 			if (ret) {
 				printf("Failed to map memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -534,7 +513,8 @@ printf("%lx\n", vaddr);
 			dma_map.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 			dma_map.vaddr = vaddr + (j * DMA_CHUNK);
 
-			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+			ret = stress_map(container, co, &dma_map,
+					 &stats->map);
 			if (ret) {
 				printf("Failed to map memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -546,7 +526,8 @@ printf("%lx\n", vaddr);
 			dma_map.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 			dma_map.vaddr = vaddr + (j * DMA_CHUNK);
 
-			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+			ret = stress_map(container, co, &dma_map,
+					 &stats->map);
 			if (ret) {
 				printf("Failed to map memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -558,7 +539,8 @@ printf("%lx\n", vaddr);
 			dma_map.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 			dma_map.vaddr = vaddr + (j * DMA_CHUNK);
 
-			ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+			ret = stress_map(container, co, &dma_map,
+					 &stats->map);
 			if (ret) {
 				printf("Failed to map memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -572,10 +554,28 @@ printf("%lx\n", vaddr);
 			fflush(stdout);
 		}
 	}
+	/* A GB is one batch, so this only catches a partial last one */
+	if (co && coalesce_flush(co)) {
+		printf("Failed to map memory (%s)\n", strerror(errno));
+		return -1;
+	}
+	perf_stop(perf);
+	stats->map_ns = now_ns() - stats->map_ns;
 	printf("\b\b\b\b100%%\n");
 
+	/* Every third GB is skipped, the rest fully mapped in 2M chunks */
+	ops = (MAP_MAX - (MAP_MAX + 2) / 3) * (MAP_SIZE / DMA_CHUNK);
+	stats->map_ioctls = co ? co->map_ioctls : ops;
+	perf_print(perf, "Mapping", ops);
+	results_phase_end(&results, &phase, "map", params,
+			  ops, ops * DMA_CHUNK, NULL, perf);
+	perf_clear(perf);
+
 	printf("Unmapping:   0%%");
 	fflush(stdout);
+	results_phase_start(&results, &phase);
+	stats->unmap_ns = now_ns();
+	perf_start(perf);
 	for (i = 0; i < MAP_MAX; i++) {
 		dma_unmap.size = DMA_CHUNK;
 
@@ -585,8 +585,8 @@ printf("%lx\n", vaddr);
 		for (j = 0; j < MAP_SIZE / DMA_CHUNK / 2; j += 2) {
 			dma_unmap.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 
-			ret = ioctl(container,
-				    VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+			ret = stress_unmap(container, co, &dma_unmap,
+					   &stats->unmap);
 			if (ret) {
 				printf("Failed to unmap memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -599,8 +599,8 @@ printf("%lx\n", vaddr);
 		     j > MAP_SIZE / DMA_CHUNK / 2; j -= 2) {
 			dma_unmap.iova = (i * MAP_SIZE) + (j * DMA_CHUNK);
 
-			ret = ioctl(container,
-				    VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+			ret = stress_unmap(container, co, &dma_unmap,
+					   &stats->unmap);
 			if (ret) {
 				printf("Failed to unmap memory %d/%d (%s)\n",
 				       i, j, strerror(errno));
@@ -614,7 +614,211 @@ printf("%lx\n", vaddr);
 			fflush(stdout);
 		}
 	}
+	perf_stop(perf);
+	stats->unmap_ns = now_ns() - stats->unmap_ns;
 	printf("\b\b\b\b100%%\n");
 
+	/* Two half-range passes unmapping every other chunk */
+	ops = (MAP_MAX - (MAP_MAX + 2) / 3) * (MAP_SIZE / DMA_CHUNK / 2);
+	stats->unmap_ioctls = ops;
+	if (co) {
+		/* Remapping around a cut is paid for by the unmap */
+		stats->unmap_ioctls = co->unmap_ioctls + co->remaps;
+		printf("Coalesced %lu requests into %lu maps, %lu unmaps, "
+		       "%lu remaps of %lluM\n", co->requests,
+		       stats->map_ioctls, co->unmap_ioctls, co->remaps,
+		       co->remap_bytes >> 20);
+	}
+	perf_print(perf, "Unmapping", ops);
+	results_phase_end(&results, &phase, "unmap", params,
+			  ops, ops * DMA_CHUNK, NULL, perf);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int seg, bus, slot, func;
+	int ret, container, group, groupid;
+	char path[50], iommu_group_path[50], *group_name;
+	struct stat st;
+	ssize_t len;
+	unsigned long vaddr;
+	struct perf_counters perf = { 0 };
+	struct stress_stats stats[2] = { 0 };
+	struct map_coalescer co;
+	int models[2] = { VFIO_TYPE1_IOMMU, VFIO_TYPE1v2_IOMMU };
+	int i, nr_models = 1, use_perf = 0, use_coalesce = 0, split;
+	struct vfio_group_status group_status = {
+		.argsz = sizeof(group_status)
+	};
+
+	if (argc > 2 && !strcmp(argv[argc - 1], "perf")) {
+		use_perf = 1;
+		argc--;
+	}
+
+	models[0] = iommu_model_arg(&argc, argv);
+
+	if (argc == 3 && !strcmp(argv[2], "matrix")) {
+		models[0] = VFIO_TYPE1_IOMMU;
+		nr_models = 2;
+	} else if (argc == 3 && !strcmp(argv[2], "coalesce")) {
+		/* Same model twice, direct then coalesced */
+		models[1] = models[0];
+		nr_models = 2;
+		use_coalesce = 1;
+	} else if (argc != 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	ret = sscanf(argv[1], "%04x:%02x:%02x.%d", &seg, &bus, &slot, &func);
+	if (ret != 4) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	container = open("/dev/vfio/vfio", O_RDWR);
+	if (container < 0) {
+		printf("Failed to open /dev/vfio/vfio, %d (%s)\n",
+		       container, strerror(errno));
+		return container;
+	}
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/",
+		 seg, bus, slot, func);
+
+	ret = stat(path, &st);
+	if (ret < 0) {
+		printf("No such device\n");
+		return  ret;
+	}
+
+	strncat(path, "iommu_group", sizeof(path) - strlen(path) - 1);
+
+	len = readlink(path, iommu_group_path, sizeof(iommu_group_path));
+	if (len <= 0) {
+		printf("No iommu_group for device\n");
+		return -1;
+	}
+
+	iommu_group_path[len] = 0;
+	group_name = basename(iommu_group_path);
+
+	if (sscanf(group_name, "%d", &groupid) != 1) {
+		printf("Unknown group\n");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
+	group = open(path, O_RDWR);
+	if (group < 0) {
+		printf("Failed to open %s, %d (%s)\n",
+		       path, group, strerror(errno));
+		return group;
+	}
+
+	ret = ioctl(group, VFIO_GROUP_GET_STATUS, &group_status);
+	if (ret) {
+		printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
+		return ret;
+	}
+
+	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		printf("Group not viable, are all devices attached to vfio?\n");
+		return -1;
+	}
+
+	ret = ioctl(group, VFIO_GROUP_SET_CONTAINER, &container);
+	if (ret) {
+		printf("Failed to set group container\n");
+		return ret;
+	}
+
+	ret = ioctl(container, VFIO_SET_IOMMU, models[0]);
+	if (ret) {
+		printf("Failed to set IOMMU\n");
+		return ret;
+	}
+
+	if (results_open(&results, "vfio-iommu-stress-test"))
+		return -1;
+
+	vaddr = (unsigned long)mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	if (!vaddr) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+printf("%lx\n", vaddr);
+
+	if (use_perf && perf_init(&perf))
+		return -1;
+
+	for (i = 0; i < nr_models; i++) {
+		if (i) {
+			container = iommu_container_switch(group, container,
+							   models[i]);
+			if (container < 0) {
+				printf("Failed to switch to %s (%s)\n",
+				       iommu_model_name(models[i]),
+				       strerror(errno));
+				return -1;
+			}
+		}
+
+		results_set_iommu(&results, container, models[i]);
+
+		split = iommu_split_unmap_probe(container, models[i], 0);
+		if (split < 0)
+			printf("%s: split unmap probe failed (%s)\n",
+			       iommu_model_name(models[i]), strerror(errno));
+		else
+			printf("%s: split unmap %s\n",
+			       iommu_model_name(models[i]),
+			       split ? "allowed" : "rejected");
+
+		if (use_coalesce && i &&
+		    coalesce_init(&co, container, COALESCE_MAX,
+				  MAP_SIZE / DMA_CHUNK)) {
+			printf("Failed to allocate coalescer\n");
+			return -1;
+		}
+
+		snprintf(params, sizeof(params), "\"chunk\":%lu,\"gb\":%d,"
+			 "\"coalesce\":%lu", DMA_CHUNK, MAP_MAX,
+			 use_coalesce && i ? COALESCE_MAX : 0);
+
+		ret = stress_run(container, vaddr,
+				 use_coalesce && i ? &co : NULL, &perf,
+				 &stats[i]);
+		if (ret)
+			return ret;
+		if (use_coalesce && i)
+			coalesce_free(&co);
+		perf_clear(&perf);
+	}
+
+	if (use_coalesce) {
+		matrix_header("direct", "coalesced");
+		matrix_row("map ioctls", stats[0].map_ioctls,
+			   stats[1].map_ioctls);
+		matrix_row("map ms", stats[0].map_ns / 1e6,
+			   stats[1].map_ns / 1e6);
+		matrix_row("unmap ioctls", stats[0].unmap_ioctls,
+			   stats[1].unmap_ioctls);
+		matrix_row("unmap ms", stats[0].unmap_ns / 1e6,
+			   stats[1].unmap_ns / 1e6);
+		matrix_lat("map", &stats[0].map, &stats[1].map);
+		matrix_lat("unmap", &stats[0].unmap, &stats[1].unmap);
+	} else if (nr_models > 1) {
+		matrix_header(iommu_model_name(models[0]),
+			      iommu_model_name(models[1]));
+		matrix_lat("map", &stats[0].map, &stats[1].map);
+		matrix_lat("unmap", &stats[0].unmap, &stats[1].unmap);
+	}
+
 	return 0;
 }
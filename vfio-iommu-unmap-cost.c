@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+#include "vfio-iommu-plan.h"
+
+#define MIN_SIZE	(4096UL)
+#define REPS		8
+#define REPS_LARGE	2		/* above 1G */
+#define MAX_BACKINGS	8
+#define MAX_POINTS	(MAX_BACKINGS * 64)
+
+/*
+ * How unmap latency scales with the size unmapped and the backing page
+ * size.  Regions from 4K up to the maximum given, in powers of two, are
+ * mapped and unmapped whole, one ioctl each, over 4K anonymous memory,
+ * THP and each hugetlbfs path (a 1G mount for 1G pages).  Each goes at
+ * the bottom of the largest iova range the container reports, clear of
+ * reserved windows such as the x86 MSI one, with the vaddr and iova
+ * aligned alike so the IOMMU can use its largest pages.  A backing stops
+ * at the first size that doesn't fit the range or the host can't pin.
+ *
+ * The median unmap of every size and backing is fitted to
+ *
+ *   ns = fixed + per_byte * bytes + per_page * backing pages
+ *
+ * minimising relative error, so the 4K points count as much as the 64G
+ * ones.  Bytes and pages only come apart across page sizes, so with a
+ * single backing the per-page term is folded into the per-byte one.
+ */
+struct backing {
+	char name[PATH_MAX + 32];
+	const char *kind;	/* anon, thp or hugetlbfs, for results */
+	const char *path;	/* hugetlbfs mount, NULL for anonymous */
+	int advice;		/* madvise() for anonymous memory */
+	unsigned long pagesize;
+	unsigned long max;
+	int points;
+};
+
+struct point {
+	struct backing *backing;
+	unsigned long size;
+	unsigned long long unmap_ns;
+};
+
+static struct results results;
+
+void usage(char *name)
+{
+	printf("usage: %s <max size MB> <iommu group id> [hugetlbfs path...]\n",
+	       name);
+	printf("\tmax size: largest region, e.g. 65536 for 64G\n");
+	printf("\tthe sweep covers 4K and THP anonymous memory and each hugetlbfs path\n");
+}
+
+char *size_str(char *buf, size_t len, unsigned long long size)
+{
+	if (size >= 1ULL << 30 && !(size & ((1ULL << 30) - 1)))
+		snprintf(buf, len, "%lluG", size >> 30);
+	else if (size >= 1ULL << 20 && !(size & ((1ULL << 20) - 1)))
+		snprintf(buf, len, "%lluM", size >> 20);
+	else
+		snprintf(buf, len, "%lluK", size >> 10);
+	return buf;
+}
+
+/* Populated backing of b->max bytes, aligned to align */
+void *backing_alloc(struct backing *b, unsigned long align, const char *prog)
+{
+	char path[PATH_MAX];
+	unsigned long i;
+	void *addr;
+	int fd;
+
+	if (!b->path) {
+		addr = iommu_plan_mmap(b->max, align, PROT_READ | PROT_WRITE,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1);
+		if (addr == MAP_FAILED)
+			return NULL;
+
+		/* Advise before the first touch so THP gets a say */
+		madvise(addr, b->max, b->advice);
+		for (i = 0; i < b->max; i += getpagesize())
+			((volatile char *)addr)[i] = 0;
+
+		return addr;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.XXXXXX", b->path, prog);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("Failed to open mempath file %s (%s)\n",
+		       path, strerror(errno));
+		return NULL;
+	}
+	unlink(path);
+
+	if (ftruncate(fd, b->max)) {
+		close(fd);
+		return NULL;
+	}
+
+	addr = iommu_plan_mmap(b->max, align, PROT_READ | PROT_WRITE,
+			       MAP_POPULATE | MAP_SHARED, fd);
+	close(fd);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+double model_ns(double *coef, struct point *p)
+{
+	unsigned long pagesize = p->backing->pagesize;
+
+	return coef[0] + coef[1] * p->size +
+	       coef[2] * ((p->size + pagesize - 1) / pagesize);
+}
+
+/*
+ * Weighted least squares for ns = x . coef over n (2 or 3) terms, each
+ * point weighted by 1 / ns^2.  Returns the worst relative error, or -1 if
+ * the terms can't be told apart.
+ */
+double fit(struct point *pts, int nr, int n, double *coef)
+{
+	double a[3][4] = { { 0 } }, x[3], f, err, worst = 0;
+	int i, j, k, p;
+
+	for (p = 0; p < nr; p++) {
+		double y = pts[p].unmap_ns;
+
+		x[0] = 1 / y;
+		x[1] = pts[p].size / (double)(1ULL << 30) / y;
+		x[2] = (pts[p].size + pts[p].backing->pagesize - 1) /
+		       pts[p].backing->pagesize / (double)(1 << 20) / y;
+
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < n; j++)
+				a[i][j] += x[i] * x[j];
+			a[i][n] += x[i];
+		}
+	}
+
+	/* Gaussian elimination with partial pivoting */
+	for (i = 0; i < n; i++) {
+		for (p = i, j = i + 1; j < n; j++)
+			if ((a[j][i] < 0 ? -a[j][i] : a[j][i]) >
+			    (a[p][i] < 0 ? -a[p][i] : a[p][i]))
+				p = j;
+		for (k = 0; k <= n; k++) {
+			f = a[i][k];
+			a[i][k] = a[p][k];
+			a[p][k] = f;
+		}
+		if (a[i][i] == 0)
+			return -1;
+
+		for (j = i + 1; j < n; j++) {
+			f = a[j][i] / a[i][i];
+			for (k = i; k <= n; k++)
+				a[j][k] -= f * a[i][k];
+		}
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		coef[i] = a[i][n];
+		for (j = i + 1; j < n; j++)
+			coef[i] -= a[i][j] * coef[j];
+		coef[i] /= a[i][i];
+	}
+	if (n < 3)
+		coef[2] = 0;
+
+	/* Back to ns, ns per byte and ns per page */
+	coef[1] /= 1ULL << 30;
+	coef[2] /= 1 << 20;
+
+	for (p = 0; p < nr; p++) {
+		err = (model_ns(coef, &pts[p]) - pts[p].unmap_ns) /
+		      pts[p].unmap_ns;
+		err = err < 0 ? -err : err;
+		worst = err > worst ? err : worst;
+	}
+
+	return worst;
+}
+
+int main(int argc, char **argv)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+	struct lat_stats map_lat = { 0 }, unmap_lat = { 0 };
+	struct backing backings[MAX_BACKINGS], *b;
+	unsigned long max, size, align, cap;
+	int container, groupid, nr_backings = 2, nr_pts = 0, i, j, r, n;
+	int pagesizes = 0;
+	struct point pts[MAX_POINTS];
+	struct results_phase phase;
+	unsigned long long start;
+	__u64 iova_start = 0, iova_end = ~0ULL, iova;
+	double coef[3], worst;
+	char params[256], buf[16];
+	struct statfs fs;
+	long long avail;
+	__u64 pgsizes;
+	void *vaddr;
+
+	if (argc < 3 || sscanf(argv[1], "%lu", &max) != 1 || !max ||
+	    sscanf(argv[2], "%d", &groupid) != 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc - 3 > MAX_BACKINGS - 2) {
+		printf("At most %d hugetlbfs paths\n", MAX_BACKINGS - 2);
+		return -1;
+	}
+
+	max <<= 20;
+
+	if (setrlimit(RLIMIT_MEMLOCK, &unlimited))
+		printf("Can't lift RLIMIT_MEMLOCK (%s), large sizes may fail\n",
+		       strerror(errno));
+
+	memset(backings, 0, sizeof(backings));
+	snprintf(backings[0].name, sizeof(backings[0].name),
+		 "%dK anonymous", getpagesize() >> 10);
+	backings[0].kind = "anon";
+	backings[0].advice = MADV_NOHUGEPAGE;
+	backings[0].pagesize = getpagesize();
+
+	snprintf(backings[1].name, sizeof(backings[1].name), "THP anonymous");
+	backings[1].kind = "thp";
+	backings[1].advice = MADV_HUGEPAGE;
+	backings[1].pagesize = 2 * 1024 * 1024;
+
+	/* Anonymous memory is populated up front, leave the host some */
+	avail = proc_field("/proc/meminfo", "MemAvailable");
+	cap = avail > 0 ? MIN(max, avail * 1024 / 4 * 3) : max;
+	backings[0].max = backings[1].max = cap;
+
+	for (i = 3; i < argc; i++) {
+		b = &backings[nr_backings++];
+
+		if (statfs(argv[i], &fs)) {
+			printf("Can't statfs on %s\n", argv[i]);
+			return -1;
+		}
+
+		b->kind = "hugetlbfs";
+		b->path = argv[i];
+		b->pagesize = fs.f_bsize;
+		b->max = MIN(max, (unsigned long)fs.f_bavail * fs.f_bsize);
+		snprintf(b->name, sizeof(b->name), "%ldK hugetlbfs %s",
+			 (long)fs.f_bsize >> 10, argv[i]);
+	}
+
+	/* Whole powers of two only */
+	for (i = 0; i < nr_backings; i++)
+		while (backings[i].max & (backings[i].max - 1))
+			backings[i].max &= backings[i].max - 1;
+
+	container = open_container(groupid, VFIO_TYPE1_IOMMU);
+	if (container < 0)
+		return -1;
+
+	if (results_open(&results, "vfio-iommu-unmap-cost"))
+		return -1;
+	results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	pgsizes = iommu_pgsizes(container);
+	printf("IOMMU page sizes:");
+	iommu_pgsizes_print(pgsizes);
+
+	if (!iova_range(container, &iova_start, &iova_end))
+		printf(", iova range 0x%llx-0x%llx",
+		       (unsigned long long)iova_start,
+		       (unsigned long long)iova_end);
+	printf("\n");
+
+	for (i = 0; i < nr_backings; i++) {
+		b = &backings[i];
+
+		if (b->max < MIN_SIZE) {
+			printf("%s: no memory to sweep\n", b->name);
+			continue;
+		}
+
+		align = MAX(iommu_plan_align(pgsizes, b->max), b->pagesize);
+		vaddr = backing_alloc(b, align, basename(argv[0]));
+		if (!vaddr) {
+			printf("Failed to allocate %s memory\n", b->name);
+			continue;
+		}
+
+		printf("%s, up to %s\n", b->name,
+		       size_str(buf, sizeof(buf), b->max));
+		printf("%8s %12s %12s %12s\n", "size", "map p50 ns",
+		       "unmap p50 ns", "unmap p99 ns");
+
+		/* Congruent with vaddr, so the same pages fit both sides */
+		iova = (iova_start + align - 1) / align * align;
+		dma_map.vaddr = (unsigned long)vaddr;
+		dma_map.iova = dma_unmap.iova = iova;
+
+		for (size = MIN_SIZE; size <= b->max; size *= 2) {
+			if (iova < iova_start || iova > iova_end ||
+			    iova_end - iova < size - 1) {
+				printf("%8s doesn't fit the iova range, "
+				       "stopping here\n",
+				       size_str(buf, sizeof(buf), size));
+				break;
+			}
+
+			dma_map.size = size;
+			lat_reset(&map_lat);
+			lat_reset(&unmap_lat);
+
+			results_phase_start(&results, &phase);
+			for (r = 0; r < (size > 1UL << 30 ? REPS_LARGE : REPS); r++) {
+				start = now_ns();
+				if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map))
+					break;
+				lat_add(&map_lat, now_ns() - start);
+
+				dma_unmap.size = size;
+				start = now_ns();
+				if (ioctl(container, VFIO_IOMMU_UNMAP_DMA,
+					  &dma_unmap) ||
+				    dma_unmap.size != size) {
+					printf("Failed to unmap %s (%s)\n",
+					       size_str(buf, sizeof(buf), size),
+					       strerror(errno));
+					return -1;
+				}
+				lat_add(&unmap_lat, now_ns() - start);
+			}
+
+			if (!unmap_lat.count) {
+				printf("%8s can't map (%s), stopping here\n",
+				       size_str(buf, sizeof(buf), size),
+				       strerror(errno));
+				break;
+			}
+
+			pts[nr_pts].backing = b;
+			pts[nr_pts].size = size;
+			pts[nr_pts].unmap_ns = lat_pct(&unmap_lat, 50);
+			nr_pts++;
+			b->points++;
+
+			printf("%8s %12llu %12llu %12llu\n",
+			       size_str(buf, sizeof(buf), size),
+			       lat_pct(&map_lat, 50), lat_pct(&unmap_lat, 50),
+			       lat_pct(&unmap_lat, 99));
+
+			snprintf(params, sizeof(params), "\"pagesize\":%lu,"
+				 "\"size\":%lu,\"backing\":", b->pagesize, size);
+			json_str_buf(params, sizeof(params), b->kind);
+			results_phase_end(&results, &phase, "map", params,
+					  map_lat.count, map_lat.count * size,
+					  &map_lat, NULL);
+			results_phase_end(&results, &phase, "unmap", params,
+					  unmap_lat.count,
+					  unmap_lat.count * size, &unmap_lat,
+					  NULL);
+		}
+
+		munmap(vaddr, b->max);
+	}
+
+	/* Page sizes that got measured, each counted once */
+	for (i = 0; i < nr_backings; i++) {
+		for (j = 0; j < i; j++)
+			if (backings[j].points &&
+			    backings[j].pagesize == backings[i].pagesize)
+				break;
+		if (backings[i].points && j == i)
+			pagesizes++;
+	}
+
+	n = pagesizes > 1 ? 3 : 2;
+	if (nr_pts < n) {
+		printf("Too few points to fit a model\n");
+		return -1;
+	}
+
+	worst = fit(pts, nr_pts, n, coef);
+	if (worst < 0) {
+		printf("Can't fit a model to these points\n");
+		return -1;
+	}
+
+	printf("Unmap model over %d points: %.0f ns + %.1f ns/MB + %.1f ns/page, "
+	       "worst error %.0f%%\n", nr_pts, coef[0], coef[1] * (1 << 20),
+	       coef[2], worst * 100);
+	if (n < 3)
+		printf("  one page size measured, the per-page cost is in the per-byte one\n");
+
+	/* Below this an unmap is mostly fixed cost, worth batching */
+	for (i = 0; i < nr_backings; i++) {
+		double per_byte = coef[1] + coef[2] / backings[i].pagesize;
+
+		if (!backings[i].points)
+			continue;
+
+		if (per_byte <= 0)
+			printf("  %s: size cost never reaches the fixed cost\n",
+			       backings[i].name);
+		else
+			printf("  %s: size cost matches the fixed cost at %.0fK\n",
+			       backings[i].name, coef[0] / per_byte / 1024);
+	}
+
+	snprintf(params, sizeof(params), "\"page_sizes\":%d", pagesizes);
+	results_phase_start(&results, &phase);
+	snprintf(phase.extra, sizeof(phase.extra), "\"fixed_ns\":%.1f,"
+		 "\"per_byte_ns\":%.6f,\"per_page_ns\":%.3f,"
+		 "\"worst_err\":%.3f", coef[0], coef[1], coef[2], worst);
+	results_phase_end(&results, &phase, "model", params, nr_pts, 0, NULL,
+			  NULL);
+
+	return 0;
+}
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define STORM_SIZE	(64UL * 1024 * 1024)
+#define NR_PACES	3		/* full rate, then 1/4 and 1/16 of it */
+
+/*
+ * What unmap storms cost the CPUs that aren't doing them.  Unmapping
+ * invalidates the IOTLB and, once pages are unpinned, can shoot down CPU
+ * TLBs, and the IPIs land on whatever else is running: in a VMM, vCPU
+ * threads.  A probe thread is pinned to each CPU probed and spins reading
+ * the clock; any gap between two reads above the threshold is a hiccup.
+ *
+ * The storm runs on the first CPU we may use, vfio-iommu-stress-test
+ * style: STORM_SIZE mapped in chunks, every other chunk unmapped, then the
+ * rest, so no two unmaps merge.  Each chunk size runs flat out and then
+ * paced to a fraction of that unmap rate, after an idle step with no storm
+ * for the baseline.  Hiccup rate, duration and time lost are reported per
+ * CPU, with whether it's isolated or nohz_full.
+ *
+ * Without a group the storm is simulated: mlock() to map, munlock() and
+ * MADV_DONTNEED to unmap, which zaps the PTEs and shoots down the TLBs of
+ * every CPU running this mm, the probes included, as it would the vCPUs.
+ */
+struct probe {
+	int cpu;
+	int error;
+	unsigned long long loops;
+	struct lat_stats hiccups;
+	pthread_t thread;
+};
+
+struct storm {
+	unsigned long chunk;
+	int divisor;			/* of the flat out rate, 1 for it */
+	double target;			/* unmaps/s, 0 for flat out */
+	unsigned long unmaps;
+	unsigned long long wall_ns;
+	unsigned long left;		/* unmap order position still mapped */
+};
+
+static struct results results;
+static unsigned long long threshold_ns;
+static volatile int probes_started, probes_stop;
+
+void usage(char *name)
+{
+	printf("usage: %s <seconds per step> <threshold us> [iommu group id] [cpus <list>]\n",
+	       name);
+	printf("\tthreshold: clock gaps above this count as hiccups\n");
+	printf("\tcpus:      CPUs to probe, e.g. 2-5,8, default all but the storm's\n");
+	printf("\twithout a group the storm is simulated with mlock/MADV_DONTNEED\n");
+}
+
+/* "2-5,8" style, as in sysfs and isolcpus= */
+int parse_cpus(const char *str, cpu_set_t *set)
+{
+	int first, last, n;
+
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		if (sscanf(str, "%d%n", &first, &n) != 1 || first < 0)
+			return -1;
+		str += n;
+		last = first;
+		if (*str == '-') {
+			if (sscanf(str + 1, "%d%n", &last, &n) != 1 ||
+			    last < first)
+				return -1;
+			str += n + 1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*str == ',')
+			str++;
+	}
+
+	return 0;
+}
+
+/* CPUs listed in a sysfs file, empty if it's missing */
+void sysfs_cpus(const char *path, cpu_set_t *set)
+{
+	char buf[256];
+	FILE *f;
+
+	CPU_ZERO(set);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(buf, sizeof(buf), f) && parse_cpus(buf, set))
+		CPU_ZERO(set);
+	fclose(f);
+}
+
+void *probe_thread(void *arg)
+{
+	struct probe *p = arg;
+	unsigned long long last, t;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(p->cpu, &set);
+	p->error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	__sync_fetch_and_add(&probes_started, 1);
+	if (p->error)
+		return NULL;
+
+	last = now_ns();
+	while (!probes_stop) {
+		t = now_ns();
+		p->loops++;
+		if (t - last > threshold_ns) {
+			lat_add(&p->hiccups, t - last);
+			/* Don't count our own bookkeeping as the next one */
+			t = now_ns();
+		}
+		last = t;
+	}
+
+	return NULL;
+}
+
+int probes_run(struct probe *probes, int nr)
+{
+	int i;
+
+	probes_started = probes_stop = 0;
+	for (i = 0; i < nr; i++) {
+		probes[i].loops = 0;
+		lat_reset(&probes[i].hiccups);
+		if (pthread_create(&probes[i].thread, NULL, probe_thread,
+				   &probes[i])) {
+			printf("Failed to create probe thread for CPU %d\n",
+			       probes[i].cpu);
+			return -1;
+		}
+	}
+
+	while (probes_started < nr)
+		sched_yield();
+
+	for (i = 0; i < nr; i++) {
+		if (probes[i].error) {
+			printf("Failed to pin probe to CPU %d (%s)\n",
+			       probes[i].cpu, strerror(probes[i].error));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void probes_join(struct probe *probes, int nr)
+{
+	int i;
+
+	probes_stop = 1;
+	for (i = 0; i < nr; i++)
+		pthread_join(probes[i].thread, NULL);
+}
+
+int storm_map(int container, char *buf, unsigned long off,
+	      unsigned long chunk)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = (unsigned long)buf + off,
+		.iova = off,
+		.size = chunk,
+	};
+
+	if (container < 0)
+		return mlock(buf + off, chunk);
+
+	return ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
+}
+
+int storm_unmap(int container, char *buf, unsigned long off,
+		unsigned long chunk)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = off,
+		.size = chunk,
+	};
+
+	if (container < 0)
+		return munlock(buf + off, chunk) ||
+		       madvise(buf + off, chunk, MADV_DONTNEED);
+
+	return ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+}
+
+/* Even chunks, then odd */
+unsigned long storm_order(unsigned long j, unsigned long nr)
+{
+	return j < (nr + 1) / 2 ? j * 2 : (j - (nr + 1) / 2) * 2 + 1;
+}
+
+/*
+ * Map and unmap the storm region until the step is over, paced unmaps
+ * spread evenly.  The step can end mid cycle, storm_drain() unmaps what's
+ * left once the probes are done.
+ */
+int storm_run(struct storm *s, int container, char *buf, int seconds)
+{
+	unsigned long nr = STORM_SIZE / s->chunk, i, j;
+	unsigned long long start, end, intended, t;
+	struct timespec ts;
+
+	s->unmaps = 0;
+	s->left = nr;
+	start = now_ns();
+	end = start + seconds * 1000000000ULL;
+
+	for (;;) {
+		for (i = 0; i < nr; i++) {
+			if (storm_map(container, buf, i * s->chunk, s->chunk)) {
+				printf("Failed to map chunk %lu (%s)\n",
+				       i, strerror(errno));
+				return -1;
+			}
+		}
+
+		for (j = 0; j < nr; j++) {
+			i = storm_order(j, nr);
+
+			t = now_ns();
+			intended = s->target ?
+				   start + s->unmaps * 1e9 / s->target : t;
+			if (intended > end)
+				intended = end;
+			if (t < intended) {
+				ts.tv_sec = (intended - t) / 1000000000ULL;
+				ts.tv_nsec = (intended - t) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+				t = now_ns();
+			}
+
+			if (t >= end) {
+				s->left = j;
+				goto out;
+			}
+
+			if (storm_unmap(container, buf, i * s->chunk,
+					s->chunk)) {
+				printf("Failed to unmap chunk %lu (%s)\n",
+				       i, strerror(errno));
+				return -1;
+			}
+			s->unmaps++;
+		}
+	}
+
+out:
+	s->wall_ns = now_ns() - start;
+	return 0;
+}
+
+int storm_drain(struct storm *s, int container, char *buf)
+{
+	unsigned long nr = STORM_SIZE / s->chunk, i;
+
+	for (; s->left < nr; s->left++) {
+		i = storm_order(s->left, nr);
+		if (storm_unmap(container, buf, i * s->chunk, s->chunk)) {
+			printf("Failed to unmap chunk %lu (%s)\n",
+			       i, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void report(struct probe *probes, int nr, struct storm *s, cpu_set_t *isol,
+	    cpu_set_t *nohz, struct results_phase *phase,
+	    unsigned long long wall)
+{
+	struct probe *p;
+	char size[24], target[24], isolated[16], params[256];
+	double rate = s ? s->unmaps * 1e9 / s->wall_ns : 0;
+	int i;
+
+	if (!s)
+		snprintf(size, sizeof(size), "idle");
+	else if (s->chunk >= 1UL << 20)
+		snprintf(size, sizeof(size), "%luM", s->chunk >> 20);
+	else
+		snprintf(size, sizeof(size), "%luK", s->chunk >> 10);
+
+	if (s && s->target)
+		snprintf(target, sizeof(target), "%.0f", s->target);
+	else
+		snprintf(target, sizeof(target), s ? "max" : "-");
+
+	for (i = 0; i < nr; i++) {
+		p = &probes[i];
+
+		snprintf(isolated, sizeof(isolated), "%s%s%s",
+			 CPU_ISSET(p->cpu, isol) ? "iso" : "",
+			 CPU_ISSET(p->cpu, isol) && CPU_ISSET(p->cpu, nohz) ?
+			 "+" : "", CPU_ISSET(p->cpu, nohz) ? "nohz" : "");
+
+		printf("%-5s %9s %9.0f %4d %-8s %10.1f %9llu %9llu %10llu %8.3f\n",
+		       size, target, rate, p->cpu,
+		       *isolated ? isolated : "-",
+		       p->hiccups.count * 1e9 / wall,
+		       lat_pct(&p->hiccups, 50), lat_pct(&p->hiccups, 99),
+		       lat_pct(&p->hiccups, 100),
+		       lat_sum(&p->hiccups) * 100.0 / wall);
+
+		snprintf(params, sizeof(params), "\"cpu\":%d,"
+			 "\"isolated\":\"%s\",\"chunk\":%lu,\"pace\":%d,"
+			 "\"threshold_ns\":%llu", p->cpu, isolated,
+			 s ? s->chunk : 0, s ? s->divisor : 0, threshold_ns);
+		snprintf(phase->extra, sizeof(phase->extra),
+			 "\"target\":%.0f,\"unmap_rate\":%.0f,"
+			 "\"loops\":%llu,\"stalled_ns\":%llu",
+			 s ? s->target : 0, rate, p->loops,
+			 lat_sum(&p->hiccups));
+		results_phase_end(&results, phase, s ? "storm" : "idle",
+				  params, p->hiccups.count,
+				  s ? s->unmaps * s->chunk : 0, &p->hiccups,
+				  NULL);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned long chunks[] = { 4096, 65536, 2UL << 20 };
+	int seconds, groupid, container = -1, storm_cpu = -1, nr = 0, c, p;
+	cpu_set_t allowed, probed, isol, nohz, set;
+	struct storm storms[NR_PACES];
+	struct results_phase phase;
+	struct probe *probes;
+	unsigned long long threshold, start;
+	unsigned int k;
+	char *buf;
+
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	for (c = 0; c < CPU_SETSIZE && storm_cpu < 0; c++)
+		if (CPU_ISSET(c, &allowed))
+			storm_cpu = c;
+
+	probed = allowed;
+	CPU_CLR(storm_cpu, &probed);
+	if (argc > 2 && !strcmp(argv[argc - 2], "cpus")) {
+		if (parse_cpus(argv[argc - 1], &probed)) {
+			usage(argv[0]);
+			return -1;
+		}
+		/* The storm's CPU is never one of its own probes */
+		CPU_CLR(storm_cpu, &probed);
+		argc -= 2;
+	}
+
+	if (argc < 3 || sscanf(argv[1], "%d", &seconds) != 1 || seconds < 1 ||
+	    sscanf(argv[2], "%llu", &threshold) != 1 || !threshold ||
+	    (argc > 3 && sscanf(argv[3], "%d", &groupid) != 1)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	threshold_ns = threshold * 1000;
+	sysfs_cpus("/sys/devices/system/cpu/isolated", &isol);
+	sysfs_cpus("/sys/devices/system/cpu/nohz_full", &nohz);
+
+	probes = calloc(CPU_COUNT(&probed), sizeof(*probes));
+	if (!probes) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, &probed))
+			probes[nr++].cpu = c;
+	if (!nr) {
+		printf("No CPU to probe besides the storm's (CPU %d), "
+		       "give some with cpus\n", storm_cpu);
+		return -1;
+	}
+
+	if (argc > 3) {
+		container = open_container(groupid, VFIO_TYPE1_IOMMU);
+		if (container < 0)
+			return -1;
+	}
+
+	if (results_open(&results, "vfio-iommu-unmap-interference"))
+		return -1;
+	if (container >= 0)
+		results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	buf = mmap(NULL, STORM_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(storm_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		printf("Failed to pin to CPU %d (%s)\n",
+		       storm_cpu, strerror(errno));
+		return -1;
+	}
+
+	printf("%luM storm on CPU %d, %s, %d CPUs probed, threshold %llu us\n",
+	       STORM_SIZE >> 20, storm_cpu,
+	       container < 0 ? "simulated" : "vfio", nr, threshold);
+	printf("%-5s %9s %9s %4s %-8s %10s %9s %9s %10s %8s\n", "chunk",
+	       "target/s", "unmaps/s", "cpu", "isolated", "hiccups/s",
+	       "p50 ns", "p99 ns", "max ns", "stalled%");
+
+	/* Baseline, whatever else the CPUs get up to */
+	results_phase_start(&results, &phase);
+	if (probes_run(probes, nr))
+		return -1;
+	start = now_ns();
+	sleep(seconds);
+	probes_join(probes, nr);
+	report(probes, nr, NULL, &isol, &nohz, &phase,
+		       now_ns() - start);
+
+	for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+		for (p = 0; p < NR_PACES; p++) {
+			struct storm *s = &storms[p];
+
+			s->chunk = chunks[k];
+			s->divisor = 1 << (2 * p);
+			s->target = p ? storms[0].unmaps * 1e9 /
+					storms[0].wall_ns / s->divisor : 0;
+
+			results_phase_start(&results, &phase);
+			if (probes_run(probes, nr))
+				return -1;
+			start = now_ns();
+			if (storm_run(s, container, buf, seconds))
+				return -1;
+			probes_join(probes, nr);
+			report(probes, nr, s, &isol, &nohz, &phase,
+			       now_ns() - start);
+			if (storm_drain(s, container, buf))
+				return -1;
+		}
+	}
+
+	return 0;
+}
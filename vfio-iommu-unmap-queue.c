@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+#include "vfio-unmap-queue.h"
+
+#define AGE_MAX_NS	(10 * 1000 * 1000ULL)	/* time watermark */
+
+/*
+ * Immediate against deferred unmapping of a region mapped in chunks.
+ * Each unmap order is run once with one ioctl per chunk and then through
+ * an unmap queue at a few size watermarks, from a small batch up to the
+ * whole region.  The "stress" order is the one vfio-iommu-stress-test
+ * uses, every other chunk of each half, followed by the chunks it leaves
+ * behind.  Without a group the queue runs dry, which shows the ioctl
+ * counts and merging but no timing worth reading.
+ */
+enum order {
+	ORDER_SEQUENTIAL,
+	ORDER_STRESS,
+	ORDER_RANDOM,
+	NR_ORDERS,
+};
+
+static const char *order_names[NR_ORDERS] = {
+	"sequential", "stress", "random",
+};
+
+static struct results results;
+
+void usage(char *name)
+{
+	printf("usage: %s <size MB> <chunk KB> [iommu group id]\n", name);
+	printf("\tsize:  region mapped and unmapped each run\n");
+	printf("\tchunk: size of each map and of each queued unmap\n");
+	printf("\twithout a group the queue only counts ioctls\n");
+}
+
+/* Chunk indexes in the order they're unmapped */
+void build_order(unsigned long *idx, unsigned long nr, enum order order)
+{
+	unsigned long i, j, n = 0, tmp;
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+	switch (order) {
+	case ORDER_SEQUENTIAL:
+		for (i = 0; i < nr; i++)
+			idx[n++] = i;
+		break;
+	case ORDER_STRESS:
+		for (j = 0; j < nr / 2; j += 2)
+			idx[n++] = j;
+		for (j = nr - 1; j > nr / 2; j -= 2)
+			idx[n++] = j;
+		/* What the stress test leaves mapped */
+		for (j = 1; j < nr / 2; j += 2)
+			idx[n++] = j;
+		for (j = nr / 2; j < nr; j++)
+			if ((nr - 1 - j) % 2 || j == nr / 2)
+				idx[n++] = j;
+		break;
+	case ORDER_RANDOM:
+		for (i = 0; i < nr; i++)
+			idx[i] = i;
+		for (i = nr - 1; i > 0; i--) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			j = seed % (i + 1);
+			tmp = idx[i];
+			idx[i] = idx[j];
+			idx[j] = tmp;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+int map_region(int container, unsigned long vaddr, unsigned long size,
+	       unsigned long chunk)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.size = chunk,
+	};
+	unsigned long off;
+
+	if (container < 0)
+		return 0;
+
+	for (off = 0; off < size; off += chunk) {
+		dma_map.vaddr = vaddr + off;
+		dma_map.iova = off;
+		if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+			printf("Failed to map chunk at %lx (%s)\n",
+			       off, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * bytes_max 0 unmaps immediately, a chunk at a time.  Returns the unmap
+ * wall time in ns, or 0 on failure.
+ */
+unsigned long long unmap_run(int container, unsigned long *idx,
+			     unsigned long nr, unsigned long chunk,
+			     unsigned long long bytes_max,
+			     struct unmap_queue *q)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = chunk,
+	};
+	unsigned long long start, t;
+	unsigned long i;
+
+	unmap_queue_init(q, container, bytes_max, AGE_MAX_NS);
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		if (bytes_max) {
+			if (unmap_queue_add(q, idx[i] * chunk, chunk))
+				goto fail;
+			continue;
+		}
+
+		/* Immediate: the queue is only used for its counters */
+		t = now_ns();
+		dma_unmap.iova = idx[i] * chunk;
+		q->requests++;
+		q->ioctls++;
+		if (container >= 0 &&
+		    (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+		     dma_unmap.size != chunk))
+			goto fail;
+		if (now_ns() - t > q->stale_max_ns)
+			q->stale_max_ns = now_ns() - t;
+	}
+
+	if (unmap_queue_flush(q))
+		goto fail;
+
+	return now_ns() - start;
+
+fail:
+	printf("Failed to unmap (%s)\n", strerror(errno));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long size, chunk, nr, *idx, vaddr;
+	unsigned long long marks[4], wall;
+	int container = -1, groupid, o, m;
+	struct results_phase phase;
+	struct unmap_queue q;
+	char params[192], mode[32];
+
+	if (argc < 3 || sscanf(argv[1], "%lu", &size) != 1 || !size ||
+	    sscanf(argv[2], "%lu", &chunk) != 1 || !chunk ||
+	    (argc > 3 && sscanf(argv[3], "%d", &groupid) != 1)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	size <<= 20;
+	chunk <<= 10;
+	if (size % chunk || chunk % getpagesize()) {
+		printf("Size must be a multiple of the chunk, chunk of the page size\n");
+		return -1;
+	}
+	nr = size / chunk;
+
+	if (argc > 3) {
+		container = open_container(groupid, VFIO_TYPE1_IOMMU);
+		if (container < 0)
+			return -1;
+	}
+
+	if (results_open(&results, "vfio-iommu-unmap-queue"))
+		return -1;
+	if (container >= 0)
+		results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	vaddr = (unsigned long)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+				    -1, 0);
+	idx = calloc(nr, sizeof(*idx));
+	if (vaddr == (unsigned long)MAP_FAILED || !idx) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+
+	/* Immediate, then small, medium and whole region batches */
+	marks[0] = 0;
+	marks[1] = chunk * 16 < size ? chunk * 16 : size;
+	marks[2] = size / 8 > marks[1] ? size / 8 : marks[1];
+	marks[3] = size;
+
+	printf("%luM in %luK chunks, %s, time watermark %llu us\n",
+	       size >> 20, chunk >> 10, container < 0 ? "dry run" : "vfio",
+	       AGE_MAX_NS / 1000);
+	printf("%-10s %-12s %8s %8s %10s %10s %12s\n", "order", "mode",
+	       "ioctls", "flushes", "unmap ms", "GB/s", "max stale us");
+
+	for (o = 0; o < NR_ORDERS; o++) {
+		build_order(idx, nr, o);
+
+		for (m = 0; m < 4; m++) {
+			if (m > 1 && marks[m] == marks[m - 1])
+				continue;
+
+			if (map_region(container, vaddr, size, chunk))
+				return -1;
+
+			results_phase_start(&results, &phase);
+			wall = unmap_run(container, idx, nr, chunk, marks[m], &q);
+			if (!wall)
+				return -1;
+
+			if (marks[m])
+				snprintf(mode, sizeof(mode), "defer %lluK",
+					 marks[m] >> 10);
+			else
+				snprintf(mode, sizeof(mode), "immediate");
+
+			printf("%-10s %-12s %8lu %8lu %10.3f %10.2f %12llu\n",
+			       order_names[o], mode, q.ioctls, q.flushes,
+			       wall / 1e6, size / (double)wall,
+			       q.stale_max_ns / 1000);
+
+			snprintf(params, sizeof(params), "\"order\":\"%s\","
+				 "\"chunk\":%lu,\"watermark\":%llu",
+				 order_names[o], chunk, marks[m]);
+			snprintf(phase.extra, sizeof(phase.extra),
+				 "\"ioctls\":%lu,\"stale_max_ns\":%llu",
+				 q.ioctls, q.stale_max_ns);
+			results_phase_end(&results, &phase, "unmap", params,
+					  nr, size, NULL, NULL);
+
+			unmap_queue_free(&q);
+		}
+	}
+
+	return 0;
+}
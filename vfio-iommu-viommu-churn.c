@@ -0,0 +1,478 @@
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "vfio-bench.h"
+
+#define SLOT_SIZE	(64 * 1024)	/* largest guest DMA mapping */
+#define INFLIGHT	32		/* guest DMAs outstanding */
+#define STATUS_EVERY	1024		/* ops between VmLck samples */
+
+/*
+ * A guest with a strict vIOMMU maps every DMA buffer just before the
+ * device uses it and unmaps it right after, and the VMM turns each of
+ * those into a VFIO_IOMMU_MAP_DMA/UNMAP_DMA of 4K-64K.  This replays
+ * such a stream: buffers of a working set, 80% of DMAs hitting the
+ * hottest 20%, at a fixed arrival rate with INFLIGHT outstanding.
+ *
+ * Guest iovas come from a LIFO free list like the Linux iova rcache, or
+ * with "stable" each buffer always gets its own iova, as drivers that
+ * recycle their buffers do.
+ *
+ * The run is repeated with a VMM side mapping cache: a guest unmap only
+ * parks the host mapping, still pinned, and a later guest map of the
+ * same (vaddr, iova, size) reuses it without an ioctl.  The least
+ * recently parked mapping is unmapped once more than the cache size are
+ * parked, as is one whose iova the guest reuses for something else.
+ * Parking is only safe against a device that can't be made to DMA to
+ * the stale iova, which is the tradeoff this measures.
+ *
+ * Without a group the host side is simulated with mlock()/munlock().
+ */
+enum slot_state {
+	SLOT_FREE,
+	SLOT_INUSE,		/* mapped by the guest */
+	SLOT_CACHED,		/* unmapped by the guest, still mapped on host */
+};
+
+struct slot {
+	unsigned long vaddr, size;
+	enum slot_state state;
+	int prev, next;		/* LRU of cached slots, most recent first */
+};
+
+struct churn {
+	int container;		/* -1 for the simulated backend */
+	int cache_max;
+	int nr_cached;
+	int lru_head, lru_tail;
+	struct slot *slots;
+	unsigned long dmas, map_ioctls, unmap_ioctls;
+	unsigned long hits, evictions, conflicts;
+	unsigned long long cached_bytes, peak_cached_bytes;
+	unsigned long long cached_sum;	/* cached_bytes summed per op */
+	long lck_base, peak_lck_kb;
+	unsigned long long wall_ns;
+	struct lat_stats map_lat, unmap_lat;
+};
+
+static struct results results;
+static unsigned long long rng_state;
+
+void usage(char *name)
+{
+	printf("usage: %s <DMAs/s> <working set> <seconds> <cache entries> [iommu group id] [stable]\n",
+	       name);
+	printf("\tDMAs/s:        guest map/unmap rate, 0 for as fast as possible\n");
+	printf("\tworking set:   number of 4K-64K guest buffers, more than %d\n",
+	       INFLIGHT);
+	printf("\tcache entries: parked mappings, 0 to only run uncached\n");
+	printf("\tstable:        each buffer reuses its iova instead of a LIFO allocator\n");
+	printf("\twithout a group the host side is simulated with mlock\n");
+}
+
+static unsigned long rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static int host_map(struct churn *c, int slot)
+{
+	struct slot *s = &c->slots[slot];
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = s->vaddr,
+		.iova = (unsigned long)slot * SLOT_SIZE,
+		.size = s->size,
+	};
+
+	c->map_ioctls++;
+	if (c->container < 0)
+		return mlock((void *)s->vaddr, s->size);
+
+	return ioctl(c->container, VFIO_IOMMU_MAP_DMA, &dma_map);
+}
+
+static int host_unmap(struct churn *c, int slot)
+{
+	struct slot *s = &c->slots[slot];
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = (unsigned long)slot * SLOT_SIZE,
+		.size = s->size,
+	};
+
+	c->unmap_ioctls++;
+	if (c->container < 0)
+		return munlock((void *)s->vaddr, s->size);
+
+	if (ioctl(c->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap))
+		return -1;
+
+	return dma_unmap.size == s->size ? 0 : -1;
+}
+
+static void lru_del(struct churn *c, int slot)
+{
+	struct slot *s = &c->slots[slot];
+
+	if (s->prev >= 0)
+		c->slots[s->prev].next = s->next;
+	else
+		c->lru_head = s->next;
+
+	if (s->next >= 0)
+		c->slots[s->next].prev = s->prev;
+	else
+		c->lru_tail = s->prev;
+
+	c->nr_cached--;
+	c->cached_bytes -= s->size;
+}
+
+static void lru_add(struct churn *c, int slot)
+{
+	struct slot *s = &c->slots[slot];
+
+	s->prev = -1;
+	s->next = c->lru_head;
+	if (c->lru_head >= 0)
+		c->slots[c->lru_head].prev = slot;
+	else
+		c->lru_tail = slot;
+	c->lru_head = slot;
+
+	c->nr_cached++;
+	c->cached_bytes += s->size;
+	if (c->cached_bytes > c->peak_cached_bytes)
+		c->peak_cached_bytes = c->cached_bytes;
+}
+
+/* Guest maps vaddr/size at the slot's iova */
+int guest_map(struct churn *c, int slot, unsigned long vaddr,
+	      unsigned long size)
+{
+	struct slot *s = &c->slots[slot];
+	unsigned long long t = now_ns();
+
+	if (s->state == SLOT_CACHED) {
+		lru_del(c, slot);
+
+		if (s->vaddr == vaddr && s->size == size) {
+			c->hits++;
+			s->state = SLOT_INUSE;
+			lat_add(&c->map_lat, now_ns() - t);
+			return 0;
+		}
+
+		/* The iova went to another buffer, the old mapping must go */
+		c->conflicts++;
+		if (host_unmap(c, slot))
+			return -1;
+	}
+
+	s->vaddr = vaddr;
+	s->size = size;
+	if (host_map(c, slot))
+		return -1;
+	s->state = SLOT_INUSE;
+
+	lat_add(&c->map_lat, now_ns() - t);
+	return 0;
+}
+
+int guest_unmap(struct churn *c, int slot)
+{
+	struct slot *s = &c->slots[slot];
+	unsigned long long t = now_ns();
+	int victim;
+
+	if (!c->cache_max) {
+		if (host_unmap(c, slot))
+			return -1;
+		s->state = SLOT_FREE;
+		lat_add(&c->unmap_lat, now_ns() - t);
+		return 0;
+	}
+
+	s->state = SLOT_CACHED;
+	lru_add(c, slot);
+
+	if (c->nr_cached > c->cache_max) {
+		victim = c->lru_tail;
+		lru_del(c, victim);
+		c->evictions++;
+		if (host_unmap(c, victim))
+			return -1;
+		c->slots[victim].state = SLOT_FREE;
+	}
+
+	lat_add(&c->unmap_lat, now_ns() - t);
+	return 0;
+}
+
+/* Drop everything still mapped on the host, not measured */
+int churn_teardown(struct churn *c, int nr_slots)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr_slots; i++) {
+		if (c->slots[i].state == SLOT_FREE)
+			continue;
+		if (host_unmap(c, i))
+			ret = -1;
+		c->slots[i].state = SLOT_FREE;
+	}
+
+	return ret;
+}
+
+/*
+ * Replays the same guest DMA stream whatever the cache size, the guest
+ * can't see the cache.
+ */
+int churn_run(struct churn *c, char *buf, unsigned long *sizes,
+	      int nr_bufs, unsigned long rate, int seconds, int stable)
+{
+	int fifo[INFLIGHT + 1], head = 0, count = 0;
+	int *free_slots, nr_free = 0, i, b, slot;
+	unsigned long long start, deadline, next, t;
+	struct timespec ts;
+	long lck;
+
+	c->slots = calloc(nr_bufs, sizeof(*c->slots));
+	free_slots = calloc(nr_bufs, sizeof(*free_slots));
+	if (!c->slots || !free_slots) {
+		printf("Failed to allocate slots\n");
+		return -1;
+	}
+
+	c->lru_head = c->lru_tail = -1;
+	for (i = nr_bufs - 1; i >= 0; i--)
+		free_slots[nr_free++] = i;
+
+	rng_state = 0x9e3779b97f4a7c15ULL;
+	c->lck_base = status_kb("VmLck");
+
+	start = next = now_ns();
+	deadline = start + seconds * 1000000000ULL;
+
+	while ((t = now_ns()) < deadline) {
+		/* Fixed arrival rate, don't catch up by bursting */
+		if (rate && t < next) {
+			t = next - t;
+			ts.tv_sec = t / 1000000000ULL;
+			ts.tv_nsec = t % 1000000000ULL;
+			nanosleep(&ts, NULL);
+		}
+		next += rate ? 1000000000ULL / rate : 0;
+
+		do {
+			if (rng() % 100 < 80)
+				b = rng() % (nr_bufs / 5 ? nr_bufs / 5 : 1);
+			else
+				b = rng() % nr_bufs;
+		} while (stable && c->slots[b].state == SLOT_INUSE);
+
+		slot = stable ? b : free_slots[--nr_free];
+
+		if (guest_map(c, slot, (unsigned long)buf +
+			      (unsigned long)b * SLOT_SIZE, sizes[b])) {
+			printf("Failed to map DMA %lu (%s)\n",
+			       c->dmas, strerror(errno));
+			return -1;
+		}
+
+		fifo[(head + count++) % (INFLIGHT + 1)] = slot;
+		c->dmas++;
+
+		if (count > INFLIGHT) {
+			slot = fifo[head];
+			head = (head + 1) % (INFLIGHT + 1);
+			count--;
+
+			if (guest_unmap(c, slot)) {
+				printf("Failed to unmap DMA (%s)\n",
+				       strerror(errno));
+				return -1;
+			}
+
+			if (!stable)
+				free_slots[nr_free++] = slot;
+		}
+
+		c->cached_sum += c->cached_bytes;
+
+		if (!(c->dmas % STATUS_EVERY)) {
+			lck = status_kb("VmLck") - c->lck_base;
+			if (lck > c->peak_lck_kb)
+				c->peak_lck_kb = lck;
+		}
+	}
+
+	c->wall_ns = now_ns() - start;
+
+	/* The guest's outstanding DMAs complete */
+	while (count--) {
+		if (guest_unmap(c, fifo[head])) {
+			printf("Failed to unmap DMA (%s)\n", strerror(errno));
+			return -1;
+		}
+		head = (head + 1) % (INFLIGHT + 1);
+	}
+
+	free(free_slots);
+
+	if (churn_teardown(c, nr_bufs)) {
+		printf("Failed to tear down mappings (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void churn_print(struct churn *c)
+{
+	printf("%lu DMAs in %llu ms, %.0f DMAs/s\n", c->dmas,
+	       c->wall_ns / 1000000, c->wall_ns ? c->dmas * 1e9 / c->wall_ns : 0);
+	printf("  %lu map ioctls, %lu unmap ioctls", c->map_ioctls,
+	       c->unmap_ioctls);
+	if (c->cache_max)
+		printf(", %lu hits (%.1f%%), %lu evicted, %lu iova conflicts",
+		       c->hits, c->dmas ? c->hits * 100.0 / c->dmas : 0,
+		       c->evictions, c->conflicts);
+	printf("\n");
+	if (c->cache_max)
+		printf("  parked: peak %llukB, avg %llukB\n",
+		       c->peak_cached_bytes >> 10,
+		       c->dmas ? c->cached_sum / c->dmas >> 10 : 0);
+	printf("  VmLck peak +%ldkB\n", c->peak_lck_kb);
+	lat_print("  map", &c->map_lat);
+	lat_print("  unmap", &c->unmap_lat);
+}
+
+void churn_results(struct churn *c, struct results_phase *phase,
+		   unsigned long rate, int nr_bufs, int stable)
+{
+	char params[256];
+
+	snprintf(params, sizeof(params), "\"rate\":%lu,\"working_set\":%d,"
+		 "\"cache\":%d,\"iova\":\"%s\",\"backend\":\"%s\"",
+		 rate, nr_bufs, c->cache_max, stable ? "stable" : "lifo",
+		 c->container < 0 ? "simulated" : "vfio");
+	snprintf(phase->extra, sizeof(phase->extra), "\"hits\":%lu,"
+		 "\"map_ioctls\":%lu,\"unmap_ioctls\":%lu,"
+		 "\"peak_parked\":%llu", c->hits, c->map_ioctls,
+		 c->unmap_ioctls, c->peak_cached_bytes);
+	results_phase_end(&results, phase, "map", params, c->dmas,
+			  0, &c->map_lat, NULL);
+	results_phase_end(&results, phase, "unmap", params, c->dmas,
+			  0, &c->unmap_lat, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	int i, nr_bufs, seconds, cache_max, groupid, stable = 0, container = -1;
+	struct churn runs[2];
+	struct results_phase phase;
+	unsigned long rate, *sizes;
+	char *buf;
+
+	if (argc > 1 && !strcmp(argv[argc - 1], "stable")) {
+		stable = 1;
+		argc--;
+	}
+
+	if (argc < 5 || sscanf(argv[1], "%lu", &rate) != 1 ||
+	    sscanf(argv[2], "%d", &nr_bufs) != 1 || nr_bufs <= INFLIGHT ||
+	    sscanf(argv[3], "%d", &seconds) != 1 || seconds < 1 ||
+	    sscanf(argv[4], "%d", &cache_max) != 1 || cache_max < 0 ||
+	    (argc > 5 && sscanf(argv[5], "%d", &groupid) != 1)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc > 5) {
+		container = open_container(groupid, VFIO_TYPE1_IOMMU);
+		if (container < 0)
+			return -1;
+	}
+
+	if (results_open(&results, "vfio-iommu-viommu-churn"))
+		return -1;
+	if (container >= 0)
+		results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
+	buf = mmap(NULL, (unsigned long)nr_bufs * SLOT_SIZE,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	sizes = calloc(nr_bufs, sizeof(*sizes));
+	if (buf == MAP_FAILED || !sizes) {
+		printf("Failed to allocate memory\n");
+		return -1;
+	}
+
+	/* 4K, 8K, 16K, 32K or 64K, fixed per buffer */
+	rng_state = 0x2545f4914f6cdd1dULL;
+	for (i = 0; i < nr_bufs; i++)
+		sizes[i] = 4096UL << (rng() % 5);
+
+	printf("%d buffers, %d in flight, %s iovas, %s, ", nr_bufs, INFLIGHT,
+	       stable ? "stable" : "LIFO", container < 0 ? "simulated" : "vfio");
+	if (rate)
+		printf("%lu DMAs/s\n", rate);
+	else
+		printf("unthrottled\n");
+
+	memset(runs, 0, sizeof(runs));
+
+	for (i = 0; i < (cache_max ? 2 : 1); i++) {
+		runs[i].container = container;
+		runs[i].cache_max = i ? cache_max : 0;
+
+		printf("%s:\n", i ? "Cached" : "Uncached");
+
+		results_phase_start(&results, &phase);
+		if (churn_run(&runs[i], buf, sizes, nr_bufs, rate, seconds,
+			      stable))
+			return -1;
+		churn_results(&runs[i], &phase, rate, nr_bufs, stable);
+		churn_print(&runs[i]);
+	}
+
+	if (!cache_max)
+		return 0;
+
+	printf("\n");
+	matrix_header("uncached", "cached");
+	matrix_row("map ioctls/DMA", runs[0].map_ioctls * 1000.0 / runs[0].dmas,
+		   runs[1].map_ioctls * 1000.0 / runs[1].dmas);
+	matrix_row("unmap ioctls/DMA", runs[0].unmap_ioctls * 1000.0 /
+		   runs[0].dmas, runs[1].unmap_ioctls * 1000.0 / runs[1].dmas);
+	matrix_lat("map", &runs[0].map_lat, &runs[1].map_lat);
+	matrix_lat("unmap", &runs[0].unmap_lat, &runs[1].unmap_lat);
+	matrix_row("VmLck peak kB", runs[0].peak_lck_kb, runs[1].peak_lck_kb);
+	printf("(ioctls per DMA x1000)\n");
+	printf("Cache avoided %lu of %lu maps (%.1f%%) for %llukB parked at peak\n",
+	       runs[1].hits, runs[1].dmas,
+	       runs[1].dmas ? runs[1].hits * 100.0 / runs[1].dmas : 0,
+	       runs[1].peak_cached_bytes >> 10);
+
+	return 0;
+}
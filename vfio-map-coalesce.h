@@ -0,0 +1,337 @@
+/*
+ * Coalescing VFIO_IOMMU_MAP_DMA.
+ *
+ * Map requests are batched, sorted by iova and issued as one mapping per
+ * run that is contiguous in both iova and vaddr with the same flags, up
+ * to max_size.  The requests making up each host mapping are kept as a
+ * shadow, so a caller can still unmap any one of them: an unmap covering
+ * whole host mappings is a single ioctl, one cutting into a host mapping
+ * unmaps all of it and maps back the requests either side of the cut.
+ * The requests remapped are briefly absent from the IOMMU, and repinned,
+ * which is the price of partial unmaps and what max_size bounds.
+ *
+ * Mapped requests are only in the IOMMU after coalesce_flush(), or once
+ * batch requests are pending.  A negative container makes it a dry run
+ * which only counts ioctls.
+ *
+ * Include after the VFIO uapi definitions.
+ */
+#ifndef VFIO_MAP_COALESCE_H
+#define VFIO_MAP_COALESCE_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+struct coalesce_req {
+	__u64	vaddr;
+	__u64	iova;
+	__u64	size;
+	__u32	flags;
+};
+
+/* A host mapping and the request sizes it was built from, in order */
+struct coalesce_map {
+	__u64	vaddr;
+	__u64	iova;
+	__u64	size;
+	__u32	flags;
+	int	nr;
+	__u64	*sizes;
+};
+
+struct map_coalescer {
+	int	container;
+	__u64	max_size;
+	int	batch;
+	int	nr_pending;
+	struct coalesce_req *pending;
+	int	nr_maps, max_maps;
+	struct coalesce_map *maps;	/* sorted by iova, disjoint */
+	unsigned long	requests, map_ioctls, unmap_ioctls, remaps;
+	unsigned long long remap_bytes;
+};
+
+static inline int coalesce_init(struct map_coalescer *c, int container,
+				__u64 max_size, int batch)
+{
+	memset(c, 0, sizeof(*c));
+	c->container = container;
+	c->max_size = max_size;
+	c->batch = batch;
+	c->pending = calloc(batch, sizeof(*c->pending));
+	return c->pending ? 0 : -1;
+}
+
+/* First host mapping ending after iova */
+static inline int coalesce_find(struct map_coalescer *c, __u64 iova)
+{
+	int lo = 0, hi = c->nr_maps, i;
+
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (c->maps[i].iova + c->maps[i].size <= iova)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	return lo;
+}
+
+/* Replace nr_old host mappings at index i with nr_new uninitialised ones */
+static inline int coalesce_splice(struct map_coalescer *c, int i,
+				  int nr_old, int nr_new)
+{
+	int nr = c->nr_maps - nr_old + nr_new;
+
+	if (nr > c->max_maps) {
+		int max = c->max_maps ? c->max_maps * 2 : 64;
+		struct coalesce_map *tmp;
+
+		while (max < nr)
+			max *= 2;
+
+		tmp = realloc(c->maps, max * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		c->maps = tmp;
+		c->max_maps = max;
+	}
+
+	memmove(&c->maps[i + nr_new], &c->maps[i + nr_old],
+		(c->nr_maps - i - nr_old) * sizeof(*c->maps));
+	c->nr_maps = nr;
+	return 0;
+}
+
+static inline int coalesce_host_map(struct map_coalescer *c,
+				    struct coalesce_map *m)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = m->flags,
+		.vaddr = m->vaddr,
+		.iova = m->iova,
+		.size = m->size,
+	};
+
+	c->map_ioctls++;
+	if (c->container < 0)
+		return 0;
+
+	return ioctl(c->container, VFIO_IOMMU_MAP_DMA, &dma_map);
+}
+
+static inline int coalesce_req_cmp(const void *a, const void *b)
+{
+	const struct coalesce_req *x = a, *y = b;
+
+	return x->iova < y->iova ? -1 : x->iova > y->iova;
+}
+
+/* Map everything pending, one ioctl per run */
+static inline int coalesce_flush(struct map_coalescer *c)
+{
+	struct coalesce_req *r = c->pending;
+	struct coalesce_map *m;
+	int i, j, k, at;
+
+	qsort(r, c->nr_pending, sizeof(*r), coalesce_req_cmp);
+
+	for (i = 0; i < c->nr_pending; i = j) {
+		__u64 size = r[i].size;
+
+		for (j = i + 1; j < c->nr_pending; j++) {
+			if (r[j].iova != r[i].iova + size ||
+			    r[j].vaddr != r[i].vaddr + size ||
+			    r[j].flags != r[i].flags ||
+			    size + r[j].size > c->max_size)
+				break;
+			size += r[j].size;
+		}
+
+		at = coalesce_find(c, r[i].iova);
+		if (coalesce_splice(c, at, 0, 1))
+			goto fail;
+
+		m = &c->maps[at];
+		m->vaddr = r[i].vaddr;
+		m->iova = r[i].iova;
+		m->size = size;
+		m->flags = r[i].flags;
+		m->nr = j - i;
+		m->sizes = malloc(m->nr * sizeof(*m->sizes));
+		if (!m->sizes) {
+			coalesce_splice(c, at, 1, 0);
+			goto fail;
+		}
+		for (k = i; k < j; k++)
+			m->sizes[k - i] = r[k].size;
+
+		if (coalesce_host_map(c, m)) {
+			free(m->sizes);
+			coalesce_splice(c, at, 1, 0);
+			goto fail;
+		}
+	}
+
+	c->nr_pending = 0;
+	return 0;
+
+fail:
+	c->nr_pending = 0;
+	return -1;
+}
+
+static inline int coalesce_map(struct map_coalescer *c, __u64 vaddr,
+			       __u64 iova, __u64 size, __u32 flags)
+{
+	struct coalesce_req *r = &c->pending[c->nr_pending++];
+
+	r->vaddr = vaddr;
+	r->iova = iova;
+	r->size = size;
+	r->flags = flags;
+	c->requests++;
+
+	if (c->nr_pending == c->batch)
+		return coalesce_flush(c);
+
+	return 0;
+}
+
+/*
+ * Split host mapping m at off, which must fall on a request boundary,
+ * into the part before (left) or after it.  Returns the number of
+ * requests in the part, -1 if off cuts a request.
+ */
+static inline int coalesce_cut(struct coalesce_map *m, __u64 off, int left,
+			       struct coalesce_map *part)
+{
+	__u64 pos = 0;
+	int i;
+
+	for (i = 0; i < m->nr && pos < off; i++)
+		pos += m->sizes[i];
+
+	if (pos != off)
+		return -1;
+
+	*part = *m;
+	if (left) {
+		part->size = off;
+		part->nr = i;
+	} else {
+		part->vaddr += off;
+		part->iova += off;
+		part->size -= off;
+		part->nr -= i;
+	}
+
+	part->sizes = NULL;
+	if (!part->nr)
+		return 0;
+
+	part->sizes = malloc(part->nr * sizeof(*part->sizes));
+	if (!part->sizes)
+		return -1;
+	memcpy(part->sizes, m->sizes + (left ? 0 : i),
+	       part->nr * sizeof(*part->sizes));
+
+	return part->nr;
+}
+
+/*
+ * Unmap [iova, iova + size), which may only cut host mappings on request
+ * boundaries (EINVAL otherwise).  Gaps are fine, as with UNMAP_DMA.
+ */
+static inline int coalesce_unmap(struct map_coalescer *c, __u64 iova,
+				 __u64 size)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	struct coalesce_map parts[2], *first, *last;
+	__u64 end = iova + size;
+	int i, n, nr = 0, ret = 0;
+
+	if (c->nr_pending && coalesce_flush(c))
+		return -1;
+
+	i = coalesce_find(c, iova);
+	for (n = 0; i + n < c->nr_maps && c->maps[i + n].iova < end; n++)
+		;
+	if (!n)
+		return 0;
+
+	first = &c->maps[i];
+	last = &c->maps[i + n - 1];
+
+	/* What survives either side of the cut */
+	if (first->iova < iova) {
+		if (coalesce_cut(first, iova - first->iova, 1, &parts[nr]) <= 0)
+			goto inval;
+		nr++;
+	}
+	if (last->iova + last->size > end) {
+		if (coalesce_cut(last, end - last->iova, 0, &parts[nr]) <= 0)
+			goto inval;
+		nr++;
+	}
+
+	dma_unmap.iova = first->iova;
+	dma_unmap.size = last->iova + last->size - first->iova;
+	c->unmap_ioctls++;
+	if (c->container >= 0 &&
+	    (ioctl(c->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+	     dma_unmap.size != last->iova + last->size - first->iova)) {
+		/* Still mapped, leave the shadow as it is */
+		while (nr--)
+			free(parts[nr].sizes);
+		return -1;
+	}
+
+	for (n--; n >= 0; n--)
+		free(c->maps[i + n].sizes);
+	n = last - first + 1;
+
+	if (coalesce_splice(c, i, n, nr)) {
+		while (nr--)
+			free(parts[nr].sizes);
+		return -1;
+	}
+
+	for (n = 0; n < nr; n++) {
+		c->maps[i + n] = parts[n];
+		c->remaps++;
+		c->remap_bytes += parts[n].size;
+		if (coalesce_host_map(c, &c->maps[i + n]))
+			ret = -1;
+	}
+
+	return ret;
+
+inval:
+	while (nr--)
+		free(parts[nr].sizes);
+	errno = EINVAL;
+	return -1;
+}
+
+static inline void coalesce_free(struct map_coalescer *c)
+{
+	int i;
+
+	for (i = 0; i < c->nr_maps; i++)
+		free(c->maps[i].sizes);
+	free(c->maps);
+	free(c->pending);
+	memset(c, 0, sizeof(*c));
+}
+
+#endif /* VFIO_MAP_COALESCE_H */
@@ -0,0 +1,285 @@
+/*
+ * PCI config space snapshots through the vfio-pci config region.
+ *
+ * A snapshot is the whole config region (256 bytes, or 4K for PCIe)
+ * read with a single preadv, the standard header and the extended space
+ * landing in separate iovecs.  The capability lists are then parsed out
+ * of the buffer, so walking them costs no further syscalls, and two
+ * snapshots (ex. either side of a reset) can be diffed with every
+ * changed dword attributed to the header or the capability owning it.
+ *
+ * Include after the VFIO uapi definitions (embedded copy or
+ * <linux/vfio.h>).
+ */
+#ifndef VFIO_PCI_CONFIG_H
+#define VFIO_PCI_CONFIG_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#define PCI_CFG_SPACE_SIZE	256
+#define PCI_CFG_SPACE_EXP_SIZE	4096
+#define PCI_CFG_MAX_CAPS	96	/* 48 standard + 48 extended is plenty */
+
+#define PCI_CFG_VENDOR_ID	0x00
+#define PCI_CFG_COMMAND		0x04
+#define PCI_CFG_STATUS		0x06
+#define PCI_CFG_STATUS_CAP_LIST	0x10
+#define PCI_CFG_BAR0		0x10
+#define PCI_CFG_CAP_PTR		0x34
+
+struct pci_cfg_cap {
+	__u16	id;
+	__u16	offset;
+	int	extended;
+};
+
+struct pci_cfg_snapshot {
+	unsigned int size;
+	unsigned long long ns;	/* time to read it */
+	int nr_caps;		/* sorted by offset */
+	struct pci_cfg_cap caps[PCI_CFG_MAX_CAPS];
+	__u8 data[PCI_CFG_SPACE_EXP_SIZE];
+};
+
+static inline __u16 pci_cfg_word(const struct pci_cfg_snapshot *snap,
+				 unsigned int off)
+{
+	__u16 val;
+
+	memcpy(&val, snap->data + off, sizeof(val));
+	return val;
+}
+
+static inline __u32 pci_cfg_dword(const struct pci_cfg_snapshot *snap,
+				  unsigned int off)
+{
+	__u32 val;
+
+	memcpy(&val, snap->data + off, sizeof(val));
+	return val;
+}
+
+/* One region info ioctl, for tests without the device info cache */
+static inline int pci_cfg_region(int device, __u64 *offset, __u32 *size)
+{
+	struct vfio_region_info info = {
+		.argsz = sizeof(info),
+		.index = VFIO_PCI_CONFIG_REGION_INDEX,
+	};
+
+	if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &info))
+		return -1;
+
+	*offset = info.offset;
+	*size = info.size > PCI_CFG_SPACE_EXP_SIZE ?
+		PCI_CFG_SPACE_EXP_SIZE : info.size;
+	return 0;
+}
+
+static inline const char *pci_cfg_cap_name(const struct pci_cfg_cap *cap)
+{
+	if (cap->extended) {
+		switch (cap->id) {
+		case 0x01: return "AER";
+		case 0x02: return "VC";
+		case 0x03: return "DSN";
+		case 0x0b: return "VNDR";
+		case 0x0d: return "ACS";
+		case 0x0e: return "ARI";
+		case 0x0f: return "ATS";
+		case 0x10: return "SR-IOV";
+		case 0x13: return "PRI";
+		case 0x15: return "REBAR";
+		case 0x18: return "LTR";
+		case 0x19: return "SECPCI";
+		case 0x1b: return "PASID";
+		case 0x1e: return "L1SS";
+		}
+	} else {
+		switch (cap->id) {
+		case 0x01: return "PM";
+		case 0x05: return "MSI";
+		case 0x09: return "VNDR";
+		case 0x0d: return "SSVID";
+		case 0x10: return "EXP";
+		case 0x11: return "MSI-X";
+		case 0x13: return "AF";
+		}
+	}
+
+	return "?";
+}
+
+static inline int pci_cfg_cap_cmp(const void *a, const void *b)
+{
+	const struct pci_cfg_cap *x = a, *y = b;
+
+	return x->offset - y->offset;
+}
+
+static inline void pci_cfg_parse_caps(struct pci_cfg_snapshot *snap)
+{
+	unsigned int pos, loops;
+	__u32 header;
+
+	snap->nr_caps = 0;
+
+	if (pci_cfg_word(snap, PCI_CFG_STATUS) & PCI_CFG_STATUS_CAP_LIST) {
+		pos = snap->data[PCI_CFG_CAP_PTR] & ~3;
+
+		for (loops = 0; pos >= 0x40 && pos < PCI_CFG_SPACE_SIZE &&
+		     loops < 48 && snap->nr_caps < PCI_CFG_MAX_CAPS; loops++) {
+			if (snap->data[pos] == 0xff)
+				break;
+
+			snap->caps[snap->nr_caps].id = snap->data[pos];
+			snap->caps[snap->nr_caps].offset = pos;
+			snap->caps[snap->nr_caps].extended = 0;
+			snap->nr_caps++;
+
+			pos = snap->data[pos + 1] & ~3;
+		}
+	}
+
+	if (snap->size < PCI_CFG_SPACE_EXP_SIZE)
+		goto sort;
+
+	for (pos = PCI_CFG_SPACE_SIZE, loops = 0;
+	     pos >= PCI_CFG_SPACE_SIZE && pos < PCI_CFG_SPACE_EXP_SIZE &&
+	     loops < 48 && snap->nr_caps < PCI_CFG_MAX_CAPS; loops++) {
+		header = pci_cfg_dword(snap, pos);
+		if (!header || header == 0xffffffff)
+			break;
+
+		snap->caps[snap->nr_caps].id = header & 0xffff;
+		snap->caps[snap->nr_caps].offset = pos;
+		snap->caps[snap->nr_caps].extended = 1;
+		snap->nr_caps++;
+
+		pos = (header >> 20) & ~3;
+	}
+
+sort:
+	qsort(snap->caps, snap->nr_caps, sizeof(snap->caps[0]),
+	      pci_cfg_cap_cmp);
+}
+
+/* offset/size from pci_cfg_region() or the device info cache */
+static inline int pci_cfg_snapshot(int device, __u64 offset, __u32 size,
+				   struct pci_cfg_snapshot *snap)
+{
+	struct iovec iov[2];
+	struct timespec t0, t1;
+	ssize_t ret;
+	int iovcnt = 1;
+
+	if (size > PCI_CFG_SPACE_EXP_SIZE)
+		size = PCI_CFG_SPACE_EXP_SIZE;
+
+	iov[0].iov_base = snap->data;
+	iov[0].iov_len = size < PCI_CFG_SPACE_SIZE ? size : PCI_CFG_SPACE_SIZE;
+	if (size > PCI_CFG_SPACE_SIZE) {
+		iov[1].iov_base = snap->data + PCI_CFG_SPACE_SIZE;
+		iov[1].iov_len = size - PCI_CFG_SPACE_SIZE;
+		iovcnt = 2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = preadv(device, iov, iovcnt, offset);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (ret != size) {
+		if (ret >= 0)
+			errno = EIO;
+		return -1;
+	}
+
+	snap->size = size;
+	snap->ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+		   t1.tv_nsec - t0.tv_nsec;
+	pci_cfg_parse_caps(snap);
+	return 0;
+}
+
+/* The capability owning a config offset, NULL for the header or a gap */
+static inline const struct pci_cfg_cap *
+pci_cfg_owner(const struct pci_cfg_snapshot *snap, unsigned int off)
+{
+	const struct pci_cfg_cap *owner = NULL;
+	int i;
+
+	if (off < 0x40)
+		return NULL;
+
+	for (i = 0; i < snap->nr_caps && snap->caps[i].offset <= off; i++)
+		owner = &snap->caps[i];
+
+	/* Don't let the last standard cap claim the start of extended space */
+	if (owner && owner->extended != (off >= PCI_CFG_SPACE_SIZE))
+		return NULL;
+
+	return owner;
+}
+
+static inline void pci_cfg_print_caps(const struct pci_cfg_snapshot *snap)
+{
+	int i;
+
+	printf("Config space %dB read in %llu ns, %04x:%04x, %d caps:",
+	       snap->size, snap->ns, pci_cfg_word(snap, PCI_CFG_VENDOR_ID),
+	       pci_cfg_word(snap, PCI_CFG_VENDOR_ID + 2), snap->nr_caps);
+
+	for (i = 0; i < snap->nr_caps; i++)
+		printf(" %s%s@%x", snap->caps[i].extended ? "x" : "",
+		       pci_cfg_cap_name(&snap->caps[i]), snap->caps[i].offset);
+
+	printf("\n");
+}
+
+/*
+ * Print the dwords that differ between two snapshots, attributed using
+ * the capability layout of the first.  Returns the number of changed
+ * dwords.
+ */
+static inline int pci_cfg_diff(const struct pci_cfg_snapshot *a,
+			       const struct pci_cfg_snapshot *b, int verbose)
+{
+	unsigned int off, size = a->size < b->size ? a->size : b->size;
+	const struct pci_cfg_cap *owner;
+	int changed = 0;
+
+	for (off = 0; off < size; off += 4) {
+		__u32 x = pci_cfg_dword(a, off), y = pci_cfg_dword(b, off);
+
+		if (x == y)
+			continue;
+
+		changed++;
+		if (!verbose)
+			continue;
+
+		owner = pci_cfg_owner(a, off);
+		if (!owner)
+			printf("\t%03x: %08x -> %08x (%s)\n", off, x, y,
+			       off < 0x40 ? "header" : "no cap");
+		else
+			printf("\t%03x: %08x -> %08x (%s%s@%x +%x)\n", off, x, y,
+			       owner->extended ? "x" : "",
+			       pci_cfg_cap_name(owner), owner->offset,
+			       off - owner->offset);
+	}
+
+	if (a->nr_caps != b->nr_caps && verbose)
+		printf("\tcapability count changed %d -> %d\n",
+		       a->nr_caps, b->nr_caps);
+
+	return changed;
+}
+
+#endif /* VFIO_PCI_CONFIG_H */
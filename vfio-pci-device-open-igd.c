@@ -212,6 +212,9 @@ struct vfio_region_info_cap_type {
 
 #define VFIO_REGION_SUBTYPE_INTEL_IGD_OPREGION  (1)
 
+#define PCI_VENDOR_ID_INTEL                     0x8086
+#define IGD_ASLS                                0xfc /* OpRegion address */
+
 /**
  * VFIO_DEVICE_GET_IRQ_INFO - _IOWR(VFIO_TYPE, VFIO_BASE + 9,
  *				    struct vfio_irq_info)
@@ -470,9 +473,207 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include "vfio-bench.h"
+#include "vfio-device-info.h"
+#include "vfio-pci-config.h"
+
 void usage(char *name)
 {
-	printf("usage: %s <iommu group id> <ssss:bb:dd.f>\n", name);
+	printf("usage: %s <iommu group id> <ssss:bb:dd.f> "
+	       "[opregion [iterations]]\n", name);
+	printf("\topregion: copy out the whole OpRegion, parse it and\n"
+	       "\t          compare read chunk sizes and mmap\n");
+}
+
+/*
+ * OpRegion layout, per the IGD OpRegion spec (and i915 intel_opregion.c).
+ * The header is followed by fixed 256 byte mailboxes, the VBT lives in
+ * mailbox 4.
+ */
+#define OPREGION_SIGNATURE	"IntelGraphicsMem"
+#define OPREGION_SIZE		0x10	/* in KB */
+#define OPREGION_OVER		0x14	/* rsvd, revision, minor, major */
+#define OPREGION_BIOS_VER	0x18
+#define OPREGION_VBIOS_VER	0x38
+#define OPREGION_DRIVER_VER	0x48
+#define OPREGION_MBOXES		0x58
+#define OPREGION_VBT_OFFSET	0x400
+#define OPREGION_VBT_SIZE	0x18	/* u16, within the VBT header */
+
+static const struct {
+	unsigned int bit, offset;
+	const char *name;
+} opregion_mboxes[] = {
+	{ 0, 0x100, "ACPI" },
+	{ 1, 0x200, "SWSCI" },
+	{ 2, 0x300, "ASLE" },
+	{ 4, 0x1c00, "ASLE_EXT" },
+	{ 5, 0x0, "BACKLIGHT" },	/* extends ASLE, no own mailbox */
+};
+
+void opregion_parse(unsigned char *buf, unsigned long size)
+{
+	unsigned int mboxes, i;
+	unsigned short vbt_size;
+	char str[33];
+
+	memcpy(str, buf, 16);
+	str[16] = 0;
+	printf("\tsignature %s%s\n", str,
+	       memcmp(buf, OPREGION_SIGNATURE, 16) ? " (INVALID)" : "");
+	printf("\tversion %d.%d.%d\n", buf[OPREGION_OVER + 3],
+	       buf[OPREGION_OVER + 2], buf[OPREGION_OVER + 1]);
+
+	memcpy(str, buf + OPREGION_BIOS_VER, 32);
+	str[32] = 0;
+	printf("\tbios version \"%s\"\n", str);
+	memcpy(str, buf + OPREGION_VBIOS_VER, 16);
+	str[16] = 0;
+	printf("\tvbios version \"%s\"\n", str);
+	memcpy(str, buf + OPREGION_DRIVER_VER, 16);
+	str[16] = 0;
+	printf("\tdriver version \"%s\"\n", str);
+
+	memcpy(&mboxes, buf + OPREGION_MBOXES, 4);
+	printf("\tmailboxes 0x%x:", mboxes);
+	for (i = 0; i < sizeof(opregion_mboxes) / sizeof(opregion_mboxes[0]);
+	     i++) {
+		if (!(mboxes & (1 << opregion_mboxes[i].bit)))
+			continue;
+
+		if (opregion_mboxes[i].offset)
+			printf(" %s@%x", opregion_mboxes[i].name,
+			       opregion_mboxes[i].offset);
+		else
+			printf(" %s", opregion_mboxes[i].name);
+	}
+	printf("\n");
+
+	if (size < OPREGION_VBT_OFFSET + OPREGION_VBT_SIZE + 2 ||
+	    memcmp(buf + OPREGION_VBT_OFFSET, "$VBT", 4)) {
+		printf("\tno VBT in mailbox 4\n");
+		return;
+	}
+
+	memcpy(str, buf + OPREGION_VBT_OFFSET, 20);
+	str[20] = 0;
+	memcpy(&vbt_size, buf + OPREGION_VBT_OFFSET + OPREGION_VBT_SIZE, 2);
+	printf("\tVBT \"%s\" @%x, %d bytes\n", str, OPREGION_VBT_OFFSET,
+	       vbt_size);
+}
+
+ssize_t opregion_copy(int device, struct vfio_dev_region *region,
+		      unsigned char *buf, unsigned long size,
+		      unsigned long chunk)
+{
+	unsigned long done;
+	ssize_t ret;
+
+	for (done = 0; done < size; done += ret) {
+		ret = pread(device, buf + done, MIN(chunk, size - done),
+			    region->offset + done);
+		if (ret <= 0)
+			return -1;
+	}
+
+	return done;
+}
+
+/*
+ * Copy the OpRegion out as a VMM would at boot, with a range of pread
+ * chunk sizes and through a mapping if the region supports it.
+ */
+int opregion_bench(int device, struct vfio_dev_region *region,
+		   unsigned long size, int iterations)
+{
+	static const unsigned long chunks[] = {
+		4, 64, 256, 1024, 4096, 16384, 65536, 0 /* whole */
+	};
+	struct lat_stats lat = { 0 };
+	unsigned char *ref, *buf;
+	unsigned long chunk;
+	unsigned long long t;
+	int i, j, ret = -1;
+	void *map;
+
+	ref = malloc(size);
+	buf = malloc(size);
+	if (!ref || !buf) {
+		printf("Failed to alloc opregion buffers\n");
+		goto out;
+	}
+
+	if (opregion_copy(device, region, ref, size, size) != size) {
+		printf("Failed to read opregion (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	printf("IGD opregion, %lu bytes:\n", size);
+	opregion_parse(ref, size);
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		chunk = chunks[i] ? chunks[i] : size;
+		if (chunks[i] >= size)
+			continue;
+
+		lat_reset(&lat);
+		for (j = 0; j < iterations; j++) {
+			memset(buf, 0, size);
+			t = now_ns();
+			if (opregion_copy(device, region,
+					  buf, size, chunk) != size) {
+				printf("Failed to read opregion (%s)\n",
+				       strerror(errno));
+				goto out;
+			}
+			lat_add(&lat, now_ns() - t);
+
+			if (memcmp(buf, ref, size)) {
+				printf("OpRegion changed between reads\n");
+				goto out;
+			}
+		}
+
+		printf("pread %6lu: %8.1f MB/s, ", chunk,
+		       (double)size * iterations * 1000 / lat_sum(&lat));
+		lat_print("copy", &lat);
+	}
+
+	ret = 0;
+	if (!(region->flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+		printf("mmap: not supported by region\n");
+		goto out;
+	}
+
+	t = now_ns();
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, device, region->offset);
+	if (map == MAP_FAILED) {
+		printf("mmap: failed (%s)\n", strerror(errno));
+		goto out;
+	}
+	printf("mmap: setup %llu ns\n", now_ns() - t);
+
+	lat_reset(&lat);
+	for (j = 0; j < iterations; j++) {
+		memset(buf, 0, size);
+		t = now_ns();
+		memcpy(buf, map, size);
+		lat_add(&lat, now_ns() - t);
+	}
+
+	if (memcmp(buf, ref, size))
+		printf("mmap: contents differ from pread\n");
+
+	printf("mmap  memcpy: %8.1f MB/s, ",
+	       (double)size * iterations * 1000 / lat_sum(&lat));
+	lat_print("copy", &lat);
+	munmap(map, size);
+
+out:
+	lat_free(&lat);
+	free(ref);
+	free(buf);
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -485,19 +686,31 @@ int main(int argc, char **argv)
 		.argsz = sizeof(group_status)
 	};
 
-	struct vfio_device_info device_info = {
-		.argsz = sizeof(device_info)
-	};
-
-	struct vfio_region_info region_info = {
-		.argsz = sizeof(region_info)
-	};
+	struct vfio_dev_info *di;
+	struct vfio_dev_region *region, *config;
+	struct pci_cfg_snapshot before, after;
+	unsigned long config_offset;
+	unsigned long long start;
+	unsigned int off;
+	char sig[17];
+	unsigned size, tmp;
+	int opregion = 0, iterations = 100;
 
 	if (argc < 3) {
 		usage(argv[0]);
 		return -1;
 	}
 
+	if (argc > 3) {
+		if (strcmp(argv[3], "opregion") ||
+		    (argc > 4 && sscanf(argv[4], "%d", &iterations) != 1) ||
+		    iterations <= 0) {
+			usage(argv[0]);
+			return -1;
+		}
+		opregion = 1;
+	}
+
 	ret = sscanf(argv[1], "%d", &groupid);
 	if (ret != 1) {
 		usage(argv[0]);
@@ -581,126 +794,109 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info)) {
+	di = vfio_dev_info_get(device);
+	if (!di) {
 		printf("Failed to get device info\n");
 		return -1;
 	}
 
 	printf("Device supports %d regions, %d irqs\n",
-	       device_info.num_regions, device_info.num_irqs);
+	       di->num_regions, di->num_irqs);
 
-	for (i = 0; i < device_info.num_regions; i++) {
-		unsigned long config_offset;
-		char sig[17];
-		unsigned size, tmp;
+	for (i = 0; i < di->num_regions; i++) {
+		region = vfio_dev_region(di, i);
 
 		printf("Region %d: ", i);
-		region_info.index = i;
-		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info)) {
+		if (!region->valid) {
 			printf("Failed to get info\n");
 			continue;
 		}
 
 		printf("size 0x%lx, offset 0x%lx, flags 0x%x\n",
-		       (unsigned long)region_info.size,
-		       (unsigned long)region_info.offset, region_info.flags);
-
-		if (i == VFIO_PCI_CONFIG_REGION_INDEX)
-			config_offset = region_info.offset;
-
-		if (region_info.flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			struct vfio_region_info *region;
-			void *buf;
-			struct vfio_info_cap_header *header;
-			struct vfio_region_info_cap_type *type;
-
-			printf("Found caps flag, realloc %d bytes\n",
-				region_info.argsz);
-
-
-			buf = region = malloc(region_info.argsz);
-			if (!region) {
-				printf("Can't new buffer\n");
-				return -1;
-			}
-
-			region->argsz = region_info.argsz;
-			region->index = i;
-
-			if (ioctl(device,
-			          VFIO_DEVICE_GET_REGION_INFO, region)) {
-
-				printf("Failed to re-get info\n");
-				return -1;
-			}
-
-			if (region->argsz != region_info.argsz) {
-				printf("Size changed!?\n");
-				return -1;
-			}
-
-			if (!region->flags & VFIO_REGION_INFO_FLAG_CAPS) {
-				printf("Caps disappeared?!\n");
-				return -1;
-			}
+		       (unsigned long)region->size,
+		       (unsigned long)region->offset, region->flags);
 
-			printf("First cap @%x\n", region->cap_offset);
+		if (region->nr_caps)
+			printf("%d caps, type %x, sub-type %x, "
+			       "%d sparse areas\n", region->nr_caps,
+			       region->type, region->subtype, region->nr_sparse);
+	}
 
-			header = buf + region->cap_offset;
+	region = vfio_dev_find_region(di, VFIO_REGION_TYPE_PCI_VENDOR_TYPE |
+					  PCI_VENDOR_ID_INTEL,
+				      VFIO_REGION_SUBTYPE_INTEL_IGD_OPREGION);
+	if (!region) {
+		printf("No IGD opregion region\n");
+		return -1;
+	}
 
-			printf("header ID %x version %x next %x\n",
-			       header->id, header->version, header->next);
+	config = vfio_dev_region(di, VFIO_PCI_CONFIG_REGION_INDEX);
+	config_offset = config->offset;
 
-			if (header->id != VFIO_REGION_INFO_CAP_TYPE) {
-				printf("Unexpected ID, this code doesn't walk the chain\n");
-				return -1;
-			}
+	if (pci_cfg_snapshot(device, config_offset, config->size, &before)) {
+		printf("failed to snapshot config (%s)\n", strerror(errno));
+		return -1;
+	}
 
+	pci_cfg_print_caps(&before);
 
-			type = (struct vfio_region_info_cap_type *)header;
+	/* For comparison, the same config space a dword at a time */
+	start = now_ns();
+	for (off = 0; off < before.size; off += 4) {
+		if (pread(device, &tmp, 4, config_offset + off) != 4) {
+			printf("failed to read config @%x\n", off);
+			return -1;
+		}
+	}
+	printf("Config space dword reads: %llu ns\n", now_ns() - start);
 
-			printf("Type %x, sub-type %x\n",
-			       type->type, type->subtype);
+	if (pread(device, sig, 16, region->offset) != 16) {
+		printf("failed to read signature\n");
+		return -1;
+	}
 
+	sig[16] = 0;
 
-			if (pread(device, sig, 16, region->offset) != 16) {
-				printf("failed to read signature\n");
-				return -1;
-			}
+	printf("IGD opregion signature: %s\n", sig);
 
-			sig[16] = 0;
+	if (pread(device, &size, 4, region->offset + 16) != 4) {
+		printf("failed to read size\n");
+		return -1;
+	}
 
-			printf("IGD opregion signature: %s\n", sig);
+	printf("IGD opregion size %dKB\n", size);
 
-			if (pread(device, &size, 4, region->offset + 16) != 4) {
-				printf("failed to read size\n");
-				return -1;
-			}
+	if (opregion) {
+		unsigned long bytes = (unsigned long)size * 1024;
 
-			printf("IGD opregion size %dKB\n", size);
+		if (!bytes || bytes > region->size) {
+			printf("OpRegion size exceeds region, using 0x%lx\n",
+			       (unsigned long)region->size);
+			bytes = region->size;
+		}
 
-			if (pread(device, &tmp, 4, config_offset + 0xfc) != 4) {
-				printf("failed to read config\n");
-				return -1;
-			}
+		if (opregion_bench(device, region, bytes, iterations))
+			return -1;
+	}
 
-			printf("IGD opregion address: %08x\n", tmp);
+	printf("IGD opregion address: %08x\n",
+	       pci_cfg_dword(&before, IGD_ASLS));
 
-			tmp = 0;
+	tmp = 0;
 
-			pwrite(device, &tmp, 4, config_offset + 0xfc);
-			if (pread(device, &tmp, 4, config_offset + 0xfc) != 4) {
-				printf("failed to re-read config\n");
-				return -1;
-			}
+	pwrite(device, &tmp, 4, config_offset + IGD_ASLS);
+	if (pci_cfg_snapshot(device, config_offset, config->size, &after)) {
+		printf("failed to re-snapshot config (%s)\n", strerror(errno));
+		return -1;
+	}
 
-			printf("IGD opregion virt address: %08x\n", tmp);
+	printf("IGD opregion virt address: %08x\n",
+	       pci_cfg_dword(&after, IGD_ASLS));
 
-			free(buf);
-		}
+	printf("Config changes:\n");
+	printf("%d dwords changed\n", pci_cfg_diff(&before, &after, 1));
 
-		region_info.argsz = sizeof(region_info);
-	}
+	vfio_dev_info_free(di);
 
 	printf("Success\n");
 	//printf("Press any key to exit\n");
@@ -178,7 +178,7 @@ struct vfio_region_info {
 #define VFIO_REGION_INFO_FLAG_MMAP	(1 << 2) /* Region supports mmap */
 #define VFIO_REGION_INFO_FLAG_CAPS      (1 << 3) /* Info supports caps */
 	__u32	index;		/* Region index */
-	__u32	cap_offset;	/* Reserved for alignment */
+	__u32	cap_offset;	/* Offset within info struct of first cap */
 	__u64	size;		/* Region size (bytes) */
 	__u64	offset;		/* Region offset from start of device fd */
 };
@@ -198,6 +198,17 @@ struct vfio_region_info_cap_sparse_mmap {
         struct vfio_region_sparse_mmap_area areas[];
 };
 
+#define VFIO_REGION_INFO_CAP_TYPE       2
+
+struct vfio_region_info_cap_type {
+        struct vfio_info_cap_header header;
+        __u32 type;     /* global per bus driver */
+        __u32 subtype;  /* type specific */
+};
+
+#define VFIO_REGION_TYPE_PCI_VENDOR_TYPE        (1 << 31)
+#define VFIO_REGION_TYPE_PCI_VENDOR_MASK        (0xffff)
+
 /**
  * VFIO_DEVICE_GET_IRQ_INFO - _IOWR(VFIO_TYPE, VFIO_BASE + 9,
  *				    struct vfio_irq_info)
@@ -456,9 +467,322 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include "vfio-bench.h"
+#include "vfio-device-info.h"
+
 void usage(char *name)
 {
-	printf("usage: %s <iommu group id> <ssss:bb:dd.f>\n", name);
+	printf("usage: %s <iommu group id> <ssss:bb:dd.f> "
+	       "[bench <region index> [accesses] [mmap %%]]\n", name);
+	printf("\tbench: time random dword reads of the region, mixing\n"
+	       "\t       mmap'd (sparse area) and trapped (pread) offsets\n");
+}
+
+/*
+ * Region accessor.  Every mmap'able area of a region (the whole region,
+ * or each area of the sparse mmap capability) is mapped once and kept in
+ * a table sorted by offset.  An access contained within an area goes
+ * direct to the mapping, anything else (ex. the MSI-X table hole in a
+ * BAR) is trapped through pread/pwrite on the device fd.
+ */
+struct region_area {
+	__u64 offset;		/* within the region */
+	__u64 size;
+	void *map;
+};
+
+struct region_accessor {
+	int device;
+	__u64 fd_offset;	/* region offset from start of device fd */
+	__u64 size;
+	int nr_areas;
+	__u64 *starts;		/* areas[i].offset, packed for the search */
+	struct region_area *areas;
+};
+
+static int region_area_cmp(const void *a, const void *b)
+{
+	const struct region_area *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int region_accessor_init(struct region_accessor *ra, int device,
+			 struct vfio_dev_region *region)
+{
+	struct vfio_region_sparse_mmap_area whole, *areas;
+	int i, nr;
+
+	memset(ra, 0, sizeof(*ra));
+	ra->device = device;
+	ra->fd_offset = region->offset;
+	ra->size = region->size;
+
+	if (!(region->flags & VFIO_REGION_INFO_FLAG_MMAP) || !region->size)
+		return 0;
+
+	if (region->nr_sparse) {
+		areas = region->sparse;
+		nr = region->nr_sparse;
+	} else {
+		whole.offset = 0;
+		whole.size = region->size;
+		areas = &whole;
+		nr = 1;
+	}
+
+	ra->areas = calloc(nr, sizeof(*ra->areas));
+	ra->starts = calloc(nr, sizeof(*ra->starts));
+	if (!ra->areas || !ra->starts) {
+		printf("Failed to alloc area table\n");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct region_area *area = &ra->areas[ra->nr_areas];
+
+		if (!areas[i].size)
+			continue;
+
+		area->map = mmap(NULL, (size_t)areas[i].size,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, device,
+				 (off_t)(region->offset + areas[i].offset));
+		if (area->map == MAP_FAILED) {
+			printf("\t\tmmap %lx-%lx failed (%s), trapping it\n",
+			       (unsigned long)areas[i].offset,
+			       (unsigned long)(areas[i].offset + areas[i].size),
+			       strerror(errno));
+			continue;
+		}
+
+		area->offset = areas[i].offset;
+		area->size = areas[i].size;
+		ra->nr_areas++;
+	}
+
+	qsort(ra->areas, ra->nr_areas, sizeof(*ra->areas), region_area_cmp);
+	for (i = 0; i < ra->nr_areas; i++)
+		ra->starts[i] = ra->areas[i].offset;
+
+	return 0;
+}
+
+void region_accessor_free(struct region_accessor *ra)
+{
+	int i;
+
+	for (i = 0; i < ra->nr_areas; i++)
+		munmap(ra->areas[i].map, (size_t)ra->areas[i].size);
+
+	free(ra->areas);
+	free(ra->starts);
+	memset(ra, 0, sizeof(*ra));
+}
+
+/*
+ * Find the area fully containing [off, off + len).  The search loop has a
+ * fixed trip count for a given table and the step is a conditional move,
+ * so the only data dependent branch is the final containment test.
+ */
+static inline struct region_area *
+region_find(struct region_accessor *ra, __u64 off, __u64 len)
+{
+	const __u64 *base = ra->starts;
+	struct region_area *area;
+	int n = ra->nr_areas;
+	__u64 delta;
+
+	if (!n)
+		return NULL;
+
+	while (n > 1) {
+		int half = n / 2;
+
+		base += (base[half] <= off) ? half : 0;
+		n -= half;
+	}
+
+	area = &ra->areas[base - ra->starts];
+	delta = off - area->offset;	/* wraps if off is below the area */
+
+	return (delta < area->size && area->size - delta >= len) ? area : NULL;
+}
+
+ssize_t region_read(struct region_accessor *ra, void *buf,
+		    size_t len, __u64 off)
+{
+	struct region_area *area = region_find(ra, off, len);
+	void *p;
+
+	if (!area)
+		return pread(ra->device, buf, len, ra->fd_offset + off);
+
+	p = area->map + (off - area->offset);
+
+	switch (len) {
+	case 1:
+		*(__u8 *)buf = *(volatile __u8 *)p;
+		break;
+	case 2:
+		*(__u16 *)buf = *(volatile __u16 *)p;
+		break;
+	case 4:
+		*(__u32 *)buf = *(volatile __u32 *)p;
+		break;
+	case 8:
+		*(__u64 *)buf = *(volatile __u64 *)p;
+		break;
+	default:
+		memcpy(buf, p, len);
+	}
+
+	return len;
+}
+
+ssize_t region_write(struct region_accessor *ra, const void *buf,
+		     size_t len, __u64 off)
+{
+	struct region_area *area = region_find(ra, off, len);
+	void *p;
+
+	if (!area)
+		return pwrite(ra->device, buf, len, ra->fd_offset + off);
+
+	p = area->map + (off - area->offset);
+
+	switch (len) {
+	case 1:
+		*(volatile __u8 *)p = *(__u8 *)buf;
+		break;
+	case 2:
+		*(volatile __u16 *)p = *(__u16 *)buf;
+		break;
+	case 4:
+		*(volatile __u32 *)p = *(__u32 *)buf;
+		break;
+	case 8:
+		*(volatile __u64 *)p = *(__u64 *)buf;
+		break;
+	default:
+		memcpy(p, buf, len);
+	}
+
+	return len;
+}
+
+/*
+ * Random dword reads, mmap_pct of them from within mmap'd areas and the
+ * rest from trapped offsets (where the region has both).  Reads only,
+ * but note that reads of some device registers have side effects.
+ */
+int region_bench(struct region_accessor *ra, unsigned long accesses,
+		 int mmap_pct)
+{
+	struct lat_stats direct = { 0 }, trapped = { 0 };
+	unsigned long long start, wall, lookup;
+	unsigned int seed = 1;
+	unsigned long i, hits, fallbacks = 0;
+	__u64 *offsets, mapped = 0;
+	int j, k, usable = 0;
+	__u32 val;
+
+	if (ra->size < 4) {
+		printf("Region too small to benchmark\n");
+		return -1;
+	}
+
+	/* Areas too small for one access can't be picked */
+	for (j = 0; j < ra->nr_areas; j++) {
+		if (ra->areas[j].size < 4)
+			continue;
+		mapped += ra->areas[j].size;
+		usable++;
+	}
+
+	if (!usable)
+		mmap_pct = 0;
+	else if (mapped >= ra->size)
+		mmap_pct = 100;
+
+	offsets = malloc(accesses * sizeof(*offsets));
+	if (!offsets) {
+		printf("Failed to alloc offsets\n");
+		return -1;
+	}
+
+	for (i = 0; i < accesses; i++) {
+		if ((int)(rand_r(&seed) % 100) < mmap_pct) {
+			struct region_area *area = NULL;
+
+			k = rand_r(&seed) % usable;
+			for (j = 0; j < ra->nr_areas; j++) {
+				if (ra->areas[j].size < 4)
+					continue;
+				area = &ra->areas[j];
+				if (!k--)
+					break;
+			}
+			offsets[i] = area->offset +
+				     ((rand_r(&seed) % (area->size / 4)) * 4);
+			continue;
+		}
+
+		/* Trapped space may be small, bounded rejection sampling */
+		for (j = 0; j < 1000; j++) {
+			offsets[i] = ((((__u64)rand_r(&seed) << 31) |
+				       rand_r(&seed)) % (ra->size / 4)) * 4;
+			if (!region_find(ra, offsets[i], 4))
+				break;
+		}
+		if (j == 1000)
+			fallbacks++;
+	}
+
+	printf("Region size 0x%lx, %d mmap'd areas covering 0x%lx, "
+	       "%lu accesses, %d%% mmap\n", (unsigned long)ra->size,
+	       ra->nr_areas, (unsigned long)mapped, accesses, mmap_pct);
+	if (fallbacks)
+		printf("%lu trapped picks found no trapped offset and landed in "
+		       "mmap'd areas instead\n", fallbacks);
+
+	start = now_ns();
+	for (i = hits = 0; i < accesses; i++)
+		hits += region_find(ra, offsets[i], 4) != NULL;
+	lookup = now_ns() - start;
+
+	printf("Dispatch lookup: %.2f ns/lookup, %lu direct, %lu trapped\n",
+	       (double)lookup / accesses, hits, accesses - hits);
+
+	start = now_ns();
+	for (i = 0; i < accesses; i++) {
+		if (region_read(ra, &val, 4, offsets[i]) != 4) {
+			printf("Failed to read @0x%lx (%s)\n",
+			       (unsigned long)offsets[i], strerror(errno));
+			free(offsets);
+			return -1;
+		}
+	}
+	wall = now_ns() - start;
+
+	printf("Mixed reads: %.2f ns/access, %.0f accesses/s\n",
+	       (double)wall / accesses, accesses * 1e9 / wall);
+
+	/* Second pass timing each access, split by the path it takes */
+	for (i = 0; i < accesses; i++) {
+		int mmapped = region_find(ra, offsets[i], 4) != NULL;
+
+		start = now_ns();
+		region_read(ra, &val, 4, offsets[i]);
+		lat_add(mmapped ? &direct : &trapped, now_ns() - start);
+	}
+
+	lat_print("Direct (mmap)", &direct);
+	lat_print("Trapped (pread)", &trapped);
+
+	lat_free(&direct);
+	lat_free(&trapped);
+	free(offsets);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -466,15 +790,16 @@ int main(int argc, char **argv)
 	int i, ret, container, group, device, groupid;
 	char path[PATH_MAX];
 	int seg, bus, dev, func;
+	int bench_region = -1, mmap_pct = 50;
+	unsigned long accesses = 1000000;
+	struct region_accessor ra = { 0 };
+	struct vfio_dev_info *di;
+	unsigned long long start, cached;
 
 	struct vfio_group_status group_status = {
 		.argsz = sizeof(group_status)
 	};
 
-	struct vfio_device_info device_info = {
-		.argsz = sizeof(device_info)
-	};
-
 	struct vfio_region_info region_info = {
 		.argsz = sizeof(region_info)
 	};
@@ -496,6 +821,17 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	if (argc > 3) {
+		if (strcmp(argv[3], "bench") || argc < 5 ||
+		    sscanf(argv[4], "%d", &bench_region) != 1 ||
+		    (argc > 5 && sscanf(argv[5], "%lu", &accesses) != 1) ||
+		    (argc > 6 && sscanf(argv[6], "%d", &mmap_pct) != 1) ||
+		    !accesses || mmap_pct < 0 || mmap_pct > 100) {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
 	printf("Using PCI device %04x:%02x:%02x.%d in group %d\n",
                seg, bus, dev, func, groupid);
 
@@ -545,95 +881,102 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info)) {
-		printf("Failed to get device info\n");
+	start = now_ns();
+	di = vfio_dev_info_get(device);
+	if (!di) {
+		printf("Failed to get device info (%s)\n", strerror(errno));
 		return -1;
 	}
 
-	printf("Device supports %d regions, %d irqs\n",
-	       device_info.num_regions, device_info.num_irqs);
+	printf("Device supports %d regions, %d irqs, "
+	       "info cached with %d ioctls in %llu us\n",
+	       di->num_regions, di->num_irqs, di->nr_ioctls,
+	       (now_ns() - start) / 1000);
 
-	for (i = 0; i < device_info.num_regions; i++) {
-		struct vfio_region_info *info;
+	for (i = 0; i < di->num_regions; i++) {
+		struct vfio_dev_region *region = vfio_dev_region(di, i);
+		int j;
 
-		info = &region_info;
 		printf("Region %d: ", i);
-		region_info.index = i;
-		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, info)) {
+		if (!region->valid) {
 			printf("Failed to get info\n");
 			continue;
 		}
 
-		if (info->flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			info = calloc(info->argsz, 1);
-			if (!info) {
-				printf("Failed to alloc larger info\n");
-				info = &region_info;
-			} else {
-				memcpy(info, &region_info, sizeof(region_info));
-				if (ioctl(device,
-					  VFIO_DEVICE_GET_REGION_INFO, info)) {
-					printf("Failed to re-get info\n");
-					continue;
-				}
-			}
-		}
-
-		printf("size 0x%lx, offset 0x%lx, flags 0x%x\n",
-		       (unsigned long)info->size,
-		       (unsigned long)info->offset, info->flags);
-		if (0 && info->flags & VFIO_REGION_INFO_FLAG_MMAP) {
-			void *map = mmap(NULL, (size_t)region_info.size,
-					 PROT_READ, MAP_SHARED, device,
-					 (off_t)region_info.offset);
-			if (map == MAP_FAILED) {
-				printf("mmap failed\n");
-				continue;
-			}
+		printf("size 0x%lx, offset 0x%lx, flags 0x%x, %d caps\n",
+		       (unsigned long)region->size,
+		       (unsigned long)region->offset, region->flags,
+		       region->nr_caps);
 
-			printf("[");
-			fwrite(map, 1, region_info.size > 16 ? 16 :
-						region_info.size, stdout);
-			printf("]\n");
-			munmap(map, (size_t)region_info.size);
-		}
+		if (region->has_type)
+			printf("\t\ttype cap, type %x, subtype %x\n",
+			       region->type, region->subtype);
 
-		if (info->flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			struct vfio_info_cap_header *header;
+		if (region->msix_mappable)
+			printf("\t\tmsix mappable cap\n");
 
-			header = (void *)info + info->cap_offset;
+		if (region->nr_sparse) {
+			printf("\t\tsparse mmap cap, nr_areas %d\n",
+			       region->nr_sparse);
 
-next:
-			printf("\tCapability @%d: ID %d, version %d, next %d\n",
-			       info->cap_offset, header->id, header->version,
-			       header->next);
+			for (j = 0; j < region->nr_sparse; j++)
+				printf("\t\t\t%d: %lx-%lx\n", j,
+				       (unsigned long)region->sparse[j].offset,
+				       (unsigned long)(region->sparse[j].offset +
+						       region->sparse[j].size));
+		}
+	}
 
-			if (header->id == VFIO_REGION_INFO_CAP_SPARSE_MMAP) {
-				struct vfio_region_info_cap_sparse_mmap *sparse;
-				int i;
+	for (i = 0; i < di->num_irqs; i++)
+		printf("IRQ %d: count %d, flags 0x%x\n",
+		       i, di->irqs[i].count, di->irqs[i].flags);
+
+	/* Cached lookups vs. the ioctl they replace */
+	if (di->num_regions) {
+		volatile __u32 flags;
+
+		start = now_ns();
+		for (i = 0; i < 100000; i++)
+			flags = vfio_dev_region(di, i % di->num_regions)->flags;
+		cached = now_ns() - start;
+		(void)flags;
+
+		start = now_ns();
+		for (i = 0; i < 1000; i++) {
+			/* The kernel grows argsz for regions with caps */
+			region_info.argsz = sizeof(region_info);
+			region_info.flags = 0;
+			region_info.cap_offset = 0;
+			region_info.index = i % di->num_regions;
+			ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info);
+		}
 
-				sparse = (void *)header;
+		printf("Region lookup: cached %.2f ns, ioctl %.2f ns\n",
+		       (double)cached / 100000,
+		       (double)(now_ns() - start) / 1000);
+	}
 
-				printf("\t\tsparse mmap cap, nr_areas %d\n",
-				       sparse->nr_areas);
+	if (bench_region >= 0) {
+		if (bench_region >= di->num_regions ||
+		    !di->regions[bench_region].valid) {
+			printf("No region %d\n", bench_region);
+			return -1;
+		}
 
-				for (i = 0; i < sparse->nr_areas; i++)
-					printf("\t\t\t%d: %lx-%lx\n", i,
-					       sparse->areas[i].offset,
-					       sparse->areas[i].offset +
-					       sparse->areas[i].size);
-			}
+		if (region_accessor_init(&ra, device,
+					 vfio_dev_region(di, bench_region)))
+			return -1;
 
-			if (header->next) {
-				header = (void *)info + header->next;
-				goto next;
-			}
-		}
+		printf("Accessor: %d areas mmap'd\n", ra.nr_areas);
 
-		if (info != &region_info)
-			free(info);
+		ret = region_bench(&ra, accesses, mmap_pct);
+		region_accessor_free(&ra);
+		if (ret)
+			return ret;
 	}
 
+	vfio_dev_info_free(di);
+
 	printf("Success\n");
 	//printf("Press any key to exit\n");
 	//fgetc(stdin);
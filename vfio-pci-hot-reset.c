@@ -435,14 +435,765 @@ struct vfio_iommu_type1_dma_unmap {
 
 #include <linux/ioctl.h>
 
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "vfio-bench.h"
+#include "vfio-pci-config.h"
+
 void usage(char *name)
 {
-	printf("usage: %s <iommu group id> <ssss:bb:dd.f>\n", name);
+	printf("usage: %s <iommu group id> <ssss:bb:dd.f> "
+	       "[ready|compare <iterations>]\n", name);
+	printf("\tready: time each stage of recovery after reset\n");
+	printf("\tcompare: VFIO_DEVICE_RESET vs. VFIO_DEVICE_PCI_HOT_RESET\n");
+	printf("       %s multi <iterations> <iommu group id> <ssss:bb:dd.f> "
+	       "[<iommu group id> <ssss:bb:dd.f> ...]\n", name);
+	printf("\tmulti: group the devices by reset domain and reset the\n"
+	       "\t       domains serially, then in parallel threads\n");
+}
+
+static struct results results;
+
+#define READY_TIMEOUT_NS	(1000ULL * 1000 * 1000)	/* PCI allows 1s */
+#define READY_POLL_MIN_US	1
+#define READY_POLL_MAX_US	1000
+#define READY_DMA_SIZE		(2UL * 1024 * 1024)
+
+struct ready_stats {
+	struct lat_stats reset, config, irq, map, total;
+	unsigned long polls, map_retries;
+};
+
+/* Sleep with exponential back-off, 0 once the timeout has passed */
+static int ready_backoff(unsigned long long start, unsigned int *delay)
+{
+	if (now_ns() - start > READY_TIMEOUT_NS)
+		return 0;
+
+	usleep(*delay);
+	*delay = MIN(*delay * 2, READY_POLL_MAX_US);
+	return 1;
+}
+
+/*
+ * Poll the config header through the device fd until it reads back the
+ * pre-reset vendor/device ID, command register and BARs.
+ */
+int wait_config_ready(int device, __u64 config_offset,
+		      const struct pci_cfg_snapshot *ref, unsigned long *polls)
+{
+	unsigned int delay = READY_POLL_MIN_US;
+	unsigned long long start = now_ns();
+	__u8 header[PCI_CFG_BAR0 + 24];
+
+	do {
+		(*polls)++;
+		if (pread(device, header, sizeof(header),
+			  config_offset) != sizeof(header))
+			continue;
+
+		if (!memcmp(header, ref->data, 4) &&
+		    !memcmp(header + PCI_CFG_COMMAND,
+			    ref->data + PCI_CFG_COMMAND, 2) &&
+		    !memcmp(header + PCI_CFG_BAR0,
+			    ref->data + PCI_CFG_BAR0, 24))
+			return 0;
+	} while (ready_backoff(start, &delay));
+
+	return -1;
+}
+
+int set_irq_eventfd(int device, int index, int fd)
+{
+	char buf[sizeof(struct vfio_irq_set) + sizeof(int)];
+	struct vfio_irq_set *irq_set = (void *)buf;
+
+	irq_set->argsz = sizeof(buf);
+	irq_set->index = index;
+	irq_set->start = 0;
+
+	if (fd < 0) {
+		irq_set->flags = VFIO_IRQ_SET_DATA_NONE |
+				 VFIO_IRQ_SET_ACTION_TRIGGER;
+		irq_set->count = 0;
+	} else {
+		irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
+				 VFIO_IRQ_SET_ACTION_TRIGGER;
+		irq_set->count = 1;
+		memcpy(irq_set->data, &fd, sizeof(fd));
+	}
+
+	return ioctl(device, VFIO_DEVICE_SET_IRQS, irq_set);
+}
+
+/*
+ * One reset and recovery as a VMM would do it: tear down interrupts and
+ * DMA, reset, wait for config space to come back, then re-enable an
+ * interrupt and re-map DMA, timing each stage.
+ */
+int reset_and_recover(int container, int device, int irq_index, int efd,
+		      __u64 config_offset, const struct pci_cfg_snapshot *ref,
+		      struct vfio_iommu_type1_dma_map *dma_map,
+		      int (*reset)(int device, void *arg), void *arg,
+		      struct ready_stats *stats)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = dma_map->iova,
+		.size = dma_map->size,
+	};
+	unsigned long long start, t;
+	unsigned int delay = READY_POLL_MIN_US;
+
+	if (irq_index >= 0)
+		set_irq_eventfd(device, irq_index, -1);
+	ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+
+	start = t = now_ns();
+	if (reset(device, arg)) {
+		printf("Reset failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	lat_add(&stats->reset, now_ns() - t);
+
+	t = now_ns();
+	if (wait_config_ready(device, config_offset, ref, &stats->polls)) {
+		printf("Config space not restored after %llu ms\n",
+		       READY_TIMEOUT_NS / 1000000);
+		return -1;
+	}
+	lat_add(&stats->config, now_ns() - t);
+
+	if (irq_index >= 0) {
+		t = now_ns();
+		if (set_irq_eventfd(device, irq_index, efd)) {
+			printf("Failed to re-enable IRQ index %d (%s)\n",
+			       irq_index, strerror(errno));
+			return -1;
+		}
+		lat_add(&stats->irq, now_ns() - t);
+	}
+
+	t = now_ns();
+	while (ioctl(container, VFIO_IOMMU_MAP_DMA, dma_map)) {
+		stats->map_retries++;
+		if (!ready_backoff(t, &delay)) {
+			printf("Failed to re-map DMA (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+	lat_add(&stats->map, now_ns() - t);
+	lat_add(&stats->total, now_ns() - start);
+
+	return 0;
+}
+
+void print_ready_stats(struct ready_stats *stats, int iterations,
+		       const char *method, struct results_phase *phase)
+{
+	struct {
+		const char *name;
+		struct lat_stats *lat;
+	} stages[] = {
+		{ "reset_ioctl", &stats->reset },
+		{ "config_ready", &stats->config },
+		{ "irq_enable", &stats->irq },
+		{ "first_map", &stats->map },
+		{ "total", &stats->total },
+	};
+	char name[64], params[128];
+	int i;
+
+	for (i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+		snprintf(name, sizeof(name), "  %-12s", stages[i].name);
+		lat_print(name, stages[i].lat);
+	}
+
+	printf("  %.1f config polls/reset, %lu map retries\n",
+	       (double)stats->polls / iterations, stats->map_retries);
+
+	snprintf(params, sizeof(params), "\"method\":\"%s\","
+		 "\"iterations\":%d", method, iterations);
+	snprintf(phase->extra, sizeof(phase->extra), "\"polls\":%lu,"
+		 "\"map_retries\":%lu", stats->polls, stats->map_retries);
+
+	for (i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+		snprintf(name, sizeof(name), "ready_%s", stages[i].name);
+		results_phase_end(&results, phase, name, params,
+				  stages[i].lat->count, 0, stages[i].lat, NULL);
+	}
+}
+
+void free_ready_stats(struct ready_stats *stats)
+{
+	lat_free(&stats->reset);
+	lat_free(&stats->config);
+	lat_free(&stats->irq);
+	lat_free(&stats->map);
+	lat_free(&stats->total);
+	memset(stats, 0, sizeof(*stats));
+}
+
+/* Pick an interrupt to re-enable after reset, INTx if it has one */
+int ready_irq_index(int device)
+{
+	struct vfio_irq_info irq_info = {
+		.argsz = sizeof(irq_info),
+	};
+	int index;
+
+	for (index = VFIO_PCI_INTX_IRQ_INDEX;
+	     index <= VFIO_PCI_MSIX_IRQ_INDEX; index++) {
+		irq_info.index = index;
+		if (!ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) &&
+		    irq_info.count && (irq_info.flags & VFIO_IRQ_INFO_EVENTFD))
+			return index;
+	}
+
+	return -1;
+}
+
+int hot_reset(int device, void *arg)
+{
+	return ioctl(device, VFIO_DEVICE_PCI_HOT_RESET, arg);
+}
+
+int device_reset(int device, void *arg)
+{
+	return ioctl(device, VFIO_DEVICE_RESET);
+}
+
+/* Runs iterations of reset_and_recover(), stats are left to the caller */
+int ready_test(int container, int device,
+	       int (*reset)(int device, void *arg), void *arg,
+	       __u64 config_offset, const struct pci_cfg_snapshot *ref,
+	       int iterations, struct ready_stats *stats)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.size = READY_DMA_SIZE,
+		.iova = 0,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.iova = 0,
+		.size = READY_DMA_SIZE,
+	};
+	int i, efd, irq_index, ret = 0;
+	void *buf;
+
+	buf = mmap(NULL, READY_DMA_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to allocate DMA buffer\n");
+		return -1;
+	}
+	dma_map.vaddr = (unsigned long)buf;
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd < 0) {
+		printf("Failed to create eventfd\n");
+		munmap(buf, READY_DMA_SIZE);
+		return -1;
+	}
+
+	irq_index = ready_irq_index(device);
+	if (irq_index < 0)
+		printf("No eventfd capable IRQ, skipping irq stage\n");
+	else
+		printf("Re-enabling IRQ index %d after reset\n", irq_index);
+
+	for (i = 0; i < iterations; i++) {
+		ret = reset_and_recover(container, device, irq_index, efd,
+					config_offset, ref, &dma_map,
+					reset, arg, stats);
+		if (ret)
+			break;
+	}
+
+	if (irq_index >= 0)
+		set_irq_eventfd(device, irq_index, -1);
+	close(efd);
+	/* The last recovery's mapping is still pinning buf */
+	ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	munmap(buf, READY_DMA_SIZE);
+	return ret;
+}
+
+/*
+ * VFIO_DEVICE_RESET (the kernel picks FLR, PM or a bus reset if the
+ * device is alone on its bus) against VFIO_DEVICE_PCI_HOT_RESET of the
+ * same device: what each changes in config space and how long each
+ * takes to get the device usable again.
+ */
+int compare_test(int container, int device, struct vfio_pci_hot_reset *reset,
+		 __u64 config_offset, __u32 config_size, int iterations)
+{
+	struct vfio_device_info device_info = {
+		.argsz = sizeof(device_info)
+	};
+	struct {
+		const char *name;
+		int (*reset)(int device, void *arg);
+		void *arg;
+		int supported;
+		int changed;
+		struct ready_stats stats;
+	} methods[] = {
+		{ "VFIO_DEVICE_RESET", device_reset, NULL },
+		{ "VFIO_DEVICE_PCI_HOT_RESET", hot_reset, reset, 1 },
+	};
+	struct pci_cfg_snapshot before, after;
+	struct results_phase phase;
+	int i, ret = 0;
+
+	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info)) {
+		printf("Failed to get device info\n");
+		return -1;
+	}
+
+	methods[0].supported = !!(device_info.flags & VFIO_DEVICE_FLAGS_RESET);
+
+	for (i = 0; i < 2; i++) {
+		printf("%s: %s\n", methods[i].name,
+		       methods[i].supported ? "supported" : "not supported");
+		if (!methods[i].supported)
+			continue;
+
+		if (pci_cfg_snapshot(device, config_offset,
+				     config_size, &before) ||
+		    methods[i].reset(device, methods[i].arg) ||
+		    pci_cfg_snapshot(device, config_offset,
+				     config_size, &after)) {
+			printf("Failed (%s)\n", strerror(errno));
+			methods[i].supported = 0;
+			ret = -1;
+			continue;
+		}
+
+		methods[i].changed = pci_cfg_diff(&before, &after, 1);
+		printf("%d config dwords changed\n", methods[i].changed);
+
+		results_phase_start(&results, &phase);
+		if (ready_test(container, device, methods[i].reset,
+			       methods[i].arg, config_offset, &before,
+			       iterations, &methods[i].stats)) {
+			methods[i].supported = 0;
+			ret = -1;
+			continue;
+		}
+
+		print_ready_stats(&methods[i].stats, iterations,
+				  methods[i].name, &phase);
+	}
+
+	printf("%-26s %8s %10s %10s %10s %10s\n", "method", "changed",
+	       "ioctl p50", "ioctl p99", "ready p50", "ready p99");
+	for (i = 0; i < 2; i++) {
+		struct ready_stats *stats = &methods[i].stats;
+
+		if (!methods[i].supported)
+			continue;
+
+		printf("%-26s %8d %10llu %10llu %10llu %10llu (us)\n",
+		       methods[i].name, methods[i].changed,
+		       lat_pct(&stats->reset, 50) / 1000,
+		       lat_pct(&stats->reset, 99) / 1000,
+		       lat_pct(&stats->total, 50) / 1000,
+		       lat_pct(&stats->total, 99) / 1000);
+		free_ready_stats(stats);
+	}
+
+	return ret;
 }
 
 #define false 0
 #define true 1
 
+#define MAX_RESET_DEVICES 64
+
+struct reset_device {
+	int groupid, group, device;
+	int seg, bus, devfn;
+	int domain;		/* union-find parent, then domain index */
+	struct vfio_pci_hot_reset_info *info;
+};
+
+struct reset_domain {
+	int device;		/* fd the reset is issued through */
+	int nr_devices;
+	struct vfio_pci_hot_reset *reset;
+	int iterations, failures;
+	struct lat_stats lat;
+	pthread_barrier_t *barrier;
+	pthread_t thread;
+};
+
+/* Returns the info with the dependent device list, NULL on error */
+struct vfio_pci_hot_reset_info *get_reset_info(int device)
+{
+	struct vfio_pci_hot_reset_info *info, *tmp;
+	size_t argsz = sizeof(*info);
+
+	info = malloc(argsz);
+	if (!info)
+		return NULL;
+
+	info->argsz = argsz;
+	if (!ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, info) ||
+	    errno != ENOSPC) {
+		free(info);
+		return NULL;
+	}
+
+	argsz += info->count * sizeof(info->devices[0]);
+	tmp = realloc(info, argsz);
+	if (!tmp) {
+		free(info);
+		return NULL;
+	}
+
+	info = tmp;
+	info->argsz = argsz;
+	if (ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, info)) {
+		free(info);
+		return NULL;
+	}
+
+	return info;
+}
+
+static int domain_find(struct reset_device *devs, int i)
+{
+	while (devs[i].domain != i)
+		i = devs[i].domain = devs[devs[i].domain].domain;
+
+	return i;
+}
+
+int domain_reset(struct reset_domain *domain)
+{
+	unsigned long long t;
+	int ret;
+
+	t = now_ns();
+	ret = ioctl(domain->device, VFIO_DEVICE_PCI_HOT_RESET, domain->reset);
+	t = now_ns() - t;
+
+	if (ret)
+		domain->failures++;
+	else
+		lat_add(&domain->lat, t);
+
+	return ret;
+}
+
+void *domain_reset_thread(void *arg)
+{
+	struct reset_domain *domain = arg;
+	int i;
+
+	pthread_barrier_wait(domain->barrier);
+
+	for (i = 0; i < domain->iterations; i++)
+		domain_reset(domain);
+
+	return NULL;
+}
+
+void print_domain_results(struct reset_domain *domains, int nr_domains,
+			  unsigned long long wall, const char *mode,
+			  struct results_phase *phase)
+{
+	struct lat_stats all = { 0 };
+	unsigned long j;
+	char name[32], params[64];
+	int i, failures = 0;
+
+	for (i = 0; i < nr_domains; i++) {
+		snprintf(name, sizeof(name), "  domain %d", i);
+		lat_print(name, &domains[i].lat);
+		if (domains[i].failures)
+			printf("  domain %d: %d resets FAILED\n",
+			       i, domains[i].failures);
+
+		for (j = 0; j < domains[i].lat.count; j++)
+			lat_add(&all, domains[i].lat.ns[j]);
+		failures += domains[i].failures;
+	}
+
+	lat_print("  all resets", &all);
+	printf("  wall time %llu us\n", wall / 1000);
+
+	snprintf(params, sizeof(params), "\"domains\":%d", nr_domains);
+	snprintf(phase->extra, sizeof(phase->extra), "\"failures\":%d",
+		 failures);
+	results_phase_end(&results, phase, mode, params,
+			  all.count, 0, &all, NULL);
+	lat_free(&all);
+}
+
+/*
+ * Reset many devices as a host maintenance pass would.  Devices are
+ * grouped by the dependent device sets from the hot reset info into
+ * reset domains, each domain is reset through one of its devices with
+ * the fds of every group the domain touches.
+ */
+int multi_reset_test(int iterations, int nr_args, char **args)
+{
+	struct reset_device devs[MAX_RESET_DEVICES];
+	int roots[MAX_RESET_DEVICES];
+	struct reset_domain *domains;
+	struct vfio_group_status group_status = {
+		.argsz = sizeof(group_status)
+	};
+	pthread_barrier_t barrier;
+	int nr_devs = nr_args / 2, nr_domains = 0;
+	int container, ret, i, j, k, iommu_set = 0;
+	unsigned long long wall;
+	struct results_phase phase;
+	char path[PATH_MAX];
+
+	if (nr_devs < 1 || nr_args % 2 || nr_devs > MAX_RESET_DEVICES) {
+		printf("Expected 1 to %d <group> <device> pairs\n",
+		       MAX_RESET_DEVICES);
+		return -1;
+	}
+
+	container = open("/dev/vfio/vfio", O_RDWR);
+	if (container < 0) {
+		printf("Failed to open /dev/vfio/vfio, %d (%s)\n",
+		       container, strerror(errno));
+		return container;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		struct reset_device *d = &devs[i];
+		int dev, func;
+
+		if (sscanf(args[i * 2], "%d", &d->groupid) != 1 ||
+		    sscanf(args[i * 2 + 1], "%04x:%02x:%02x.%d",
+			   &d->seg, &d->bus, &dev, &func) != 4) {
+			printf("Bad group/device %s %s\n",
+			       args[i * 2], args[i * 2 + 1]);
+			return -1;
+		}
+
+		d->devfn = (dev << 3) | func;
+		d->domain = i;
+
+		/* Groups may hold several of the devices, open each once */
+		d->group = -1;
+		for (j = 0; j < i; j++)
+			if (devs[j].groupid == d->groupid)
+				d->group = devs[j].group;
+
+		if (d->group < 0) {
+			snprintf(path, sizeof(path), "/dev/vfio/%d",
+				 d->groupid);
+			d->group = open(path, O_RDWR);
+			if (d->group < 0) {
+				printf("Failed to open %s, %d (%s)\n",
+				       path, d->group, strerror(errno));
+				return -1;
+			}
+
+			ret = ioctl(d->group, VFIO_GROUP_GET_STATUS,
+				    &group_status);
+			if (ret) {
+				printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
+				return ret;
+			}
+
+			if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+				printf("Group %d not viable, are all devices "
+				       "attached to vfio?\n", d->groupid);
+				return -1;
+			}
+
+			ret = ioctl(d->group, VFIO_GROUP_SET_CONTAINER,
+				    &container);
+			if (ret) {
+				printf("Failed to set group container\n");
+				return ret;
+			}
+
+			if (!iommu_set) {
+				ret = ioctl(container, VFIO_SET_IOMMU,
+					    VFIO_TYPE1_IOMMU);
+				if (ret) {
+					printf("Failed to set IOMMU\n");
+					return ret;
+				}
+				results_set_iommu(&results, container,
+						  VFIO_TYPE1_IOMMU);
+				iommu_set = 1;
+			}
+		}
+
+		d->device = ioctl(d->group, VFIO_GROUP_GET_DEVICE_FD,
+				  args[i * 2 + 1]);
+		if (d->device < 0) {
+			printf("Failed to get device %s\n", args[i * 2 + 1]);
+			return -1;
+		}
+
+		d->info = get_reset_info(d->device);
+		if (!d->info) {
+			printf("Device %s does not support hot reset (%s)\n",
+			       args[i * 2 + 1], strerror(errno));
+			return -1;
+		}
+	}
+
+	/* Devices that appear in each other's dependent sets share a domain */
+	for (i = 0; i < nr_devs; i++) {
+		struct vfio_pci_hot_reset_info *info = devs[i].info;
+
+		for (k = 0; k < info->count; k++) {
+			for (j = 0; j < nr_devs; j++) {
+				if (info->devices[k].segment != devs[j].seg ||
+				    info->devices[k].bus != devs[j].bus ||
+				    info->devices[k].devfn != devs[j].devfn)
+					continue;
+
+				devs[domain_find(devs, j)].domain =
+							domain_find(devs, i);
+			}
+		}
+	}
+
+	domains = calloc((size_t)nr_devs, sizeof(*domains));
+	if (!domains) {
+		printf("Failed to alloc domains\n");
+		return -1;
+	}
+
+	/* Number the domains, then point each device at its number */
+	for (i = 0; i < nr_devs; i++) {
+		roots[i] = domain_find(devs, i);
+		if (roots[i] == i)
+			domains[nr_domains++].device = devs[i].device;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		for (j = k = 0; j < roots[i]; j++)
+			k += roots[j] == j;
+		devs[i].domain = k;
+	}
+
+	/*
+	 * The reset needs an fd for every group of every dependent device.
+	 * Only groups we opened can be passed, a domain reaching into any
+	 * other group is reported and will fail.
+	 */
+	for (i = 0; i < nr_domains; i++) {
+		struct reset_domain *domain = &domains[i];
+		int fds[MAX_RESET_DEVICES], nr_fds = 0;
+
+		for (j = 0; j < nr_devs; j++) {
+			struct vfio_pci_hot_reset_info *info = devs[j].info;
+
+			if (devs[j].domain != i)
+				continue;
+
+			domain->nr_devices++;
+
+			for (k = 0; k < info->count; k++) {
+				int g, fd = -1;
+
+				for (g = 0; g < nr_devs; g++)
+					if (devs[g].groupid ==
+					    info->devices[k].group_id)
+						fd = devs[g].group;
+
+				if (fd < 0) {
+					printf("Domain %d: group %d of "
+					       "%04x:%02x:%02x.%d not given\n",
+					       i, info->devices[k].group_id,
+					       info->devices[k].segment,
+					       info->devices[k].bus,
+					       info->devices[k].devfn >> 3,
+					       info->devices[k].devfn & 7);
+					continue;
+				}
+
+				for (g = 0; g < nr_fds && fds[g] != fd; g++)
+					;
+				if (g == nr_fds)
+					fds[nr_fds++] = fd;
+			}
+		}
+
+		domain->reset = malloc(sizeof(*domain->reset) +
+				       nr_fds * sizeof(int));
+		if (!domain->reset) {
+			printf("Failed to alloc reset struct\n");
+			return -1;
+		}
+
+		domain->reset->argsz = sizeof(*domain->reset) +
+				       nr_fds * sizeof(int);
+		domain->reset->flags = 0;
+		domain->reset->count = nr_fds;
+		memcpy(domain->reset->group_fds, fds, nr_fds * sizeof(int));
+		domain->iterations = iterations;
+		domain->barrier = &barrier;
+
+		printf("Domain %d: %d devices, %d groups\n",
+		       i, domain->nr_devices, nr_fds);
+	}
+
+	printf("Serial, %d iterations:\n", iterations);
+	results_phase_start(&results, &phase);
+	wall = now_ns();
+	for (j = 0; j < iterations; j++)
+		for (i = 0; i < nr_domains; i++)
+			domain_reset(&domains[i]);
+	wall = now_ns() - wall;
+	print_domain_results(domains, nr_domains, wall, "serial", &phase);
+
+	for (i = 0; i < nr_domains; i++) {
+		lat_reset(&domains[i].lat);
+		domains[i].failures = 0;
+	}
+
+	printf("Parallel, %d iterations:\n", iterations);
+	pthread_barrier_init(&barrier, NULL, nr_domains + 1);
+	for (i = 0; i < nr_domains; i++) {
+		if (pthread_create(&domains[i].thread, NULL,
+				   domain_reset_thread, &domains[i])) {
+			printf("Failed to create reset thread\n");
+			return -1;
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+	results_phase_start(&results, &phase);
+	wall = now_ns();
+	for (i = 0; i < nr_domains; i++)
+		pthread_join(domains[i].thread, NULL);
+	wall = now_ns() - wall;
+	print_domain_results(domains, nr_domains, wall, "parallel", &phase);
+
+	ret = 0;
+	for (i = 0; i < nr_domains; i++) {
+		if (domains[i].failures)
+			ret = -1;
+		lat_free(&domains[i].lat);
+		free(domains[i].reset);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(domains);
+	for (i = 0; i < nr_devs; i++)
+		free(devs[i].info);
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int i, ret, container, group, device, groupid, *pfd;
@@ -456,12 +1207,43 @@ int main(int argc, char **argv)
 	struct vfio_pci_hot_reset_info *reset_info;
 	struct vfio_pci_dependent_device *devices;
 	struct vfio_pci_hot_reset *reset;
+	struct pci_cfg_snapshot before, after;
+	__u64 config_offset;
+	__u32 config_size;
+	int ready = 0, compare = 0;
+	struct results_phase phase;
+
+	if (results_open(&results, "vfio-pci-hot-reset"))
+		return -1;
+
+	if (argc > 1 && !strcmp(argv[1], "multi")) {
+		int iterations;
+
+		if (argc < 5 || sscanf(argv[2], "%d", &iterations) != 1 ||
+		    iterations <= 0) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		return multi_reset_test(iterations, argc - 3, argv + 3);
+	}
 
 	if (argc < 3) {
 		usage(argv[0]);
 		return -1;
 	}
 
+	if (argc > 3) {
+		int *iterations = !strcmp(argv[3], "ready") ? &ready :
+				  !strcmp(argv[3], "compare") ? &compare : NULL;
+
+		if (!iterations || argc < 5 ||
+		    sscanf(argv[4], "%d", iterations) != 1 || *iterations <= 0) {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
 	ret = sscanf(argv[1], "%d", &groupid);
 	if (ret != 1) {
 		usage(argv[0]);
@@ -515,6 +1297,8 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
+	results_set_iommu(&results, container, VFIO_TYPE1_IOMMU);
+
 	snprintf(path, sizeof(path), "%04x:%02x:%02x.%d", seg, bus, dev, func);
 
 	device = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, path);
@@ -566,6 +1350,15 @@ int main(int argc, char **argv)
 		       devices[i].devfn >> 3, devices[i].devfn & 7,
 		       devices[i].group_id);
 
+	if (pci_cfg_region(device, &config_offset, &config_size) ||
+	    pci_cfg_snapshot(device, config_offset, config_size, &before)) {
+		printf("Failed to snapshot config space (%s)\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	pci_cfg_print_caps(&before);
+
 	printf("Attempting reset: ");
 	fflush(stdout);
 
@@ -578,8 +1371,39 @@ int main(int argc, char **argv)
 	reset->count = 1;
 	reset->flags = 0;
 
+	results_phase_start(&results, &phase);
 	ret = ioctl(device, VFIO_DEVICE_PCI_HOT_RESET, reset);
 	printf("%s\n", ret ? "Failed" : "Pass");
+	if (ret)
+		return ret;
+	results_phase_end(&results, &phase, "hot_reset", "", 1, 0, NULL, NULL);
 
-	return ret;
+	if (pci_cfg_snapshot(device, config_offset, config_size, &after)) {
+		printf("Failed to re-snapshot config space (%s)\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	printf("Config space after reset, read in %llu ns:\n", after.ns);
+	printf("%d dwords changed\n", pci_cfg_diff(&before, &after, 1));
+
+	if (ready) {
+		struct ready_stats stats = { 0 };
+
+		printf("Time to ready, %d iterations:\n", ready);
+		results_phase_start(&results, &phase);
+		ret = ready_test(container, device, hot_reset, reset,
+				 config_offset, &before, ready, &stats);
+		print_ready_stats(&stats, ready, "VFIO_DEVICE_PCI_HOT_RESET",
+				  &phase);
+		free_ready_stats(&stats);
+		if (ret)
+			return ret;
+	}
+
+	if (compare)
+		return compare_test(container, device, reset, config_offset,
+				    config_size, compare);
+
+	return 0;
 }
@@ -0,0 +1,187 @@
+/*
+ * Deferred, batched VFIO_IOMMU_UNMAP_DMA.
+ *
+ * Unmaps are queued as iova ranges instead of being issued, kept sorted
+ * with adjacent and overlapping ranges merged, and flushed as one ioctl
+ * per merged range once the queued bytes reach a watermark or the oldest
+ * queued range has waited long enough.  It's the userspace side of what
+ * the kernel's IOVA flush queue does for the IOTLB: the device can still
+ * reach a queued range until the flush, so a range must not be reused
+ * before unmap_queue_sync() says it's gone.
+ *
+ * Ranges must cover whole mappings, as the merged unmap can only be
+ * split by the IOMMU model where it crosses mappings (TYPE1v2 rejects
+ * partial ones).  A negative container makes the flush a dry run which
+ * only counts the ioctls it would have issued.
+ *
+ * Include after the VFIO uapi definitions and vfio-bench.h.
+ */
+#ifndef VFIO_UNMAP_QUEUE_H
+#define VFIO_UNMAP_QUEUE_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+struct unmap_range {
+	__u64	iova;
+	__u64	size;
+	unsigned long long queued_ns;	/* oldest request merged in */
+};
+
+struct unmap_queue {
+	int	container;
+	int	nr, max;
+	struct unmap_range *ranges;	/* sorted by iova, disjoint */
+	unsigned long long bytes;
+	unsigned long long bytes_max;	/* size watermark */
+	unsigned long long age_max_ns;	/* time watermark, 0 for none */
+	unsigned long long oldest_ns;
+	unsigned long	requests, ioctls, flushes;
+	unsigned long long stale_max_ns;	/* queue to unmap done, worst */
+};
+
+static inline void unmap_queue_init(struct unmap_queue *q, int container,
+				    unsigned long long bytes_max,
+				    unsigned long long age_max_ns)
+{
+	memset(q, 0, sizeof(*q));
+	q->container = container;
+	q->bytes_max = bytes_max;
+	q->age_max_ns = age_max_ns;
+}
+
+/* Issue every queued range, the queue is empty even on failure */
+static inline int unmap_queue_flush(struct unmap_queue *q)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	unsigned long long done;
+	int i, ret = 0;
+
+	for (i = 0; i < q->nr; i++) {
+		dma_unmap.iova = q->ranges[i].iova;
+		dma_unmap.size = q->ranges[i].size;
+
+		q->ioctls++;
+		if (q->container >= 0 &&
+		    (ioctl(q->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+		     dma_unmap.size != q->ranges[i].size))
+			ret = -1;
+
+		done = now_ns();
+		if (done - q->ranges[i].queued_ns > q->stale_max_ns)
+			q->stale_max_ns = done - q->ranges[i].queued_ns;
+	}
+
+	if (q->nr)
+		q->flushes++;
+	q->nr = 0;
+	q->bytes = 0;
+	return ret;
+}
+
+/* Flush if the time watermark has passed, for callers going idle */
+static inline int unmap_queue_poll(struct unmap_queue *q)
+{
+	if (q->nr && q->age_max_ns && now_ns() - q->oldest_ns >= q->age_max_ns)
+		return unmap_queue_flush(q);
+
+	return 0;
+}
+
+static inline int unmap_queue_add(struct unmap_queue *q, __u64 iova,
+				  __u64 size)
+{
+	unsigned long long now = now_ns();
+	__u64 end = iova + size;
+	int lo = 0, hi, i, n;
+
+	q->requests++;
+
+	/* First range ending at or after iova, it may merge */
+	hi = q->nr;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (q->ranges[i].iova + q->ranges[i].size < iova)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	/* Swallow every range touching [iova, end) */
+	for (n = 0; lo + n < q->nr && q->ranges[lo + n].iova <= end; n++) {
+		struct unmap_range *r = &q->ranges[lo + n];
+
+		if (r->iova < iova)
+			iova = r->iova;
+		if (r->iova + r->size > end)
+			end = r->iova + r->size;
+		if (r->queued_ns < now)
+			now = r->queued_ns;
+		q->bytes -= r->size;
+	}
+
+	if (!n) {
+		if (q->nr == q->max) {
+			int max = q->max ? q->max * 2 : 64;
+			struct unmap_range *tmp;
+
+			tmp = realloc(q->ranges, max * sizeof(*tmp));
+			if (!tmp) {
+				errno = ENOMEM;
+				return -1;
+			}
+
+			q->ranges = tmp;
+			q->max = max;
+		}
+
+		memmove(&q->ranges[lo + 1], &q->ranges[lo],
+			(q->nr - lo) * sizeof(*q->ranges));
+		q->nr++;
+	} else if (n > 1) {
+		memmove(&q->ranges[lo + 1], &q->ranges[lo + n],
+			(q->nr - lo - n) * sizeof(*q->ranges));
+		q->nr -= n - 1;
+	}
+
+	q->ranges[lo].iova = iova;
+	q->ranges[lo].size = end - iova;
+	q->ranges[lo].queued_ns = now;
+	q->bytes += end - iova;
+
+	/* A merged range keeps its oldest time, only a lone one moves this */
+	if (q->nr == 1)
+		q->oldest_ns = q->ranges[0].queued_ns;
+
+	if (q->bytes >= q->bytes_max)
+		return unmap_queue_flush(q);
+
+	return unmap_queue_poll(q);
+}
+
+/* Flush before mapping anything over [iova, iova + size) again */
+static inline int unmap_queue_sync(struct unmap_queue *q, __u64 iova,
+				   __u64 size)
+{
+	int i;
+
+	for (i = 0; i < q->nr; i++)
+		if (q->ranges[i].iova < iova + size &&
+		    iova < q->ranges[i].iova + q->ranges[i].size)
+			return unmap_queue_flush(q);
+
+	return 0;
+}
+
+static inline void unmap_queue_free(struct unmap_queue *q)
+{
+	free(q->ranges);
+	q->ranges = NULL;
+	q->nr = q->max = 0;
+}
+
+#endif /* VFIO_UNMAP_QUEUE_H */